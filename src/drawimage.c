@@ -3,10 +3,17 @@
 #include <string.h>
 #include <math.h>
 #include "wlqpersistence.h"
+#include "selection.h"
 
 
 enum {
     UNDO_MAX = 1000,
+    PICKBUFFER_PIXELS_MAX = 16 * 1024 * 1024,
+    PICKBUFFER_SHAPES_MAX = 0xffffff,
+    CAPTURE_PIXELS_MAX = 16 * 1024 * 1024,
+    CULL_MARGIN = 8,    /* selection marks drawn outside of shape bounds */
+    DIRTY_RECTS_MAX = 64,
+    BASE_IMAGE_LEVEL_MAX = 8
 };
 
 enum StateModification {
@@ -36,10 +43,20 @@ typedef struct {
     gdouble imgXRef, imgYRef;
     GdkRGBA imgBgColor;
     cairo_surface_t *baseImage;
+    gboolean isBaseImageJpeg;   /* base image was decoded from JPEG */
     Shape **shapes;
     int shapeCount;
 } DrawImageState;
 
+struct DrawImageSnapshot {
+    DrawImageState state;
+    Selection *selection;
+    gint curShapeIdx;
+    gboolean isFast;
+    /* base image halved repeatedly, NULL terminated */
+    cairo_surface_t *baseImageLevels[BASE_IMAGE_LEVEL_MAX + 1];
+};
+
 struct DrawImage {
     DrawImageState states[UNDO_MAX];
     gint stateFirst, stateCur, stateLast;
@@ -48,10 +65,31 @@ struct DrawImage {
     enum ShapeCorner dragShapeCorner;
     guint nextStateId;
     guint savedStateId;
-    GHashTable *selection;
-    GHashTable *addedByRectSel;
+    Selection *selection;
+    Selection *addedByRectSel;
     gdouble selXBeg, selYBeg;
+    gdouble freeformTolerance;
     cairo_surface_t *preview;
+    guint changeSerial;             /* incremented on every image change */
+    gboolean isPickBufferEnabled;
+    cairo_surface_t *pickBuffer;    /* shape index + 1 as pixel color */
+    guint pickBufferSerial;         /* changeSerial of pickBuffer contents */
+    gdouble pickBufferZoom;
+    gdouble pickBufferScale;        /* may be less than zoom for big images */
+
+    /* freeform stroke capture, see di_drawCapture */
+    cairo_surface_t *captureBase;       /* image without the captured shape */
+    cairo_surface_t *captureOverlay;    /* captured shape path */
+    const Shape *captureShape;
+    gint captureStateIdx;
+    gdouble captureZoom;
+    gint captureX, captureY, captureWidth, captureHeight;
+    gint captureStrokedCount;           /* path points on overlay */
+
+    /* image area changed since last di_takeDirtyRegion */
+    cairo_region_t *dirtyRegion;
+    gboolean isAllDirty;
+    gboolean isSelectionDirty;      /* add selected shapes on take */
 };
 
 DrawImage *di_new(gint imgWidth, gint imgHeight, const GdkPixbuf *baseImage)
@@ -72,6 +110,7 @@ DrawImage *di_new(gint imgWidth, gint imgHeight, const GdkPixbuf *baseImage)
         cairo_destroy(cr);
     }else
         di->states[0].baseImage = NULL;
+    di->states[0].isBaseImageJpeg = FALSE;
     di->states[0].imgBgColor.red = 1.0;
     di->states[0].imgBgColor.green = 1.0;
     di->states[0].imgBgColor.blue = 1.0;
@@ -86,11 +125,24 @@ DrawImage *di_new(gint imgWidth, gint imgHeight, const GdkPixbuf *baseImage)
     di->dragShapeCorner = SC_NONE;
     di->nextStateId = 1;
     di->savedStateId = 0;
-    di->selection = g_hash_table_new(NULL, NULL);
-    di->addedByRectSel = g_hash_table_new(NULL, NULL);
+    di->selection = sel_new();
+    di->addedByRectSel = sel_new();
     di->selXBeg = 0;
     di->selYBeg = 0;
+    di->freeformTolerance = 0;
     di->preview = NULL;
+    di->changeSerial = 0;
+    di->isPickBufferEnabled = FALSE;
+    di->pickBuffer = NULL;
+    di->pickBufferSerial = 0;
+    di->pickBufferZoom = 0;
+    di->pickBufferScale = 0;
+    di->captureBase = NULL;
+    di->captureOverlay = NULL;
+    di->captureShape = NULL;
+    di->dirtyRegion = cairo_region_create();
+    di->isAllDirty = TRUE;
+    di->isSelectionDirty = FALSE;
     return di;
 }
 
@@ -112,6 +164,52 @@ static void freeStates(DrawImageState *states, int first, int last)
     freeState(states + first);
 }
 
+static void markShapeDirty(DrawImage *di, gint shapeIdx)
+{
+    const DrawImageState *state = di->states + di->stateCur;
+    gdouble x1, y1, x2, y2;
+    cairo_rectangle_int_t rect;
+
+    shape_getBounds(state->shapes[shapeIdx], &x1, &y1, &x2, &y2);
+    x1 += state->imgXRef;
+    y1 += state->imgYRef;
+    x2 += state->imgXRef;
+    y2 += state->imgYRef;
+    if( fmin(x1, y1) < -G_MAXINT16 || fmax(x2, y2) > G_MAXINT16 ) {
+        di->isAllDirty = TRUE;
+        return;
+    }
+    rect.x = floor(x1);
+    rect.y = floor(y1);
+    rect.width = ceil(x2) - rect.x;
+    rect.height = ceil(y2) - rect.y;
+    cairo_region_union_rectangle(di->dirtyRegion, &rect);
+    if( cairo_region_num_rectangles(di->dirtyRegion) > DIRTY_RECTS_MAX ) {
+        cairo_region_get_extents(di->dirtyRegion, &rect);
+        cairo_region_destroy(di->dirtyRegion);
+        di->dirtyRegion = cairo_region_create_rectangle(&rect);
+    }
+}
+
+/* Marks area of selected shapes as changed, before the selection or the
+ * shapes are modified. The area is marked again by di_takeDirtyRegion,
+ * after modification.
+ */
+static void markSelectionDirty(DrawImage *di)
+{
+    gint shapeIdx;
+
+    if( di->isAllDirty )
+        return;
+    for(shapeIdx = sel_next(di->selection, 0); shapeIdx >= 0
+            && ! di->isAllDirty;
+            shapeIdx = sel_next(di->selection, shapeIdx + 1))
+        markShapeDirty(di, shapeIdx);
+    if( di->curShapeIdx >= 0 && ! di->isAllDirty )
+        markShapeDirty(di, di->curShapeIdx);
+    di->isSelectionDirty = TRUE;
+}
+
 static DrawImageState *getStateForModify(DrawImage *di,
         enum StateModification smod)
 {
@@ -120,6 +218,20 @@ static DrawImageState *getStateForModify(DrawImage *di,
 
     cur = di->states + di->stateCur;
     g_assert_cmpint(di->curShapeIdx, <, cur->shapeCount);
+    ++di->changeSerial;
+    switch( smod ) {
+    case SM_SHAPE_LAYOUT_NEW:
+    case SM_SHAPE_LAYOUT:
+    case SM_SHAPE_ZORDER:
+    case SM_SEL_DRAG:
+    case SM_SEL_PARAM:
+    case SM_SEL_DELETE:
+        markSelectionDirty(di);
+        break;
+    default:
+        di->isAllDirty = TRUE;
+        break;
+    }
     if( smod != di->curStateModification ) {
         prev = cur;
         i = di->stateCur;
@@ -144,14 +256,17 @@ static DrawImageState *getStateForModify(DrawImage *di,
             cur->baseImage = cairo_surface_reference(prev->baseImage);
         else
             cur->baseImage = NULL;
+        cur->isBaseImageJpeg = prev->isBaseImageJpeg;
         cur->shapes = g_malloc(prev->shapeCount * sizeof(Shape*));
         gboolean isModSel = smod == SM_SEL_DRAG || smod == SM_SEL_PARAM
             || smod == SM_SEL_DELETE;
         for(i = 0; i < prev->shapeCount; ++i) {
             cur->shapes[i] = prev->shapes[i];
             shape_ref(cur->shapes[i]);
-            if( isModSel && g_hash_table_contains(di->selection,
-                        GINT_TO_POINTER(i)) )
+        }
+        if( isModSel ) {
+            for(i = sel_next(di->selection, 0); i >= 0;
+                    i = sel_next(di->selection, i + 1))
                 shape_replaceDup(cur->shapes + i);
         }
         if( smod == SM_SHAPE_LAYOUT )
@@ -162,17 +277,14 @@ static DrawImageState *getStateForModify(DrawImage *di,
     return cur;
 }
 
-DrawImage *di_openWLQ(const char *fileName, gchar **errLoc,
-        gboolean *isNoEntErr)
+static DrawImage *readImage(WlqInFile *inFile, gchar **errLoc)
 {
     static cairo_user_data_key_t dataKey;
-    WlqInFile *inFile;
+    const char *fileName = wlq_getInFileName(inFile);
     unsigned imgWidth, imgHeight, imgStride, shapeCount;
-    DrawImage *di;
+    DrawImage *di = NULL;
     DrawImageState *state;
 
-    if( (inFile = wlq_openIn(fileName, errLoc, isNoEntErr)) == NULL )
-        return NULL;
     if( wlq_readU32(inFile, &imgWidth, errLoc)
             && wlq_readU32(inFile, &imgHeight, errLoc) )
     {
@@ -228,8 +340,32 @@ DrawImage *di_openWLQ(const char *fileName, gchar **errLoc,
             di = NULL;
         }
     }
+    return di;
+}
+
+DrawImage *di_openWLQ(const char *fileName, gchar **errLoc,
+        gboolean *isNoEntErr)
+{
+    WlqInFile *inFile;
+    DrawImage *di;
+
+    if( (inFile = wlq_openIn(fileName, errLoc, isNoEntErr)) == NULL )
+        return NULL;
+    di = readImage(inFile, errLoc);
+    wlq_closeIn(inFile);
+    return di;
+}
+
+DrawImage *di_openWLQStream(GInputStream *inStrm, const char *name,
+        gchar **errLoc)
+{
+    WlqInFile *inFile;
+    DrawImage *di;
+
+    if( (inFile = wlq_openInStream(inStrm, name, errLoc)) == NULL )
+        return NULL;
+    di = readImage(inFile, errLoc);
     wlq_closeIn(inFile);
-    *isNoEntErr = FALSE;
     return di;
 }
 
@@ -280,6 +416,8 @@ void di_addShape(DrawImage *di, ShapeType shapeType,
     state = getStateForModify(di, SM_SHAPE_LAYOUT_NEW);
     shape = shape_new(shapeType, xRef - state->imgXRef, yRef - state->imgYRef,
             shapeParams);
+    if( shapeType == ST_FREEFORM )
+        shape_setPathTolerance(shape, di->freeformTolerance);
     di->curShapeIdx = state->shapeCount;
     state->shapes = g_realloc(state->shapes,
             ++state->shapeCount * sizeof(Shape*));
@@ -292,12 +430,17 @@ void di_addShape(DrawImage *di, ShapeType shapeType,
     state->shapes[di->curShapeIdx] = shape;
     di->selXBeg = xRef;
     di->selYBeg = yRef;
-    g_hash_table_remove_all(di->selection);
+    sel_clear(di->selection);
+}
+
+void di_setFreeformTolerance(DrawImage *di, gdouble tolerance)
+{
+    di->freeformTolerance = tolerance;
 }
 
 gboolean di_isSelectionEmpty(const DrawImage *di)
 {
-    return g_hash_table_size(di->selection) == 0;
+    return sel_isEmpty(di->selection);
 }
 
 static Shape *curShape(const DrawImage *di)
@@ -325,14 +468,14 @@ void di_curShapeRaise(DrawImage *di)
     DrawImageState *state = di->states + di->stateCur;
     if( di->curShapeIdx >= 0 && di->curShapeIdx + 1 < state->shapeCount ) {
         state = getStateForModify(di, SM_SHAPE_ZORDER);
-        g_hash_table_remove(di->selection, GINT_TO_POINTER(di->curShapeIdx));
+        sel_move(di->selection, di->curShapeIdx, state->shapeCount - 1);
         shape = state->shapes[di->curShapeIdx];
         while( di->curShapeIdx + 1 < state->shapeCount ) {
             state->shapes[di->curShapeIdx] = state->shapes[di->curShapeIdx+1];
             ++di->curShapeIdx;
         }
         state->shapes[di->curShapeIdx] = shape;
-        g_hash_table_add(di->selection, GINT_TO_POINTER(di->curShapeIdx));
+        sel_add(di->selection, di->curShapeIdx);
     }
 }
 
@@ -343,14 +486,14 @@ void di_curShapeSink(DrawImage *di)
     DrawImageState *state = di->states + di->stateCur;
     if( di->curShapeIdx > 0 ) {
         state = getStateForModify(di, SM_SHAPE_ZORDER);
-        g_hash_table_remove(di->selection, GINT_TO_POINTER(di->curShapeIdx));
+        sel_move(di->selection, di->curShapeIdx, 0);
         shape = state->shapes[di->curShapeIdx];
         while( di->curShapeIdx > 0 ) {
             state->shapes[di->curShapeIdx] = state->shapes[di->curShapeIdx-1];
             --di->curShapeIdx;
         }
         state->shapes[di->curShapeIdx] = shape;
-        g_hash_table_add(di->selection, GINT_TO_POINTER(di->curShapeIdx));
+        sel_add(di->selection, di->curShapeIdx);
     }
 }
 
@@ -361,8 +504,10 @@ void di_undo(DrawImage *di)
             di->stateCur = UNDO_MAX - 1;
         else
             --di->stateCur;
+        ++di->changeSerial;
+        di->isAllDirty = TRUE;
         di->curShapeIdx = -1;
-        g_hash_table_remove_all(di->selection);
+        sel_clear(di->selection);
         di->curStateModification = SM_UNDO_REDO;
     }
 }
@@ -372,48 +517,133 @@ void di_redo(DrawImage *di)
     if( di->stateCur != di->stateLast ) {
         if( ++di->stateCur == UNDO_MAX )
             di->stateCur = 0;
+        ++di->changeSerial;
+        di->isAllDirty = TRUE;
         di->curShapeIdx = -1;
-        g_hash_table_remove_all(di->selection);
+        sel_clear(di->selection);
         di->curStateModification = SM_UNDO_REDO;
     }
 }
 
+void di_setPickBufferEnabled(DrawImage *di, gboolean enable)
+{
+    di->isPickBufferEnabled = enable;
+    if( ! enable && di->pickBuffer != NULL ) {
+        cairo_surface_destroy(di->pickBuffer);
+        di->pickBuffer = NULL;
+    }
+}
+
+/* Draws all shapes on pick buffer, each one using its index + 1 as color.
+ */
+static void updatePickBuffer(DrawImage *di, gdouble zoom)
+{
+    const DrawImageState *state = di->states + di->stateCur;
+    gdouble scale = zoom, pixels;
+    gint width, height, i;
+    guint32 shapeId;
+    cairo_t *cr;
+
+    if( di->pickBuffer != NULL && di->pickBufferSerial == di->changeSerial
+            && di->pickBufferZoom == zoom )
+        return;
+    pixels = state->imgWidth * zoom * state->imgHeight * zoom;
+    if( pixels > PICKBUFFER_PIXELS_MAX )
+        scale *= sqrt(PICKBUFFER_PIXELS_MAX / pixels);
+    width = MAX(ceil(state->imgWidth * scale), 1);
+    height = MAX(ceil(state->imgHeight * scale), 1);
+    if( di->pickBuffer != NULL
+            && (cairo_image_surface_get_width(di->pickBuffer) != width
+            || cairo_image_surface_get_height(di->pickBuffer) != height) )
+    {
+        cairo_surface_destroy(di->pickBuffer);
+        di->pickBuffer = NULL;
+    }
+    if( di->pickBuffer == NULL )
+        di->pickBuffer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                width, height);
+    cr = cairo_create(di->pickBuffer);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+    cairo_translate(cr, scale * state->imgXRef, scale * state->imgYRef);
+    for(i = 0; i < state->shapeCount; ++i) {
+        shapeId = i + 1;
+        cairo_set_source_rgb(cr, (shapeId >> 16) / 255.0,
+                (shapeId >> 8 & 0xff) / 255.0, (shapeId & 0xff) / 255.0);
+        shape_drawForPick(state->shapes[i], cr, scale);
+    }
+    cairo_destroy(cr);
+    di->pickBufferSerial = di->changeSerial;
+    di->pickBufferZoom = zoom;
+    di->pickBufferScale = scale;
+}
+
+/* Returns index of the topmost shape drawn at the point, -1 for none.
+ */
+static gint pickShape(DrawImage *di, gdouble x, gdouble y, gdouble zoom)
+{
+    const unsigned char *data;
+    gint xPix, yPix, shapeIdx;
+
+    updatePickBuffer(di, zoom);
+    xPix = floor(x * di->pickBufferScale);
+    yPix = floor(y * di->pickBufferScale);
+    if( xPix < 0 || xPix >= cairo_image_surface_get_width(di->pickBuffer)
+            || yPix < 0
+            || yPix >= cairo_image_surface_get_height(di->pickBuffer) )
+        return -1;
+    cairo_surface_flush(di->pickBuffer);
+    data = cairo_image_surface_get_data(di->pickBuffer)
+        + yPix * cairo_image_surface_get_stride(di->pickBuffer);
+    shapeIdx = (((const guint32*)data)[xPix] & 0xffffff) - 1;
+    return shapeIdx < di->states[di->stateCur].shapeCount ? shapeIdx : -1;
+}
+
 gboolean di_curShapeFromPoint(DrawImage *di, gdouble x, gdouble y,
         gdouble zoom, gboolean extendSel)
 {
     DrawImageState *state = di->states + di->stateCur;
-    int shapeIdx;
-    gpointer idxAsPtr;
-    enum ShapeCorner corner;
-
-    g_hash_table_remove_all(di->addedByRectSel);
+    int shapeIdx, pickedIdx = -1;
+    gboolean usePickBuffer;
+    enum ShapeCorner corner = SC_NONE;
+
+    markSelectionDirty(di);
+    sel_clear(di->addedByRectSel);
+    /* corner marks are drawn on the current shape only, when selected */
+    shapeIdx = di->curShapeIdx;
+    if( shapeIdx >= 0 && sel_contains(di->selection, shapeIdx) )
+        corner = shape_cornerHitTest(state->shapes[shapeIdx],
+                x - state->imgXRef, y - state->imgYRef, zoom);
     if( ! extendSel )
-        g_hash_table_remove_all(di->selection);
+        sel_clear(di->selection);
     di->curShapeIdx = -1;
     di->curStateModification = SM_SELECTION_MARK;
     di->selXBeg = x;
     di->selYBeg = y;
+    if( corner != SC_NONE ) {
+        di->curShapeIdx = shapeIdx;
+        sel_add(di->selection, shapeIdx);
+        if( ! extendSel ) {
+            di->curStateModification = SM_SHAPESIDE_MARK;
+            di->dragShapeCorner = corner;
+        }
+        return TRUE;
+    }
+    usePickBuffer = di->isPickBufferEnabled
+        && state->shapeCount <= PICKBUFFER_SHAPES_MAX;
+    if( usePickBuffer )
+        pickedIdx = pickShape(di, x, y, zoom);
     shapeIdx = state->shapeCount - 1;
     while( shapeIdx >= 0 && di->curShapeIdx == -1 ) {
-        if( (corner = shape_cornerHitTest(state->shapes[shapeIdx],
-                x - state->imgXRef, y - state->imgYRef, zoom)) != SC_NONE )
-        {
-            di->curShapeIdx = shapeIdx;
-            idxAsPtr = GINT_TO_POINTER(shapeIdx);
-            if( ! g_hash_table_contains(di->selection, idxAsPtr) )
-                g_hash_table_add(di->selection, idxAsPtr);
-            if( ! extendSel ) {
-                di->curStateModification = SM_SHAPESIDE_MARK;
-                di->dragShapeCorner = corner;
-            }
-        }else if( shape_hitTest(state->shapes[shapeIdx],
+        if( usePickBuffer ? shapeIdx == pickedIdx :
+                shape_hitTest(state->shapes[shapeIdx],
                 x - state->imgXRef, y - state->imgYRef,
                 x - state->imgXRef, y - state->imgYRef) )
         {
             di->curShapeIdx = shapeIdx;
-            idxAsPtr = GINT_TO_POINTER(shapeIdx);
-            if( ! g_hash_table_contains(di->selection, idxAsPtr) )
-                g_hash_table_add(di->selection, idxAsPtr);
+            sel_add(di->selection, shapeIdx);
         }
         --shapeIdx;
     }
@@ -427,26 +657,23 @@ void di_selectionFromPoint(DrawImage *di, gdouble x, gdouble y,
 {
     DrawImageState *state = di->states + di->stateCur;
     int shapeIdx;
-    gpointer idxAsPtr;
 
-    g_hash_table_remove_all(di->addedByRectSel);
+    markSelectionDirty(di);
+    sel_clear(di->addedByRectSel);
     if( ! extend )
-        g_hash_table_remove_all(di->selection);
+        sel_clear(di->selection);
     di->curShapeIdx = -1;
     di->curStateModification = SM_SELECTION_MARK;
     di->selXBeg = x;
     di->selYBeg = y;
     for( shapeIdx = state->shapeCount - 1; shapeIdx >= 0; --shapeIdx ) {
-        idxAsPtr = GINT_TO_POINTER(shapeIdx);
-        if( ! g_hash_table_contains(di->selection, idxAsPtr)
+        if( ! sel_contains(di->selection, shapeIdx)
             && shape_hitTest(state->shapes[shapeIdx],
                 x - state->imgXRef, y - state->imgYRef,
                 x - state->imgXRef, y - state->imgYRef) )
-        {
-            g_hash_table_add(di->addedByRectSel, idxAsPtr);
-            g_hash_table_add(di->selection, idxAsPtr);
-        }
+            sel_add(di->addedByRectSel, shapeIdx);
     }
+    sel_addSet(di->selection, di->addedByRectSel);
 }
 
 /* Extends rectangle area selection started by di_selectionFromPoint.
@@ -455,49 +682,39 @@ void di_selectionFromRect(DrawImage *di, gdouble x, gdouble y)
 {
     DrawImageState *state = di->states + di->stateCur;
     int shapeIdx;
-    GHashTableIter iter;
-    gpointer idxAsPtr;
 
     g_assert_cmpint(di->curStateModification, ==, SM_SELECTION_MARK);
-    g_hash_table_iter_init(&iter, di->addedByRectSel);
-    while( g_hash_table_iter_next(&iter, &idxAsPtr, NULL) )
-        g_hash_table_remove(di->selection, idxAsPtr);
-    g_hash_table_remove_all(di->addedByRectSel);
+    markSelectionDirty(di);
+    sel_removeSet(di->selection, di->addedByRectSel);
+    sel_clear(di->addedByRectSel);
     for(shapeIdx = 0; shapeIdx < state->shapeCount; ++shapeIdx) {
-        idxAsPtr = GINT_TO_POINTER(shapeIdx);
-        if( ! g_hash_table_contains(di->selection, idxAsPtr)
+        if( ! sel_contains(di->selection, shapeIdx)
             && shape_hitTest(state->shapes[shapeIdx],
                 di->selXBeg - state->imgXRef, di->selYBeg - state->imgYRef,
                 x - state->imgXRef, y - state->imgYRef) )
-        {
-            g_hash_table_add(di->addedByRectSel, idxAsPtr);
-            g_hash_table_add(di->selection, idxAsPtr);
-        }
+            sel_add(di->addedByRectSel, shapeIdx);
     }
+    sel_addSet(di->selection, di->addedByRectSel);
 }
 
 void di_setSelectionParam(DrawImage *di, enum ShapeParam shapeParam,
         const ShapeParams *shapeParams)
 {
-    GHashTableIter iter;
-    gpointer key;
+    gint shapeIdx;
 
-    if( g_hash_table_size(di->selection) > 0 ) {
+    if( ! sel_isEmpty(di->selection) ) {
         DrawImageState *state = getStateForModify(di, SM_SEL_PARAM);
-        g_hash_table_iter_init(&iter, di->selection);
-        while( g_hash_table_iter_next(&iter, &key, NULL) ) {
-            gint shapeIdx = GPOINTER_TO_INT(key);
+        for(shapeIdx = sel_next(di->selection, 0); shapeIdx >= 0;
+                shapeIdx = sel_next(di->selection, shapeIdx + 1))
             shape_setParam(state->shapes[shapeIdx], shapeParam, shapeParams);
-        }
     }
 }
 
 void di_selectionDragTo(DrawImage *di, gdouble x, gdouble y, gboolean even)
 {
-    GHashTableIter iter;
-    gpointer key;
     DrawImageState *state, *stPrev;
     gdouble mvX, mvY;
+    gint shapeIdx;
 
     switch( di->curStateModification ) {
     case SM_SHAPE_LAYOUT_NEW:
@@ -515,11 +732,10 @@ void di_selectionDragTo(DrawImage *di, gdouble x, gdouble y, gboolean even)
         break;
     case SM_SELECTION_MARK:
     case SM_SEL_DRAG:
-        if( g_hash_table_size(di->selection) > 0 ) {
+        if( ! sel_isEmpty(di->selection) ) {
             state = getStateForModify(di, SM_SEL_DRAG);
             stPrev = di->states
                     + (di->stateCur == 0 ? UNDO_MAX : di->stateCur) - 1;
-            g_hash_table_iter_init(&iter, di->selection);
             mvX = x - di->selXBeg;
             mvY = y - di->selYBeg;
             if( even ) {
@@ -528,11 +744,10 @@ void di_selectionDragTo(DrawImage *di, gdouble x, gdouble y, gboolean even)
                 else
                     mvX = 0;
             }
-            while( g_hash_table_iter_next(&iter, &key, NULL) ) {
-                gint shapeIdx = GPOINTER_TO_INT(key);
+            for(shapeIdx = sel_next(di->selection, 0); shapeIdx >= 0;
+                    shapeIdx = sel_next(di->selection, shapeIdx + 1))
                 shape_move(state->shapes[shapeIdx],
                         stPrev->shapes[shapeIdx], mvX, mvY);
-            }
         }
         break;
     default:
@@ -544,12 +759,11 @@ void di_selectionDragTo(DrawImage *di, gdouble x, gdouble y, gboolean even)
 
 gboolean di_selectionDelete(DrawImage *di)
 {
-
-    if( g_hash_table_size(di->selection) >= 0 ) {
+    if( ! sel_isEmpty(di->selection) ) {
         int src, dest = 0;
         DrawImageState *state = getStateForModify(di, SM_SEL_DELETE);
         for(src = 0; src < state->shapeCount; ++src) {
-            if( g_hash_table_contains(di->selection, GINT_TO_POINTER(src)) ) {
+            if( sel_contains(di->selection, src) ) {
                 shape_unref(state->shapes[src]);
             }else{
                 if( dest != src )
@@ -559,7 +773,7 @@ gboolean di_selectionDelete(DrawImage *di)
         }
         state->shapeCount = dest;
         di->curShapeIdx = -1;
-        g_hash_table_remove_all(di->selection);
+        sel_clear(di->selection);
         return TRUE;
     }
     return FALSE;
@@ -567,19 +781,53 @@ gboolean di_selectionDelete(DrawImage *di)
 
 gboolean di_selectionSetEmpty(DrawImage *di)
 {
-    gboolean wasEmpty = g_hash_table_size(di->selection) == 0;
+    gboolean wasEmpty = sel_isEmpty(di->selection);
 
+    markSelectionDirty(di);
     if( ! wasEmpty )
-        g_hash_table_remove_all(di->selection);
+        sel_clear(di->selection);
     di->curShapeIdx = -1;
     return ! wasEmpty;
 }
 
-void di_scale(DrawImage *di, gdouble factor)
+gboolean di_selectAll(DrawImage *di)
+{
+    const DrawImageState *state = di->states + di->stateCur;
+
+    markSelectionDirty(di);
+    sel_clear(di->selection);
+    sel_addRange(di->selection, 0, state->shapeCount);
+    di->curShapeIdx = -1;
+    di->curStateModification = SM_SELECTION_MARK;
+    return state->shapeCount > 0;
+}
+
+gboolean di_scale(DrawImage *di, gdouble factor, ImageScaleFilter filter,
+        gchar **errLoc)
 {
     int i;
-    DrawImageState *state = getStateForModify(di, SM_IMAGE_SCALE);
+    DrawImageState *state = di->states + di->stateCur;
+    cairo_surface_t *newImage = NULL;
+    cairo_status_t status;
 
+    /* the base image is scaled first, to leave the state intact when
+     * it fails */
+    if( state->baseImage != NULL ) {
+        gint imgWidth = fmax(round(cairo_image_surface_get_width(
+                        state->baseImage) * factor), 1);
+        gint imgHeight = fmax(round(cairo_image_surface_get_height(
+                        state->baseImage) * factor), 1);
+        newImage = imgscale_scale(state->baseImage, imgWidth, imgHeight,
+                filter);
+        status = cairo_surface_status(newImage);
+        if( status != CAIRO_STATUS_SUCCESS ) {
+            cairo_surface_destroy(newImage);
+            *errLoc = g_strdup_printf("unable to scale base image: %s",
+                    cairo_status_to_string(status));
+            return FALSE;
+        }
+    }
+    state = getStateForModify(di, SM_IMAGE_SCALE);
     for(i = 0; i < state->shapeCount; ++i) {
         Shape *shape = shape_replaceDup(state->shapes + i);
         shape_scale(shape, factor);
@@ -588,22 +836,12 @@ void di_scale(DrawImage *di, gdouble factor)
     state->imgYRef *= factor;
     state->imgWidth = round(state->imgWidth * factor);
     state->imgHeight = round(state->imgHeight * factor);
-    if( state->baseImage != NULL ) {
-        gint imgWidth = fmax(round(cairo_image_surface_get_width(
-                        state->baseImage) * factor), 1);
-        gint imgHeight = fmax(round(cairo_image_surface_get_height(
-                        state->baseImage) * factor), 1);
-        cairo_surface_t *newImage = cairo_image_surface_create(
-                CAIRO_FORMAT_ARGB32, imgWidth, imgHeight);
-        cairo_t *cr = cairo_create(newImage);
-        cairo_scale(cr, factor, factor);
-        cairo_set_source_surface(cr, state->baseImage, 0, 0);
-        cairo_paint(cr);
-        cairo_destroy(cr);
+    if( newImage != NULL ) {
         cairo_surface_destroy(state->baseImage);
         state->baseImage = newImage;
     }
-    g_hash_table_remove_all(di->selection);
+    sel_clear(di->selection);
+    return TRUE;
 }
 
 void di_moveTo(DrawImage *di, gdouble imgXRef, gdouble imgYRef)
@@ -611,7 +849,7 @@ void di_moveTo(DrawImage *di, gdouble imgXRef, gdouble imgYRef)
     DrawImageState *state = getStateForModify(di, SM_IMAGE_SIZE);
     state->imgXRef = imgXRef;
     state->imgYRef = imgYRef;
-    g_hash_table_remove_all(di->selection);
+    sel_clear(di->selection);
 }
 
 void di_setSize(DrawImage *di, gint imgWidth, gint imgHeight,
@@ -622,17 +860,53 @@ void di_setSize(DrawImage *di, gint imgWidth, gint imgHeight,
     state->imgYRef += translateYfactor * (imgHeight - state->imgHeight);
     state->imgWidth = imgWidth;
     state->imgHeight = imgHeight;
-    g_hash_table_remove_all(di->selection);
+    sel_clear(di->selection);
 }
 
-void di_draw(const DrawImage *di, cairo_t *cr, gdouble zoom)
+/* Paints the base image using the smallest of base image levels which is
+ * not smaller than the image at the zoom. The cairo context is scaled
+ * by zoom.
+ */
+static void paintBaseImageLevel(const DrawImageState *state,
+        cairo_surface_t *const *baseImageLevels, cairo_t *cr, gdouble zoom)
 {
-    cairo_matrix_t matrix;
-    double xBeg, yBeg;
-    const DrawImageState *state = di->states + di->stateCur;
+    cairo_surface_t *level = state->baseImage;
+    gint i, levelWidth, levelHeight;
+
+    for(i = 0; baseImageLevels[i] != NULL && zoom * (2 << i) <= 1.0; ++i)
+        level = baseImageLevels[i];
+    levelWidth = cairo_image_surface_get_width(level);
+    levelHeight = cairo_image_surface_get_height(level);
+    cairo_translate(cr, state->imgXRef, state->imgYRef);
+    cairo_scale(cr,
+            (gdouble)cairo_image_surface_get_width(state->baseImage)
+            / levelWidth,
+            (gdouble)cairo_image_surface_get_height(state->baseImage)
+            / levelHeight);
+    cairo_rectangle(cr, 0, 0, levelWidth, levelHeight);
+    cairo_clip(cr);
+    cairo_set_source_surface(cr, level, 0, 0);
+    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_paint(cr);
+}
+
+/* Draws the image state. Base image is replaced by preview when not NULL.
+ * Shape with index skipIdx is omitted. When isFast is set, shapes are drawn
+ * in lower quality.
+ */
+static void drawState(const DrawImageState *state, cairo_surface_t *preview,
+        cairo_surface_t *const *baseImageLevels,
+        const Selection *selection, gint curShapeIdx, cairo_t *cr,
+        gdouble zoom, gint skipIdx, gboolean isFast)
+{
+    double xBeg, yBeg, clipX1, clipY1, clipX2, clipY2;
+    double shapeX1, shapeY1, shapeX2, shapeY2;
     gint baseImgWidth, baseImgHeight;
     cairo_surface_t *baseImage;
 
+    cairo_clip_extents(cr, &clipX1, &clipY1, &clipX2, &clipY2);
+
 	if( state->imgBgColor.alpha != 0.0 ) {
 		gdk_cairo_set_source_rgba(cr, &state->imgBgColor);
 		cairo_rectangle(cr, 0, 0, state->imgWidth * zoom,
@@ -640,7 +914,7 @@ void di_draw(const DrawImage *di, cairo_t *cr, gdouble zoom)
 		cairo_fill(cr);
 	}
     if( state->baseImage != NULL ) {
-        baseImage = di->preview ? di->preview : state->baseImage;
+        baseImage = preview ? preview : state->baseImage;
         baseImgWidth = cairo_image_surface_get_width(baseImage);
         baseImgHeight = cairo_image_surface_get_height(baseImage);
         if( zoom != 1.0 ) {
@@ -672,10 +946,17 @@ void di_draw(const DrawImage *di, cairo_t *cr, gdouble zoom)
                     state->imgHeight - yBeg);
             cairo_fill(cr);
         }
-        cairo_set_source_surface(cr, baseImage,
-            state->imgXRef, state->imgYRef);
-        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
-        cairo_paint(cr);
+        cairo_save(cr);
+        if( baseImageLevels != NULL && preview == NULL ) {
+            paintBaseImageLevel(state, baseImageLevels, cr, zoom);
+        }else{
+            cairo_set_source_surface(cr, baseImage,
+                state->imgXRef, state->imgYRef);
+            cairo_pattern_set_filter(cairo_get_source(cr),
+                    CAIRO_FILTER_NEAREST);
+            cairo_paint(cr);
+        }
+        cairo_restore(cr);
         if( zoom != 1.0 )
             cairo_restore(cr);
     }
@@ -683,14 +964,235 @@ void di_draw(const DrawImage *di, cairo_t *cr, gdouble zoom)
         cairo_save(cr);
         cairo_translate(cr, zoom * state->imgXRef, zoom * state->imgYRef);
     }
-    for(int i = 0; i < state->shapeCount; ++i)
-        shape_draw(state->shapes[i], cr, zoom,
-                g_hash_table_contains(di->selection, GINT_TO_POINTER(i)),
-                i == di->curShapeIdx);
+    /* skip shapes outside of the visible area */
+    clipX1 = (clipX1 - CULL_MARGIN) / zoom - state->imgXRef;
+    clipY1 = (clipY1 - CULL_MARGIN) / zoom - state->imgYRef;
+    clipX2 = (clipX2 + CULL_MARGIN) / zoom - state->imgXRef;
+    clipY2 = (clipY2 + CULL_MARGIN) / zoom - state->imgYRef;
+    if( isFast ) {
+        cairo_save(cr);
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_FAST);
+    }
+    for(int i = 0; i < state->shapeCount; ++i) {
+        if( i == skipIdx )
+            continue;
+        shape_getBounds(state->shapes[i], &shapeX1, &shapeY1,
+                &shapeX2, &shapeY2);
+        if( shapeX2 >= clipX1 && shapeX1 <= clipX2
+                && shapeY2 >= clipY1 && shapeY1 <= clipY2 )
+            shape_draw(state->shapes[i], cr, zoom,
+                    sel_contains(selection, i), i == curShapeIdx, isFast);
+    }
+    if( isFast )
+        cairo_restore(cr);
     if( state->imgXRef != 0.0 || state->imgYRef != 0.0 )
         cairo_restore(cr);
 }
 
+void di_draw(const DrawImage *di, cairo_t *cr, gdouble zoom)
+{
+    drawState(di->states + di->stateCur, di->preview, NULL, di->selection,
+            di->curShapeIdx, cr, zoom, -1, FALSE);
+}
+
+DrawImageSnapshot *di_snapshotNew(const DrawImage *di, gboolean isFast)
+{
+    const DrawImageState *state = di->states + di->stateCur;
+    DrawImageSnapshot *snapshot = g_malloc(sizeof(DrawImageSnapshot));
+    int i;
+
+    snapshot->state = *state;
+    if( state->baseImage != NULL )
+        cairo_surface_reference(state->baseImage);
+    snapshot->state.shapes = g_malloc(state->shapeCount * sizeof(Shape*));
+    for(i = 0; i < state->shapeCount; ++i) {
+        /* the current and selected shapes may be modified in place */
+        if( i == di->curShapeIdx || sel_contains(di->selection, i) ) {
+            snapshot->state.shapes[i] = shape_copyOf(state->shapes[i]);
+        }else{
+            snapshot->state.shapes[i] = state->shapes[i];
+            shape_ref(state->shapes[i]);
+        }
+    }
+    snapshot->selection = sel_copyOf(di->selection);
+    snapshot->curShapeIdx = di->curShapeIdx;
+    snapshot->isFast = isFast;
+    snapshot->baseImageLevels[0] = NULL;
+    return snapshot;
+}
+
+void di_snapshotSetSelectionEmpty(DrawImageSnapshot *snapshot)
+{
+    sel_clear(snapshot->selection);
+    snapshot->curShapeIdx = -1;
+}
+
+void di_snapshotAddBaseImageLevels(DrawImageSnapshot *snapshot,
+        gdouble minZoom)
+{
+    cairo_surface_t *src = snapshot->state.baseImage, *level;
+    gint i = 0, srcWidth, srcHeight, width, height;
+    cairo_t *cr;
+
+    if( src == NULL )
+        return;
+    while( snapshot->baseImageLevels[i] != NULL )
+        src = snapshot->baseImageLevels[i++];
+    while( i < BASE_IMAGE_LEVEL_MAX && minZoom * (2 << i) <= 1.0 ) {
+        srcWidth = cairo_image_surface_get_width(src);
+        srcHeight = cairo_image_surface_get_height(src);
+        if( srcWidth == 1 && srcHeight == 1 )
+            break;
+        width = MAX(srcWidth / 2, 1);
+        height = MAX(srcHeight / 2, 1);
+        level = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                width, height);
+        cr = cairo_create(level);
+        cairo_scale(cr, (gdouble)width / srcWidth,
+                (gdouble)height / srcHeight);
+        cairo_set_source_surface(cr, src, 0, 0);
+        cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        snapshot->baseImageLevels[i++] = level;
+        snapshot->baseImageLevels[i] = NULL;
+        src = level;
+    }
+}
+
+void di_snapshotDraw(const DrawImageSnapshot *snapshot, cairo_t *cr,
+        gdouble zoom)
+{
+    drawState(&snapshot->state, NULL,
+            snapshot->baseImageLevels[0] != NULL ?
+            snapshot->baseImageLevels : NULL, snapshot->selection,
+            snapshot->curShapeIdx, cr, zoom, -1, snapshot->isFast);
+}
+
+void di_snapshotFree(DrawImageSnapshot *snapshot)
+{
+    gint i;
+
+    for(i = 0; snapshot->baseImageLevels[i] != NULL; ++i)
+        cairo_surface_destroy(snapshot->baseImageLevels[i]);
+    freeState(&snapshot->state);
+    sel_free(snapshot->selection);
+    g_free(snapshot);
+}
+
+cairo_region_t *di_takeDirtyRegion(DrawImage *di)
+{
+    cairo_region_t *res = NULL;
+
+    if( di->isSelectionDirty ) {
+        markSelectionDirty(di);
+        di->isSelectionDirty = FALSE;
+    }
+    if( ! di->isAllDirty ) {
+        res = di->dirtyRegion;
+        di->dirtyRegion = cairo_region_create();
+    }else{
+        cairo_region_destroy(di->dirtyRegion);
+        di->dirtyRegion = cairo_region_create();
+        di->isAllDirty = FALSE;
+    }
+    return res;
+}
+
+void di_finishCapture(DrawImage *di)
+{
+    if( di->captureBase != NULL ) {
+        cairo_surface_destroy(di->captureBase);
+        cairo_surface_destroy(di->captureOverlay);
+        di->captureBase = NULL;
+        di->captureOverlay = NULL;
+    }
+    di->captureShape = NULL;
+}
+
+void di_drawCapture(DrawImage *di, cairo_t *cr, gdouble zoom)
+{
+    const DrawImageState *state = di->states + di->stateCur;
+    const Shape *shape = NULL;
+    ShapeParams params;
+    double x1, y1, x2, y2;
+    gint x, y, width, height, ptCount, strokedCount;
+    cairo_t *captureCr;
+
+    if( di->curShapeIdx >= 0 && di->curShapeIdx == state->shapeCount - 1 )
+        shape = state->shapes[di->curShapeIdx];
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+    x = floor(x1);
+    y = floor(y1);
+    width = ceil(x2) - x;
+    height = ceil(y2) - y;
+    if( shape == NULL || shape_getType(shape) != ST_FREEFORM
+            || width <= 0 || height <= 0
+            || (gdouble)width * height > CAPTURE_PIXELS_MAX )
+    {
+        di_finishCapture(di);
+        di_draw(di, cr, zoom);
+        return;
+    }
+    if( di->captureShape != shape || di->captureStateIdx != di->stateCur
+            || di->captureZoom != zoom || di->captureX != x
+            || di->captureY != y || di->captureWidth != width
+            || di->captureHeight != height )
+    {
+        di_finishCapture(di);
+        di->captureBase = cairo_surface_create_similar(cairo_get_target(cr),
+                CAIRO_CONTENT_COLOR_ALPHA, width, height);
+        captureCr = cairo_create(di->captureBase);
+        cairo_translate(captureCr, -x, -y);
+        drawState(di->states + di->stateCur, di->preview, NULL,
+                di->selection, di->curShapeIdx, captureCr, zoom,
+                di->curShapeIdx, FALSE);
+        cairo_destroy(captureCr);
+        di->captureOverlay = cairo_surface_create_similar(
+                cairo_get_target(cr), CAIRO_CONTENT_COLOR_ALPHA, width, height);
+        di->captureShape = shape;
+        di->captureStateIdx = di->stateCur;
+        di->captureZoom = zoom;
+        di->captureX = x;
+        di->captureY = y;
+        di->captureWidth = width;
+        di->captureHeight = height;
+        di->captureStrokedCount = 0;
+    }
+    /* The last point may be yet replaced by path simplification. Segments
+     * ending on other points are stroked on overlay once. The previous
+     * segment is stroked again to get the line join.
+     */
+    ptCount = shape_getPathPointCount(shape);
+    strokedCount = di->captureStrokedCount;
+    if( ptCount - 1 > strokedCount ) {
+        captureCr = cairo_create(di->captureOverlay);
+        cairo_translate(captureCr, zoom * state->imgXRef - x,
+                zoom * state->imgYRef - y);
+        shape_strokePathRange(shape, captureCr, zoom,
+                MAX(strokedCount - 2, -1), ptCount - 2);
+        cairo_destroy(captureCr);
+        di->captureStrokedCount = ptCount - 1;
+    }
+    cairo_set_source_surface(cr, di->captureBase, x, y);
+    cairo_paint(cr);
+    shape_getParams(shape, &params);
+    if( params.strokeColor.alpha < 1.0 )
+        cairo_push_group(cr);
+    cairo_set_source_surface(cr, di->captureOverlay, x, y);
+    cairo_paint(cr);
+    cairo_save(cr);
+    cairo_translate(cr, zoom * state->imgXRef, zoom * state->imgYRef);
+    shape_strokePathRange(shape, cr, zoom, MAX(ptCount - 3, -1), ptCount - 1);
+    cairo_restore(cr);
+    if( params.strokeColor.alpha < 1.0 ) {
+        cairo_pop_group_to_source(cr);
+        cairo_paint_with_alpha(cr, params.strokeColor.alpha);
+    }
+}
+
 GdkPixbuf *di_toPixbuf(const DrawImage *di)
 {
     gint imgWidth = di_getWidth(di);
@@ -743,6 +1245,7 @@ void di_thresholdPreview(DrawImage *di, gdouble level)
         dest += destStride;
     }
     cairo_surface_mark_dirty(di->preview);
+    di->isAllDirty = TRUE;
 }
 
 void di_thresholdFinish(DrawImage *di, gboolean commit)
@@ -755,21 +1258,90 @@ void di_thresholdFinish(DrawImage *di, gboolean commit)
         state = getStateForModify(di, SM_IMAGE_THRESHOLD);
         cairo_surface_destroy(state->baseImage);
         state->baseImage = di->preview;
+        state->isBaseImageJpeg = FALSE;
     }else{
         cairo_surface_destroy(di->preview);
     }
     di->preview = NULL;
+    di->isAllDirty = TRUE;
 }
 
-gboolean di_saveWLQ(DrawImage *di, const char *fileName, gchar **errLoc)
+gboolean di_isPreviewActive(const DrawImage *di)
+{
+    return di->preview != NULL;
+}
+
+void di_setBaseImageMimeData(DrawImage *di, const char *mimeType,
+        guchar *data, gulong length)
+{
+    DrawImageState *state = di->states + di->stateCur;
+
+    if( state->baseImage == NULL ) {
+        g_free(data);
+        return;
+    }
+    cairo_surface_set_mime_data(state->baseImage, mimeType, data, length,
+            g_free, data);
+    state->isBaseImageJpeg = !strcmp(mimeType, CAIRO_MIME_TYPE_JPEG);
+}
+
+static gboolean isSurfaceOpaque(cairo_surface_t *surface)
+{
+    gint width, height, stride, x, y;
+    const guint32 *row;
+
+    if( cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24 )
+        return TRUE;
+    width = cairo_image_surface_get_width(surface);
+    height = cairo_image_surface_get_height(surface);
+    stride = cairo_image_surface_get_stride(surface);
+    cairo_surface_flush(surface);
+    for(y = 0; y < height; ++y) {
+        row = (const guint32*)(cairo_image_surface_get_data(surface)
+                + y * stride);
+        for(x = 0; x < width; ++x) {
+            if( row[x] >> 24 != 0xff )
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+void di_prepareVectorExport(DrawImage *di)
+{
+    DrawImageState *state = di->states + di->stateCur;
+    const unsigned char *mimeData;
+    unsigned long mimeLength;
+    GdkPixbuf *pixbuf;
+    gchar *buf;
+    gsize bufSize;
+
+    if( state->baseImage == NULL || ! state->isBaseImageJpeg )
+        return;
+    cairo_surface_get_mime_data(state->baseImage, CAIRO_MIME_TYPE_JPEG,
+            &mimeData, &mimeLength);
+    if( mimeData != NULL || ! isSurfaceOpaque(state->baseImage) )
+        return;
+    pixbuf = gdk_pixbuf_get_from_surface(state->baseImage, 0, 0,
+            cairo_image_surface_get_width(state->baseImage),
+            cairo_image_surface_get_height(state->baseImage));
+    if( pixbuf == NULL )
+        return;
+    if( gdk_pixbuf_save_to_buffer(pixbuf, &buf, &bufSize, "jpeg", NULL,
+                "quality", "92", NULL) )
+    {
+        cairo_surface_set_mime_data(state->baseImage, CAIRO_MIME_TYPE_JPEG,
+                (guchar*)buf, bufSize, g_free, buf);
+    }
+    g_object_unref(pixbuf);
+}
+
+static gboolean writeState(const DrawImageState *state,
+        WlqOutFile *outFile, gchar **errLoc)
 {
-    const DrawImageState *state = di->states + di->stateCur;
     int baseImgWidth = 0, baseImgHeight = 0, baseImgStride = 0, i;
     const unsigned char *data;
-    WlqOutFile *outFile;
 
-    if( (outFile = wlq_openOut(fileName, errLoc)) == NULL )
-        return FALSE;
     if( state->baseImage != NULL ) {
         baseImgWidth = cairo_image_surface_get_width(state->baseImage);
         baseImgHeight = cairo_image_surface_get_height(state->baseImage);
@@ -793,10 +1365,188 @@ gboolean di_saveWLQ(DrawImage *di, const char *fileName, gchar **errLoc)
         for(i = 0; i < state->shapeCount && isOK; ++i)
             isOK = shape_writeToFile(state->shapes[i], outFile, errLoc);
     }
+    return isOK;
+}
+
+gboolean di_saveWLQ(DrawImage *di, const char *fileName, gchar **errLoc)
+{
+    WlqOutFile *outFile;
+    gboolean isOK;
+
+    if( (outFile = wlq_openOut(fileName, errLoc)) == NULL )
+        return FALSE;
+    isOK = writeState(di->states + di->stateCur, outFile, errLoc);
     wlq_closeOut(outFile);
     return isOK;
 }
 
+gboolean di_snapshotWriteWLQ(const DrawImageSnapshot *snapshot,
+        GOutputStream *outStrm, gchar **errLoc)
+{
+    WlqOutFile *outFile;
+    gboolean isOK;
+
+    if( (outFile = wlq_openOutStream(outStrm, errLoc)) == NULL )
+        return FALSE;
+    isOK = writeState(&snapshot->state, outFile, errLoc);
+    wlq_closeOut(outFile);
+    return isOK;
+}
+
+GdkPixbuf *di_snapshotToPixbuf(const DrawImageSnapshot *snapshot)
+{
+    gint imgWidth = snapshot->state.imgWidth;
+    gint imgHeight = snapshot->state.imgHeight;
+    cairo_surface_t *paintImage = cairo_image_surface_create(
+            CAIRO_FORMAT_ARGB32, imgWidth, imgHeight);
+    cairo_t *cr = cairo_create(paintImage);
+    di_snapshotDraw(snapshot, cr, 1.0);
+    cairo_destroy(cr);
+    GdkPixbuf *pixbuf = gdk_pixbuf_get_from_surface(paintImage,
+            0, 0, imgWidth, imgHeight);
+    cairo_surface_destroy(paintImage);
+    return pixbuf;
+}
+
+static cairo_status_t appendToByteArray(void *closure,
+        const unsigned char *data, unsigned int length)
+{
+    g_byte_array_append(closure, data, length);
+    return CAIRO_STATUS_SUCCESS;
+}
+
+/* Appends href attribute of SVG image element with the base image. When
+ * isLinked is set, the image is written to a file next to the SVG file.
+ */
+static gboolean svgAppendBaseImageRef(GString *out,
+        cairo_surface_t *baseImage, const char *fileName, gboolean isLinked,
+        gchar **errLoc)
+{
+    const unsigned char *mimeData = NULL;
+    unsigned long mimeLength;
+    const char *mimeType = CAIRO_MIME_TYPE_JPEG;
+    GByteArray *encoded = NULL;
+    cairo_status_t status;
+    gchar *imageFileName, *name, *str;
+    gsize nameLen;
+    GError *gerr = NULL;
+    gboolean isOK = TRUE;
+
+    cairo_surface_get_mime_data(baseImage, mimeType, &mimeData, &mimeLength);
+    if( mimeData == NULL ) {
+        mimeType = CAIRO_MIME_TYPE_PNG;
+        cairo_surface_get_mime_data(baseImage, mimeType, &mimeData,
+                &mimeLength);
+    }
+    if( mimeData == NULL ) {
+        encoded = g_byte_array_new();
+        status = cairo_surface_write_to_png_stream(baseImage,
+                appendToByteArray, encoded);
+        if( status != CAIRO_STATUS_SUCCESS ) {
+            *errLoc = g_strdup_printf("unable to encode base image: %s",
+                    cairo_status_to_string(status));
+            g_byte_array_unref(encoded);
+            return FALSE;
+        }
+        mimeData = encoded->data;
+        mimeLength = encoded->len;
+    }
+    if( isLinked ) {
+        nameLen = strlen(fileName);
+        if( nameLen >= 4 && !strcasecmp(fileName + nameLen - 4, ".svg") )
+            nameLen -= 4;
+        imageFileName = g_strdup_printf("%.*s-image.%s", (int)nameLen,
+                fileName,
+                strcmp(mimeType, CAIRO_MIME_TYPE_PNG) ? "jpg" : "png");
+        isOK = g_file_set_contents(imageFileName, (const gchar*)mimeData,
+                mimeLength, &gerr);
+        if( isOK ) {
+            name = g_path_get_basename(imageFileName);
+            str = g_uri_escape_string(name, NULL, TRUE);
+            g_string_append_printf(out, " xlink:href=\"%s\"", str);
+            g_free(str);
+            g_free(name);
+        }else{
+            *errLoc = g_strdup(gerr->message);
+            g_error_free(gerr);
+        }
+        g_free(imageFileName);
+    }else{
+        str = g_base64_encode(mimeData, mimeLength);
+        g_string_append_printf(out, " xlink:href=\"data:%s;base64,%s\"",
+                mimeType, str);
+        g_free(str);
+    }
+    if( encoded != NULL )
+        g_byte_array_unref(encoded);
+    return isOK;
+}
+
+gboolean di_saveSVG(DrawImage *di, const char *fileName,
+        gboolean isBaseImageLinked, gchar **errLoc)
+{
+    const DrawImageState *state = di->states + di->stateCur;
+    gchar buf[4][G_ASCII_DTOSTR_BUF_SIZE];
+    gint baseImgWidth, baseImgHeight, i;
+    GString *out = g_string_new(NULL);
+    GError *gerr = NULL;
+    gboolean isOK = TRUE;
+
+    g_string_append_printf(out,
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<svg xmlns=\"http://www.w3.org/2000/svg\""
+            " xmlns:xlink=\"http://www.w3.org/1999/xlink\""
+            " width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\">\n"
+            "<g stroke-miterlimit=\"10\">\n",
+            state->imgWidth, state->imgHeight,
+            state->imgWidth, state->imgHeight);
+    if( state->imgBgColor.alpha != 0.0 ) {
+        g_string_append_printf(out, "<rect width=\"%d\" height=\"%d\"",
+                state->imgWidth, state->imgHeight);
+        shape_svgAppendPaint(out, "fill", &state->imgBgColor);
+        g_string_append(out, "/>\n");
+    }
+    if( state->baseImage != NULL ) {
+        baseImgWidth = cairo_image_surface_get_width(state->baseImage);
+        baseImgHeight = cairo_image_surface_get_height(state->baseImage);
+        g_ascii_formatd(buf[0], sizeof(buf[0]), "%.2f", state->imgXRef);
+        g_ascii_formatd(buf[1], sizeof(buf[1]), "%.2f", state->imgYRef);
+        /* area outside of base image is painted as by drawState */
+        if( state->imgBgColor.alpha == 0.0 ) {
+            g_string_append_printf(out, "<path fill-rule=\"evenodd\""
+                    " d=\"M0,0H%dV%dH0Z M%s,%sh%dv%dh%dZ\"/>\n",
+                    state->imgWidth, state->imgHeight, buf[0], buf[1],
+                    baseImgWidth, baseImgHeight, -baseImgWidth);
+        }
+        g_string_append_printf(out, "<image x=\"%s\" y=\"%s\""
+                " width=\"%d\" height=\"%d\" preserveAspectRatio=\"none\"",
+                buf[0], buf[1], baseImgWidth, baseImgHeight);
+        isOK = svgAppendBaseImageRef(out, state->baseImage, fileName,
+                isBaseImageLinked, errLoc);
+        g_string_append(out, "/>\n");
+    }
+    if( isOK ) {
+        if( state->imgXRef != 0.0 || state->imgYRef != 0.0 ) {
+            g_ascii_formatd(buf[2], sizeof(buf[2]), "%.2f", state->imgXRef);
+            g_ascii_formatd(buf[3], sizeof(buf[3]), "%.2f", state->imgYRef);
+            g_string_append_printf(out,
+                    "<g transform=\"translate(%s %s)\">\n", buf[2], buf[3]);
+        }
+        for(i = 0; i < state->shapeCount; ++i)
+            shape_writeSvg(state->shapes[i], out, i);
+        if( state->imgXRef != 0.0 || state->imgYRef != 0.0 )
+            g_string_append(out, "</g>\n");
+        g_string_append(out, "</g>\n</svg>\n");
+        isOK = g_file_set_contents(fileName, out->str, out->len, &gerr);
+        if( ! isOK ) {
+            *errLoc = g_strdup(gerr->message);
+            g_error_free(gerr);
+        }
+    }
+    g_string_free(out, TRUE);
+    return isOK;
+}
+
 void di_markSaved(DrawImage *di)
 {
     di->savedStateId = di->states[di->stateCur].id;
@@ -811,45 +1561,137 @@ gboolean di_isModified(const DrawImage *di)
 
 void di_rotate180(DrawImage *di)
 {
-    int i, j, imgWidth, imgHeight, imgStride;
-    unsigned char *src, *pxsrc, *dest, *pxdest, buf[4];
+    int imgWidth, imgHeight;
+    cairo_surface_t *newImage;
+    cairo_t *cr;
 
     DrawImageState *state = getStateForModify(di, SM_IMAGE_ROTATE);
-    g_hash_table_remove_all(di->selection);
+    sel_clear(di->selection);
     if( state->baseImage == NULL )
         return;
+    /* the base image is shared with previous states and snapshots,
+     * so the rotated one is a new surface */
     imgWidth = cairo_image_surface_get_width(state->baseImage);
     imgHeight = cairo_image_surface_get_height(state->baseImage);
-    imgStride = cairo_image_surface_get_stride(state->baseImage);
-    cairo_surface_flush(state->baseImage);
-    src = cairo_image_surface_get_data(state->baseImage);
-    dest = src + imgStride * (imgHeight-1);
-    pxsrc = src;
-    pxdest = dest + (imgWidth - 1) * 4;
-    i = 0;
-    while( pxsrc < pxdest ) {
-        memcpy(buf, pxsrc, 4);
-        memcpy(pxsrc, pxdest, 4);
-        memcpy(pxdest, buf, 4);
-        if( ++i == imgWidth ) {
-            src += imgStride;
-            dest -= imgStride;
-            pxsrc = src;
-            pxdest = dest + (imgWidth - 1) * 4;
-            i = 0;
-        }else{
-            pxsrc += 4;
-            pxdest -= 4;
+    newImage = cairo_image_surface_create(
+            cairo_image_surface_get_format(state->baseImage),
+            imgWidth, imgHeight);
+    cr = cairo_create(newImage);
+    cairo_translate(cr, imgWidth, imgHeight);
+    cairo_scale(cr, -1, -1);
+    cairo_set_source_surface(cr, state->baseImage, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(state->baseImage);
+    state->baseImage = newImage;
+}
+
+static gsize surfaceMemSize(cairo_surface_t *surface)
+{
+    return (gsize)cairo_image_surface_get_stride(surface)
+        * cairo_image_surface_get_height(surface);
+}
+
+gchar *di_getMemoryReport(const DrawImage *di)
+{
+    const DrawImageState *state;
+    GHashTable *uniqueShapes, *uniqueSurfaces;
+    GHashTableIter iter;
+    gpointer key;
+    GString *report;
+    int stateIdx, stateCount = 0, i;
+    guint shapeRefs = 0, surfaceRefs = 0;
+    gsize shapeBytes = 0, pathPoints = 0, pathPointRefs = 0, arrayBytes = 0;
+    gsize surfaceBytes = 0, surfaceRefBytes = 0;
+
+    uniqueShapes = g_hash_table_new(NULL, NULL);
+    uniqueSurfaces = g_hash_table_new(NULL, NULL);
+    stateIdx = di->stateFirst;
+    while( TRUE ) {
+        state = di->states + stateIdx;
+        ++stateCount;
+        arrayBytes += state->shapeCount * sizeof(Shape*);
+        for(i = 0; i < state->shapeCount; ++i) {
+            ++shapeRefs;
+            pathPointRefs += shape_getPathPointCount(state->shapes[i]);
+            g_hash_table_add(uniqueShapes, state->shapes[i]);
         }
+        if( state->baseImage != NULL ) {
+            ++surfaceRefs;
+            surfaceRefBytes += surfaceMemSize(state->baseImage);
+            g_hash_table_add(uniqueSurfaces, state->baseImage);
+        }
+        if( stateIdx == di->stateLast )
+            break;
+        if( ++stateIdx == UNDO_MAX )
+            stateIdx = 0;
+    }
+    g_hash_table_iter_init(&iter, uniqueShapes);
+    while( g_hash_table_iter_next(&iter, &key, NULL) ) {
+        shapeBytes += shape_getMemSize(key);
+        pathPoints += shape_getPathPointCount(key);
     }
-    cairo_surface_mark_dirty(state->baseImage);
+    g_hash_table_iter_init(&iter, uniqueSurfaces);
+    while( g_hash_table_iter_next(&iter, &key, NULL) )
+        surfaceBytes += surfaceMemSize(key);
+    state = di->states + di->stateCur;
+    report = g_string_new(NULL);
+    g_string_append_printf(report,
+            "undo states: %d (current: %d), state arrays: %" G_GSIZE_FORMAT
+            " bytes\n", stateCount,
+            (di->stateCur - di->stateFirst + UNDO_MAX) % UNDO_MAX + 1,
+            arrayBytes);
+    g_string_append_printf(report,
+            "shapes: %d in current state, %u references, %u unique, "
+            "%u shared references\n", state->shapeCount, shapeRefs,
+            g_hash_table_size(uniqueShapes),
+            shapeRefs - g_hash_table_size(uniqueShapes));
+    g_string_append_printf(report,
+            "path points: %" G_GSIZE_FORMAT " unique, %" G_GSIZE_FORMAT
+            " referenced\n", pathPoints, pathPointRefs);
+    g_string_append_printf(report,
+            "shape memory: %" G_GSIZE_FORMAT " bytes\n", shapeBytes);
+    g_string_append_printf(report,
+            "base images: %u unique (%" G_GSIZE_FORMAT " bytes), "
+            "%u references (%" G_GSIZE_FORMAT " bytes if not shared)\n",
+            g_hash_table_size(uniqueSurfaces), surfaceBytes,
+            surfaceRefs, surfaceRefBytes);
+    g_string_append_printf(report,
+            "preview image: %" G_GSIZE_FORMAT " bytes\n",
+            di->preview ? surfaceMemSize(di->preview) : 0);
+    g_string_append_printf(report,
+            "pick buffer: %" G_GSIZE_FORMAT " bytes\n",
+            di->pickBuffer ? surfaceMemSize(di->pickBuffer) : 0);
+    g_string_append_printf(report,
+            "selection: %d shapes\n", sel_count(di->selection));
+    g_string_append_printf(report, "total: %" G_GSIZE_FORMAT " bytes\n",
+            sizeof(DrawImage) + arrayBytes + shapeBytes + surfaceBytes
+            + (di->preview ? surfaceMemSize(di->preview) : 0)
+            + (di->pickBuffer ? surfaceMemSize(di->pickBuffer) : 0));
+    g_hash_table_unref(uniqueShapes);
+    g_hash_table_unref(uniqueSurfaces);
+    return g_string_free(report, FALSE);
+}
+
+void di_dump(const DrawImage *di)
+{
+    gchar *report = di_getMemoryReport(di);
+
+    g_printerr("---- wilqpaint image %p ----\n%s", di, report);
+    g_free(report);
 }
 
 void di_free(DrawImage *di)
 {
     freeStates(di->states, di->stateFirst, di->stateLast);
-    g_hash_table_unref(di->selection);
-    g_hash_table_unref(di->addedByRectSel);
+    sel_free(di->selection);
+    sel_free(di->addedByRectSel);
+    if( di->pickBuffer )
+        cairo_surface_destroy(di->pickBuffer);
+    di_finishCapture(di);
+    cairo_region_destroy(di->dirtyRegion);
     if( di->preview ) {
         g_warning("di_free: dangling image preview");
         cairo_surface_destroy(di->preview);
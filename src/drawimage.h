@@ -2,14 +2,26 @@
 #define DRAWIMAGE_H
 
 #include "shape.h"
+#include "imgscale.h"
 
 typedef struct DrawImage DrawImage;
 
+/* Copy of the current image state, not affected by further changes of
+ * the image. Unlike the DrawImage, a snapshot may be drawn by any thread.
+ */
+typedef struct DrawImageSnapshot DrawImageSnapshot;
+
 DrawImage *di_new(gint imgWidth, gint imgHeight, const GdkPixbuf *baseImage);
 
 DrawImage *di_openWLQ(const char *fileName, gchar **errLoc,
         gboolean *isNoEntErr);
 
+/* Reads image in WLQ format from the stream. The name is used in error
+ * messages.
+ */
+DrawImage *di_openWLQStream(GInputStream*, const char *name,
+        gchar **errLoc);
+
 gint di_getWidth(const DrawImage*);
 gint di_getHeight(const DrawImage*);
 gdouble di_getXRef(const DrawImage*);
@@ -21,6 +33,11 @@ void di_setBackgroundColor(DrawImage*, const GdkRGBA*);
 
 void di_addShape(DrawImage*, ShapeType, gdouble xRef, gdouble yRef,
         const ShapeParams*, gboolean addBottom);
+
+/* Sets simplification tolerance for freeform shapes added subsequently.
+ */
+void di_setFreeformTolerance(DrawImage*, gdouble tolerance);
+
 gboolean di_isSelectionEmpty(const DrawImage*);
 ShapeType di_getCurShapeType(const DrawImage*);
 void di_getCurShapeParams(const DrawImage*, ShapeParams*);
@@ -30,6 +47,12 @@ void di_curShapeSink(DrawImage*);
 void di_undo(DrawImage*);
 void di_redo(DrawImage*);
 
+/* Turns on or off use of the pick buffer: an off-screen image with shapes
+ * drawn in colors identifying them. With the pick buffer the shape hit by
+ * di_curShapeFromPoint is the one visible at the point.
+ */
+void di_setPickBufferEnabled(DrawImage*, gboolean enable);
+
 /* Hits selected shape from point.
  */
 gboolean di_curShapeFromPoint(DrawImage*, gdouble x, gdouble y,
@@ -59,8 +82,15 @@ gboolean di_selectionDelete(DrawImage*);
 
 gboolean di_selectionSetEmpty(DrawImage*);
 
+/* Selects all shapes. Returns TRUE when the image contains any shape.
+ */
+gboolean di_selectAll(DrawImage*);
 
-void di_scale(DrawImage*, gdouble factor);
+/* Scales the image. The base image is resampled using the filter.
+ * On failure the image is left unchanged.
+ */
+gboolean di_scale(DrawImage*, gdouble factor, ImageScaleFilter,
+        gchar **errLoc);
 
 /* Set new xRef and yRef value of image.
  */
@@ -74,9 +104,77 @@ void di_setSize(DrawImage*, gint imgWidth, gint imgHeight,
         gdouble translateXfactor, gdouble translateYfactor);
 
 void di_draw(const DrawImage*, cairo_t*, gdouble zoom);
+
+/* Returns area of the image changed since the previous call, in image
+ * coordinates. Returns NULL when the whole image should be redrawn.
+ * The returned region should be destroyed by caller.
+ */
+cairo_region_t *di_takeDirtyRegion(DrawImage*);
+
+/* Creates snapshot of the image. Should be called and freed by the main
+ * thread; di_snapshotDraw may be called by other threads in between.
+ * A snapshot created with isFast set is drawn in lower quality, for
+ * redraws during mouse drag.
+ */
+DrawImageSnapshot *di_snapshotNew(const DrawImage*, gboolean isFast);
+
+/* Makes the snapshot drawn without the selection and current shape marks.
+ * The image itself is left intact.
+ */
+void di_snapshotSetSelectionEmpty(DrawImageSnapshot*);
+
+/* Creates the base image scaled down by powers of two, down to the
+ * minimum zoom the snapshot will be drawn at. The snapshot draws the
+ * base image from the scaled ones, with smooth filtering. Should be
+ * called before the snapshot is drawn in other threads.
+ */
+void di_snapshotAddBaseImageLevels(DrawImageSnapshot*, gdouble minZoom);
+
+void di_snapshotDraw(const DrawImageSnapshot*, cairo_t*, gdouble zoom);
+
+/* Writes the snapshot image in WLQ format to the stream. The stream is
+ * closed.
+ */
+gboolean di_snapshotWriteWLQ(const DrawImageSnapshot*, GOutputStream*,
+        gchar **errLoc);
+GdkPixbuf *di_snapshotToPixbuf(const DrawImageSnapshot*);
+void di_snapshotFree(DrawImageSnapshot*);
+
+/* Returns TRUE when the image is drawn with threshold preview.
+ */
+gboolean di_isPreviewActive(const DrawImage*);
+
+/* Attaches encoded file contents to the base image. Cairo writes the
+ * encoded data to PDF or SVG instead of the decoded pixels. The data
+ * is freed using g_free.
+ */
+void di_setBaseImageMimeData(DrawImage*, const char *mimeType,
+        guchar *data, gulong length);
+
+/* Called before the image is written to PDF or SVG. When the base image
+ * was loaded from JPEG and then changed, compresses it to JPEG again.
+ */
+void di_prepareVectorExport(DrawImage*);
+
+/* Draws the image while a freeform shape is being drawn. Rendering of
+ * other shapes and the already drawn part of path are kept between calls,
+ * only new path segments are stroked.
+ */
+void di_drawCapture(DrawImage*, cairo_t*, gdouble zoom);
+
+/* Releases resources kept by di_drawCapture.
+ */
+void di_finishCapture(DrawImage*);
 GdkPixbuf *di_toPixbuf(const DrawImage*);
 
 gboolean di_saveWLQ(DrawImage*, const char *fileName, gchar **errLoc);
+/* Writes the image as SVG, with shapes as SVG elements. The base image is
+ * embedded, or, when isBaseImageLinked is set, written to a separate file
+ * next to the SVG file and referenced by name.
+ */
+gboolean di_saveSVG(DrawImage*, const char *fileName,
+        gboolean isBaseImageLinked, gchar **errLoc);
+
 void di_markSaved(DrawImage*);
 gboolean di_isModified(const DrawImage*);
 
@@ -87,6 +185,14 @@ void di_rotate180(DrawImage*);
 
 void di_free(DrawImage*);
 
-void di_dump(DrawImage*);
+/* Returns report about memory used by the image: undo states, shapes,
+ * path points and image surfaces. The returned string should be freed
+ * using g_free.
+ */
+gchar *di_getMemoryReport(const DrawImage*);
+
+/* Prints the memory report on stderr.
+ */
+void di_dump(const DrawImage*);
 
 #endif /* DRAWIMAGE_H */
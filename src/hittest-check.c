@@ -0,0 +1,466 @@
+/* Checks the hit test functions against cairo and measures their speed.
+ *
+ * Shapes are generated randomly. For random points around each shape the
+ * hit test result is compared with cairo_in_fill/cairo_in_stroke on the
+ * path built by shape drawing functions. Points closer to the painted
+ * area edge than the tolerance are skipped, the hit test and cairo round
+ * differently there. Shapes are rotated by random angles.
+ *
+ * Path segments are tested without line joins, so the reference path has
+ * segments as separate subpaths.
+ */
+#include <gtk/gtk.h>
+#include "hittest.h"
+#include "shapedrawing.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    SHAPE_COUNT = 200,
+    POINTS_PER_SHAPE = 256,
+    RECTS_PER_SHAPE = 64,
+    FREEFORM_POINTS_MAX = 300,
+    BENCH_REPEAT = 20
+};
+
+#define AREA_SIZE 400.0
+
+typedef enum {
+    REF_FILL = 1,
+    REF_STROKE = 2
+} RefMode;
+
+typedef struct {
+    gdouble x1, y1, x2, y2;
+    gdouble thickness, round, angle, proportion;
+    gboolean isRight;
+    DrawPoint *path;            /* freeform, relative to x1, y1 */
+    int ptCount;
+    HittestPathIndex *pathIndex;
+} TestShape;
+
+typedef struct {
+    const char *name;
+    void (*generate)(TestShape*, GRand*);
+    /* builds reference path, sets line width; returns RefMode flags */
+    int (*pathShape)(const TestShape*, cairo_t*);
+    gboolean (*hitTest)(const TestShape*, gdouble rx1, gdouble ry1,
+            gdouble rx2, gdouble ry2);
+    gdouble (*tolerance)(const TestShape*);
+} ShapeKind;
+
+static void generateEnds(TestShape *shape, GRand *rnd, gdouble minLen)
+{
+    do {
+        shape->x1 = g_rand_double_range(rnd, 0, AREA_SIZE);
+        shape->y1 = g_rand_double_range(rnd, 0, AREA_SIZE);
+        shape->x2 = g_rand_double_range(rnd, 0, AREA_SIZE);
+        shape->y2 = g_rand_double_range(rnd, 0, AREA_SIZE);
+    } while( hypot(shape->x2 - shape->x1, shape->y2 - shape->y1) < minLen
+            || fabs(shape->x2 - shape->x1) < 2
+            || fabs(shape->y2 - shape->y1) < 2 );
+}
+
+static gdouble exactTolerance(const TestShape *shape)
+{
+    return 0.5;
+}
+
+/* Sets rotation angle of rectangle or oval
+ */
+static void generateAngle(TestShape *shape, GRand *rnd)
+{
+    gint variant = g_rand_int_range(rnd, 0, 10);
+
+    /* right angles are checked separately, cairo path is exact there */
+    shape->angle = variant == 0 ? 0 : variant == 1 ? 90
+        : g_rand_double_range(rnd, -180, 180);
+    shape->isRight = g_rand_boolean(rnd);
+}
+
+/* Wavy lines are not checked, the round is zero.
+ */
+static void generateLine(TestShape *shape, GRand *rnd)
+{
+    shape->thickness = g_rand_double_range(rnd, 1, 20);
+    generateAngle(shape, rnd);
+    generateEnds(shape, rnd, 1);
+}
+
+static int pathLine(const TestShape *shape, cairo_t *cr)
+{
+    sd_pathLine(cr, shape->x1, shape->y1, shape->x2, shape->y2, 0,
+            shape->angle, shape->isRight);
+    cairo_set_line_width(cr, shape->thickness);
+    return REF_STROKE;
+}
+
+static gboolean hitTestLine(const TestShape *shape,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    return hittest_line(shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->thickness, rx1, ry1, rx2, ry2);
+}
+
+/* The proportion is computed from round as by the arrow shape.
+ */
+static void generateArrow(TestShape *shape, GRand *rnd)
+{
+    shape->thickness = g_rand_double_range(rnd, 1, 20);
+    shape->round = g_rand_int_range(rnd, 0, 4) ? 0
+        : g_rand_double_range(rnd, 0, 100);
+    shape->proportion = 1.0 + shape->round * (0.02 + 0.1 / shape->thickness);
+    shape->angle = g_rand_double_range(rnd, 10, 170);
+    shape->isRight = g_rand_boolean(rnd);
+    /* some arrows are shorter than the head */
+    generateEnds(shape, rnd, 1);
+}
+
+static int pathArrow(const TestShape *shape, cairo_t *cr)
+{
+    sd_pathArrow(cr, shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->thickness, shape->proportion, shape->angle,
+            shape->isRight);
+    return REF_FILL;
+}
+
+static gboolean hitTestArrow(const TestShape *shape,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    return hittest_arrow(shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->thickness, shape->proportion, shape->angle,
+            shape->isRight, rx1, ry1, rx2, ry2);
+}
+
+static void generateTriangle(TestShape *shape, GRand *rnd)
+{
+    gint variant = g_rand_int_range(rnd, 0, 10);
+
+    shape->thickness = g_rand_double_range(rnd, 1, 20);
+    shape->isRight = g_rand_boolean(rnd);
+    /* sharp angles are avoided, cairo draws bevel joins there */
+    shape->angle = variant == 0 ? 0 : g_rand_double_range(rnd, 30, 150);
+    generateEnds(shape, rnd, 1);
+    /* large round makes a circle */
+    shape->round = variant == 1 ? hypot(shape->x2 - shape->x1,
+            shape->y2 - shape->y1) : 0;
+}
+
+static int pathTriangle(const TestShape *shape, cairo_t *cr)
+{
+    sd_pathTriangle(cr, shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->round, shape->angle, shape->isRight);
+    cairo_set_line_width(cr, shape->thickness);
+    return REF_FILL | REF_STROKE;
+}
+
+static gboolean hitTestTriangle(const TestShape *shape,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    return hittest_triangle(shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->angle, shape->isRight, shape->round, shape->thickness,
+            rx1, ry1, rx2, ry2);
+}
+
+static void generateRect(TestShape *shape, GRand *rnd)
+{
+    shape->thickness = g_rand_double_range(rnd, 0, 20);
+    generateAngle(shape, rnd);
+    generateEnds(shape, rnd, 1);
+}
+
+static void generateRoundedRect(TestShape *shape, GRand *rnd)
+{
+    generateRect(shape, rnd);
+    shape->round = g_rand_double_range(rnd, 1, 30);
+}
+
+static int pathRect(const TestShape *shape, cairo_t *cr)
+{
+    sd_pathRect(cr, shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->round, shape->angle, shape->isRight);
+    cairo_set_line_width(cr, shape->thickness);
+    return shape->thickness > 0 ? REF_FILL | REF_STROKE : REF_FILL;
+}
+
+static gboolean hitTestRect(const TestShape *shape,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    return hittest_rect(shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->round, shape->angle, shape->isRight, shape->thickness,
+            rx1, ry1, rx2, ry2);
+}
+
+static void generateOval(TestShape *shape, GRand *rnd)
+{
+    shape->thickness = g_rand_double_range(rnd, 0, 20);
+    generateAngle(shape, rnd);
+    generateEnds(shape, rnd, 1);
+}
+
+static int pathOval(const TestShape *shape, cairo_t *cr)
+{
+    sd_pathOval(cr, shape->x1, shape->y1, shape->x2, shape->y2, 0,
+            shape->angle, shape->isRight);
+    cairo_set_line_width(cr, shape->thickness);
+    return shape->thickness > 0 ? REF_FILL | REF_STROKE : REF_FILL;
+}
+
+static gboolean hitTestOval(const TestShape *shape,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    return hittest_ellipse(shape->x1, shape->y1, shape->x2, shape->y2,
+            shape->angle, shape->isRight, shape->thickness,
+            rx1, ry1, rx2, ry2);
+}
+
+/* The hit test uses an ellipse enlarged by half of the line width. It
+ * differs from the stroked ellipse near the stroke outer edge.
+ */
+static gdouble ovalTolerance(const TestShape *shape)
+{
+    return 0.5 * shape->thickness + 0.5;
+}
+
+static void generateFreeform(TestShape *shape, GRand *rnd)
+{
+    gdouble x = 0, y = 0;
+    int i;
+
+    shape->thickness = g_rand_double_range(rnd, 1, 20);
+    shape->x1 = g_rand_double_range(rnd, 0, AREA_SIZE);
+    shape->y1 = g_rand_double_range(rnd, 0, AREA_SIZE);
+    shape->ptCount = g_rand_int_range(rnd, 1, FREEFORM_POINTS_MAX + 1);
+    shape->path = g_malloc(shape->ptCount * sizeof(DrawPoint));
+    for(i = 0; i < shape->ptCount; ++i) {
+        x += g_rand_double_range(rnd, -15, 15);
+        y += g_rand_double_range(rnd, -15, 15);
+        dp_set(shape->path + i, x, y);
+    }
+    shape->x2 = shape->x1 + x;
+    shape->y2 = shape->y1 + y;
+    shape->pathIndex = hittest_pathIndexNew(shape->path, shape->ptCount);
+}
+
+static int pathFreeform(const TestShape *shape, cairo_t *cr)
+{
+    gdouble x = shape->x1, y = shape->y1;
+    int i;
+
+    for(i = 0; i < shape->ptCount; ++i) {
+        cairo_move_to(cr, x, y);
+        x = shape->x1 + dp_x(shape->path + i);
+        y = shape->y1 + dp_y(shape->path + i);
+        cairo_line_to(cr, x, y);
+    }
+    cairo_set_line_width(cr, shape->thickness);
+    return REF_STROKE;
+}
+
+static gboolean hitTestFreeform(const TestShape *shape,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    return hittest_path(shape->path, shape->ptCount, shape->thickness,
+            rx1 - shape->x1, ry1 - shape->y1, rx2 - shape->x1,
+            ry2 - shape->y1);
+}
+
+static gboolean hitTestFreeformIndexed(const TestShape *shape,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    return hittest_pathIndexed(shape->pathIndex, shape->path,
+            shape->ptCount, shape->thickness, rx1 - shape->x1,
+            ry1 - shape->y1, rx2 - shape->x1, ry2 - shape->y1);
+}
+
+static const ShapeKind shapeKinds[] = {
+    { "line", generateLine, pathLine, hitTestLine, exactTolerance },
+    { "arrow", generateArrow, pathArrow, hitTestArrow, exactTolerance },
+    { "triangle", generateTriangle, pathTriangle, hitTestTriangle,
+        exactTolerance },
+    { "rect", generateRect, pathRect, hitTestRect, exactTolerance },
+    { "rounded rect", generateRoundedRect, pathRect, hitTestRect,
+        exactTolerance },
+    { "oval", generateOval, pathOval, hitTestOval, ovalTolerance },
+    { "freeform", generateFreeform, pathFreeform, hitTestFreeform,
+        exactTolerance },
+    { "freeform indexed", generateFreeform, pathFreeform,
+        hitTestFreeformIndexed, exactTolerance }
+};
+
+static gboolean isPainted(cairo_t *cr, int refMode, gdouble x, gdouble y)
+{
+    return ((refMode & REF_FILL) && cairo_in_fill(cr, x, y))
+        || ((refMode & REF_STROKE) && cairo_in_stroke(cr, x, y));
+}
+
+/* Returns 1 when the point and points around it in tolerance distance
+ * are painted, 0 when none of them is painted, -1 otherwise.
+ */
+static int classifyPoint(cairo_t *cr, int refMode, gdouble x, gdouble y,
+        gdouble tolerance)
+{
+    static const gdouble dirs[8][2] = {
+        { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 },
+        { G_SQRT2 / 2, G_SQRT2 / 2 }, { G_SQRT2 / 2, -G_SQRT2 / 2 },
+        { -G_SQRT2 / 2, G_SQRT2 / 2 }, { -G_SQRT2 / 2, -G_SQRT2 / 2 }
+    };
+    gboolean res = isPainted(cr, refMode, x, y);
+    int i;
+
+    for(i = 0; i < 8; ++i) {
+        if( isPainted(cr, refMode, x + tolerance * dirs[i][0],
+                    y + tolerance * dirs[i][1]) != res )
+            return -1;
+    }
+    return res;
+}
+
+static void randomRect(const TestShape *shape, GRand *rnd, gdouble maxSize,
+        gdouble *rect)
+{
+    gdouble margin = shape->thickness + 10;
+    gdouble xMin = fmin(shape->x1, shape->x2) - margin;
+    gdouble yMin = fmin(shape->y1, shape->y2) - margin;
+    gdouble xMax = fmax(shape->x1, shape->x2) + margin;
+    gdouble yMax = fmax(shape->y1, shape->y2) + margin;
+
+    rect[0] = g_rand_double_range(rnd, xMin, xMax);
+    rect[1] = g_rand_double_range(rnd, yMin, yMax);
+    rect[2] = rect[0] + g_rand_double_range(rnd, -maxSize, maxSize);
+    rect[3] = rect[1] + g_rand_double_range(rnd, -maxSize, maxSize);
+}
+
+/* Compares the hit test with cairo for random points around the shape.
+ * Returns number of errors.
+ */
+static int checkShape(const ShapeKind *kind, const TestShape *shape,
+        cairo_t *cr, GRand *rnd, int *skipCount)
+{
+    gdouble pt[4], tolerance = kind->tolerance(shape);
+    int i, refMode, painted, errCount = 0;
+    gboolean isHit;
+
+    cairo_new_path(cr);
+    refMode = kind->pathShape(shape, cr);
+    for(i = 0; i < POINTS_PER_SHAPE; ++i) {
+        randomRect(shape, rnd, 0, pt);
+        painted = classifyPoint(cr, refMode, pt[0], pt[1], tolerance);
+        if( painted < 0 ) {
+            ++*skipCount;
+            continue;
+        }
+        isHit = kind->hitTest(shape, pt[0], pt[1], pt[0], pt[1]);
+        if( isHit == painted )
+            continue;
+        if( errCount == 0 ) {
+            fprintf(stderr, "%s: point (%g, %g) %s by hit test, shape "
+                    "(%g, %g)-(%g, %g) thickness %g round %g angle %g%s\n",
+                    kind->name, pt[0], pt[1], isHit ? "hit" : "missed",
+                    shape->x1, shape->y1, shape->x2, shape->y2,
+                    shape->thickness, shape->round, shape->angle,
+                    shape->isRight ? " right" : "");
+        }
+        ++errCount;
+    }
+    return errCount;
+}
+
+/* The indexed path hit test should give the same results as the plain one.
+ */
+static int checkPathIndex(const TestShape *shape, GRand *rnd)
+{
+    gdouble rect[4];
+    int i, errCount = 0;
+
+    for(i = 0; i < RECTS_PER_SHAPE; ++i) {
+        randomRect(shape, rnd, 40, rect);
+        if( hitTestFreeform(shape, rect[0], rect[1], rect[2], rect[3])
+                != hitTestFreeformIndexed(shape, rect[0], rect[1], rect[2],
+                    rect[3]) )
+        {
+            if( errCount == 0 )
+                fprintf(stderr, "freeform indexed: rectangle (%g, %g)-(%g, %g)"
+                        " differs from plain hit test\n",
+                        rect[0], rect[1], rect[2], rect[3]);
+            ++errCount;
+        }
+    }
+    return errCount;
+}
+
+/* Returns time of one hit test call in nanoseconds.
+ */
+static gdouble benchShapes(const ShapeKind *kind, const TestShape *shapes,
+        GRand *rnd)
+{
+    gdouble *rects = g_malloc(SHAPE_COUNT * RECTS_PER_SHAPE
+            * 4 * sizeof(gdouble));
+    gdouble *rect;
+    gint64 startTime, elapsed;
+    int i, j, rep;
+    volatile int hitCount = 0;
+
+    for(i = 0; i < SHAPE_COUNT; ++i) {
+        for(j = 0; j < RECTS_PER_SHAPE; ++j)
+            randomRect(shapes + i, rnd, 20,
+                    rects + 4 * (i * RECTS_PER_SHAPE + j));
+    }
+    startTime = g_get_monotonic_time();
+    for(rep = 0; rep < BENCH_REPEAT; ++rep) {
+        for(i = 0; i < SHAPE_COUNT; ++i) {
+            for(j = 0; j < RECTS_PER_SHAPE; ++j) {
+                rect = rects + 4 * (i * RECTS_PER_SHAPE + j);
+                if( kind->hitTest(shapes + i, rect[0], rect[1], rect[2],
+                            rect[3]) )
+                    ++hitCount;
+            }
+        }
+    }
+    elapsed = g_get_monotonic_time() - startTime;
+    g_free(rects);
+    return 1000.0 * elapsed / ((gdouble)BENCH_REPEAT * SHAPE_COUNT
+            * RECTS_PER_SHAPE);
+}
+
+int main(int argc, char *argv[])
+{
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    GRand *rnd;
+    TestShape *shapes;
+    const ShapeKind *kind;
+    int k, i, errCount, skipCount, totalErrCount = 0;
+    gdouble nsPerOp;
+
+    surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+    cr = cairo_create(surface);
+    rnd = g_rand_new_with_seed(argc > 1 ? atoi(argv[1]) : 1);
+    shapes = g_malloc(SHAPE_COUNT * sizeof(TestShape));
+    for(k = 0; k < G_N_ELEMENTS(shapeKinds); ++k) {
+        kind = shapeKinds + k;
+        errCount = skipCount = 0;
+        for(i = 0; i < SHAPE_COUNT; ++i) {
+            memset(shapes + i, 0, sizeof(TestShape));
+            kind->generate(shapes + i, rnd);
+            errCount += checkShape(kind, shapes + i, cr, rnd, &skipCount);
+            if( shapes[i].pathIndex != NULL )
+                errCount += checkPathIndex(shapes + i, rnd);
+        }
+        nsPerOp = benchShapes(kind, shapes, rnd);
+        printf("%-16s %5d errors, %5d points near edge, %8.1f ns/op\n",
+                kind->name, errCount, skipCount, nsPerOp);
+        totalErrCount += errCount;
+        for(i = 0; i < SHAPE_COUNT; ++i) {
+            g_free(shapes[i].path);
+            hittest_pathIndexFree(shapes[i].pathIndex);
+        }
+    }
+    g_free(shapes);
+    g_rand_free(rnd);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    return totalErrCount ? 1 : 0;
+}
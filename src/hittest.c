@@ -203,12 +203,6 @@ static gboolean getSubsectionLyingOnHalfplaneOrtogonal(
             swapEnds(&sxbeg, &sybeg, &sxend, &syend);
     }else{
         /* sxbeg == sxend && sybeg == syend */
-        /*
-        printf("getSubsectionLyingOnHalfplaneOrtogonal: "
-                "line=((%.0f, %.0f), (%.0f, %.0f))\n", lx1, ly1, lx2, ly2);
-        printf("    pt=(%.0f, %.0f), a1=%f, b1=%f, c1=%f, res=%f\n",
-                sxbeg, sybeg, a1, b1, c1, a1 * sxbeg + b1 * sybeg + c1);
-                */
         res = a1 * sxbeg + b1 * sybeg + c1 <= 0;
     }
     if( res ) {
@@ -229,12 +223,6 @@ static gboolean getSubsectionLyingOnLine(
     gdouble a1 = ly2 - ly1, b1 = lx1 - lx2, c1 = lx2 * ly1 - lx1 * ly2;
     gboolean res = TRUE;
 
-    /*
-    printf("getSubsectionLyingOnLine: line=((%.0f, %.0f), (%.0f, %.0f))\n",
-            lx1, ly1, lx2, ly2);
-    printf("                          sect=((%.0f, %.0f), (%.0f, %.0f))\n",
-            *sx1, *sy1, *sx2, *sy2);
-            */
     if( fabs(sxend - sxbeg) > fabs(syend - sybeg) ) {
         if( sxbeg > sxend )
             swapEnds(&sxbeg, &sybeg, &sxend, &syend);
@@ -333,15 +321,6 @@ static gboolean isSectionOnHalfplaneIntersection(
     gdouble sl1x1 = sx1, sl1x2 = sx2, sl2x1 = sx1, sl2x2 = sx2;
     gdouble sl1y1 = sy1, sl1y2 = sy2, sl2y1 = sy1, sl2y2 = sy2;
 
-    /*
-    printf("        isSectionOnHalfplaneIntersection: "
-            "line1=((%.0f, %.0f), (%.0f, %.0f))\n",
-            l1x1, l1y1, l1x2, l1y2);
-    printf("                      line2=((%.0f, %.0f), (%.0f, %.0f))\n",
-            l2x1, l2y1, l2x2, l2y2);
-    printf("                      sect=((%.0f, %.0f), (%.0f, %.0f))\n",
-            sx1, sy1, sx2, sy2);
-            */
     return getSubsectionLyingOnHalfplane(l1x1, l1y1, l1x2, l1y2,
             thickness, &sl1x1, &sl1y1, &sl1x2, &sl1y2)
         && getSubsectionLyingOnHalfplane(l2x1, l2y1, l2x2, l2y2,
@@ -357,14 +336,6 @@ static gboolean twoHalfplanesIntersectionHitTest(
         gdouble l2x1, gdouble l2y1, gdouble l2x2, gdouble l2y2,
         gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
 {
-    /*
-    printf("twoHalfplanesHitTest: line1=((%.0f, %.0f), (%.0f, %.0f))\n",
-            l1x1, l1y1, l1x2, l1y2);
-    printf("                      line2=((%.0f, %.0f), (%.0f, %.0f))\n",
-            l2x1, l2y1, l2x2, l2y2);
-    printf("                      rect =((%.0f, %.0f), (%.0f, %.0f))\n",
-            rx1, ry1, rx2, ry2);
-            */
     return isSectionOnHalfplaneIntersection(l1x1, l1y1, l1x2, l1y2,
             l2x1, l2y1, l2x2, l2y2, thickness, rx1, ry1, rx2, ry1)
         || isSectionOnHalfplaneIntersection(l1x1, l1y1, l1x2, l1y2,
@@ -384,6 +355,15 @@ static gboolean pointHitTest(gdouble x, gdouble y, gdouble thickness,
         && y - d <= fmax(ry1, ry2) && y + d >= fmin(ry1, ry2);
 }
 
+static gboolean circleHitTest(gdouble cx, gdouble cy, gdouble radius,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    gdouble x = CLAMP(cx, fmin(rx1, rx2), fmax(rx1, rx2));
+    gdouble y = CLAMP(cy, fmin(ry1, ry2), fmax(ry1, ry2));
+
+    return ptDistSqr(cx, cy, x, y) <= radius * radius;
+}
+
 static gboolean lineHitTest(gdouble lx1, gdouble ly1, gdouble lx2, gdouble ly2,
         gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
 {
@@ -468,11 +448,6 @@ static gboolean pathElemHitTest(gdouble xPrev, gdouble yPrev, gdouble xBeg,
 {
     gboolean isBegHit = FALSE, isEndHit = FALSE;
 
-    printf("pathElemHitTest: prev=(%.0f, %.0f), beg=(%.0f, %.0f), "
-            "end=(%.0f, %.0f), next=(%.0f, %.0f)\n",
-            xPrev, yPrev, xBeg, yBeg, xEnd, yEnd, xNext, yNext);
-    printf("                 rect=((%.0f, %.0f), (%.0f, %.0f))\n",
-            rx1, ry1, rx2, ry2);
     pathElemWithSectionHitTest(xPrev, yPrev, xBeg, yBeg, xEnd, yEnd, xNext,
             yNext, thickness, rx1, ry1, rx2, ry1, &isBegHit, &isEndHit);
     pathElemWithSectionHitTest(xPrev, yPrev, xBeg, yBeg, xEnd, yEnd, xNext,
@@ -481,38 +456,66 @@ static gboolean pathElemHitTest(gdouble xPrev, gdouble yPrev, gdouble xBeg,
             yNext, thickness, rx1, ry1, rx1, ry2, &isBegHit, &isEndHit);
     pathElemWithSectionHitTest(xPrev, yPrev, xBeg, yBeg, xEnd, yEnd, xNext,
             yNext, thickness, rx2, ry1, rx2, ry2, &isBegHit, &isEndHit);
-    printf("isBegHit=%d, isEndHit%d\n\n", isBegHit, isEndHit);
     return isBegHit && isEndHit;
 }
 
-static gboolean ellipseHitTest(
-        gdouble ex1, gdouble ey1, gdouble ex2, gdouble ey2, gdouble thickness,
-        gdouble sx1, gdouble sx2, gdouble sy1, gdouble sy2)
+/* Returns squared distance of point (px, py) to section.
+ */
+static gdouble sectionPtDistSqr(gdouble sx1, gdouble sy1,
+        gdouble sx2, gdouble sy2, gdouble px, gdouble py)
+{
+    gdouble dx = sx2 - sx1, dy = sy2 - sy1;
+    gdouble lenSqr = dx * dx + dy * dy, t = 0;
+
+    if( lenSqr > 0 )
+        t = CLAMP(((px - sx1) * dx + (py - sy1) * dy) / lenSqr, 0, 1);
+    return ptDistSqr(sx1 + t * dx, sy1 + t * dy, px, py);
+}
+
+/* Checks whether rectangle overlaps the triangle. Uses separating axes:
+ * the coordinate axes and normals of the triangle edges.
+ */
+static gboolean triangleHitTest(gdouble tx1, gdouble ty1,
+        gdouble tx2, gdouble ty2, gdouble tx3, gdouble ty3,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    const gdouble tx[3] = { tx1, tx2, tx3 }, ty[3] = { ty1, ty2, ty3 };
+    gdouble nx, ny, edge, opposite, rmin, rmax;
+    int i;
+
+    if( fmin(fmin(tx1, tx2), tx3) > fmax(rx1, rx2)
+            || fmax(fmax(tx1, tx2), tx3) < fmin(rx1, rx2)
+            || fmin(fmin(ty1, ty2), ty3) > fmax(ry1, ry2)
+            || fmax(fmax(ty1, ty2), ty3) < fmin(ry1, ry2) )
+        return FALSE;
+    for(i = 0; i < 3; ++i) {
+        nx = ty[i] - ty[(i + 1) % 3];
+        ny = tx[(i + 1) % 3] - tx[i];
+        edge = nx * tx[i] + ny * ty[i];
+        opposite = nx * tx[(i + 2) % 3] + ny * ty[(i + 2) % 3];
+        rmin = fmin(rx1 * nx, rx2 * nx) + fmin(ry1 * ny, ry2 * ny);
+        rmax = fmax(rx1 * nx, rx2 * nx) + fmax(ry1 * ny, ry2 * ny);
+        if( rmin > fmax(edge, opposite) || rmax < fmin(edge, opposite) )
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Gets unit vectors along the sides of rectangle drawn by sd_pathRect
+ * or sd_pathOval rotated by the angle. Returns the rectangle side lengths.
+ */
+static void getRotatedRect(gdouble x1, gdouble y1, gdouble x2, gdouble y2,
+        gdouble angle, gboolean isRight, gdouble *ux, gdouble *uy,
+        gdouble *xLen, gdouble *yLen)
 {
-    gdouble exmid = 0.5 * (ex1 + ex2);
-    gdouble eymid = 0.5 * (ey1 + ey2);
-    gdouble sxmin = fmin(sx1, sx2);
-    gdouble sxmax = fmax(sx1, sx2);
-    gdouble symin = fmin(sy1, sy2);
-    gdouble symax = fmax(sy1, sy2);
-    gdouble a = 0.5 * (G_SQRT2 * fabs(ex2 - ex1) + thickness);
-    gdouble b = 0.5 * (G_SQRT2 * fabs(ey2 - ey1) + thickness);
-    gdouble sxchk, sychk;
-
-    if( sxmax < exmid ) {
-        sxchk = sxmax;
-    }else if( sxmin > exmid ) {
-        sxchk = sxmin;
-    }else
-        sxchk = exmid;
-    if( symax < eymid ) {
-        sychk = symax;
-    }else if( symin > eymid ) {
-        sychk = symin;
-    }else
-        sychk = eymid;
-    return b * b * (sxchk - exmid) * (sxchk - exmid)
-            + a * a * (sychk - eymid) * (sychk - eymid) <= a * a * b * b;
+    if( isRight )
+        angle = -angle;
+    angle *= G_PI / 180;
+    *ux = cos(angle);
+    *uy = -sin(angle);
+    /* the other side is along (-uy, ux) */
+    *xLen = fabs((x2 - x1) * *ux + (y2 - y1) * *uy);
+    *yLen = fabs((y2 - y1) * *ux - (x2 - x1) * *uy);
 }
 
 gboolean hittest_line(gdouble lx1, gdouble ly1, gdouble lx2, gdouble ly2,
@@ -526,44 +529,230 @@ gboolean hittest_line(gdouble lx1, gdouble ly1, gdouble lx2, gdouble ly2,
 }
 
 gboolean hittest_arrow(gdouble lx1, gdouble ly1, gdouble lx2, gdouble ly2,
-        gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+        gdouble thickness, gdouble proportion, gdouble angle, gboolean isRight,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
 {
-    return lineHitTest(lx1, ly1, lx2, ly2, thickness, rx1, ry1, rx2, ry2);
+    gdouble lineLen, angleTan, dx, dy, headLen, headWidth, notchLen;
+    gdouble joinLen, minLen, sx1, sy1, sx2, sy2, jx1, jy1, jx2, jy2;
+    gboolean isNotched;
+
+    /* the shape parameters are limited as by sd_pathArrow */
+    thickness = fmax(thickness, 1.0);
+    angle = CLAMP(angle, 10, 170);
+    lineLen = sqrt(ptDistSqr(lx1, ly1, lx2, ly2));
+    if( lineLen == 0 )
+        return pointHitTest(lx2, ly2, thickness, rx1, ry1, rx2, ry2);
+    angleTan = tan(angle * G_PI / 360);
+    dx = (lx2 - lx1) / lineLen;
+    dy = (ly2 - ly1) / lineLen;
+    headLen = 0.5 * proportion * thickness / angleTan;
+    headWidth = 0.5 * proportion * thickness;
+    isNotched = ! isRight && angle < 90;
+    notchLen = isNotched ? 0.5 * headLen * (1 + angleTan * angleTan)
+        : headLen;
+    sx1 = lx2 - headLen * dx - headWidth * dy;
+    sy1 = ly2 - headLen * dy + headWidth * dx;
+    sx2 = lx2 - headLen * dx + headWidth * dy;
+    sy2 = ly2 - headLen * dy - headWidth * dx;
+    minLen = isNotched ? 0.5 * thickness * ((0.5 * proportion + 0.5)
+            / angleTan + (0.5 * proportion - 0.5) * angleTan) : headLen;
+    if( lineLen <= minLen ) {
+        /* head only, the notch vertex lies on the arrow axis */
+        jx1 = jx2 = lx2 - notchLen * dx;
+        jy1 = jy2 = ly2 - notchLen * dy;
+    }else{
+        /* the shaft joins the head between the head base and the notch */
+        joinLen = headLen / proportion + notchLen * (1 - 1 / proportion);
+        jx1 = lx2 - joinLen * dx - 0.5 * thickness * dy;
+        jy1 = ly2 - joinLen * dy + 0.5 * thickness * dx;
+        jx2 = lx2 - joinLen * dx + 0.5 * thickness * dy;
+        jy2 = ly2 - joinLen * dy - 0.5 * thickness * dx;
+        if( lineHitTest(lx1, ly1, lx2 - joinLen * dx, ly2 - joinLen * dy,
+                    thickness, rx1, ry1, rx2, ry2) )
+            return TRUE;
+    }
+    return triangleHitTest(lx2, ly2, sx1, sy1, jx1, jy1, rx1, ry1, rx2, ry2)
+        || triangleHitTest(lx2, ly2, jx1, jy1, jx2, jy2, rx1, ry1, rx2, ry2)
+        || triangleHitTest(lx2, ly2, jx2, jy2, sx2, sy2, rx1, ry1, rx2, ry2);
 }
 
-gboolean hittest_path(DrawPoint *pt, int ptCount,
-        gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+/* Hit test of path segments from range [segFirst, segEnd). Segment i goes
+ * from point i-1 to point i; the first segment begins at (0, 0).
+ */
+static gboolean pathSegmentsHitTest(const DrawPoint *pt, int segFirst,
+        int segEnd, gdouble thickness,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
 {
     int i;
-    gdouble xBeg = 0.0, yBeg = 0.0, xEnd, yEnd;
+    gdouble xBeg, yBeg;
+
+    if( segFirst == 0 ) {
+        xBeg = yBeg = 0.0;
+    }else{
+        xBeg = dp_x(pt + segFirst - 1);
+        yBeg = dp_y(pt + segFirst - 1);
+    }
+    for(i = segFirst; i < segEnd; ++i) {
+        if( lineHitTest(xBeg, yBeg, dp_x(pt + i), dp_y(pt + i), thickness,
+                    rx1, ry1, rx2, ry2) )
+            return TRUE;
+        xBeg = dp_x(pt + i);
+        yBeg = dp_y(pt + i);
+    }
+    return FALSE;
+}
 
+gboolean hittest_path(const DrawPoint *pt, int ptCount,
+        gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
     if( ptCount == 0 )
         return pointHitTest(0, 0, thickness, rx1, ry1, rx2, ry2);
-    for(i = 0; i < ptCount - 1; ++i) {
-        xEnd = pt[i].x;
-        yEnd = pt[i].y;
-        if( lineHitTest(xBeg, yBeg, xEnd, yEnd, thickness, rx1, ry1, rx2, ry2))
-            return TRUE;
-        xBeg = xEnd;
-        yBeg = yEnd;
+    return pathSegmentsHitTest(pt, 0, ptCount, thickness, rx1, ry1, rx2, ry2);
+}
+
+enum {
+    PATHINDEX_LEAF_SEGMENTS = 8,
+    PATHINDEX_LEVEL_MAX = 32
+};
+
+typedef struct {
+    gdouble xMin, yMin, xMax, yMax;
+} BoundingBox;
+
+/* Bounding volume hierarchy of path segments. Level 0 contains bounding
+ * boxes of PATHINDEX_LEAF_SEGMENTS consecutive segments, each box on
+ * level n+1 covers two boxes of level n. The top level has one box.
+ */
+struct HittestPathIndex {
+    int levelCount;
+    int levelStart[PATHINDEX_LEVEL_MAX];
+    int levelSize[PATHINDEX_LEVEL_MAX];
+    BoundingBox *boxes;
+};
+
+static void boxAddPoint(BoundingBox *box, gdouble x, gdouble y)
+{
+    box->xMin = fmin(box->xMin, x);
+    box->yMin = fmin(box->yMin, y);
+    box->xMax = fmax(box->xMax, x);
+    box->yMax = fmax(box->yMax, y);
+}
+
+HittestPathIndex *hittest_pathIndexNew(const DrawPoint *pt, int ptCount)
+{
+    HittestPathIndex *index;
+    BoundingBox *box;
+    const BoundingBox *child;
+    int i, level, size, boxCount;
+
+    if( ptCount == 0 )
+        return NULL;
+    index = g_malloc(sizeof(HittestPathIndex));
+    index->levelCount = 0;
+    boxCount = 0;
+    size = (ptCount + PATHINDEX_LEAF_SEGMENTS - 1) / PATHINDEX_LEAF_SEGMENTS;
+    while( TRUE ) {
+        index->levelStart[index->levelCount] = boxCount;
+        index->levelSize[index->levelCount] = size;
+        ++index->levelCount;
+        boxCount += size;
+        if( size == 1 )
+            break;
+        size = (size + 1) / 2;
+    }
+    index->boxes = g_malloc(boxCount * sizeof(BoundingBox));
+    box = index->boxes;
+    for(i = 0; i < ptCount; ++i) {
+        if( i % PATHINDEX_LEAF_SEGMENTS == 0 ) {
+            if( i > 0 )
+                ++box;
+            box->xMin = box->xMax = i ? dp_x(pt + i - 1) : 0.0;
+            box->yMin = box->yMax = i ? dp_y(pt + i - 1) : 0.0;
+        }
+        boxAddPoint(box, dp_x(pt + i), dp_y(pt + i));
+    }
+    for(level = 1; level < index->levelCount; ++level) {
+        box = index->boxes + index->levelStart[level];
+        child = index->boxes + index->levelStart[level-1];
+        for(i = 0; i < index->levelSize[level-1]; ++i) {
+            if( i % 2 == 0 ) {
+                box[i / 2] = child[i];
+            }else{
+                boxAddPoint(box + i / 2, child[i].xMin, child[i].yMin);
+                boxAddPoint(box + i / 2, child[i].xMax, child[i].yMax);
+            }
+        }
+    }
+    return index;
+}
+
+static gboolean pathIndexNodeHitTest(const HittestPathIndex *index,
+        int level, int boxIdx, const DrawPoint *pt, int ptCount,
+        gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    const BoundingBox *box = index->boxes + index->levelStart[level] + boxIdx;
+    gdouble d = 0.5 * thickness;
+    int segFirst;
+
+    if( box->xMin - d > rx2 || box->xMax + d < rx1
+            || box->yMin - d > ry2 || box->yMax + d < ry1 )
+        return FALSE;
+    if( level == 0 ) {
+        segFirst = boxIdx * PATHINDEX_LEAF_SEGMENTS;
+        return pathSegmentsHitTest(pt, segFirst,
+                MIN(segFirst + PATHINDEX_LEAF_SEGMENTS, ptCount),
+                thickness, rx1, ry1, rx2, ry2);
+    }
+    boxIdx *= 2;
+    return pathIndexNodeHitTest(index, level - 1, boxIdx, pt, ptCount,
+                thickness, rx1, ry1, rx2, ry2)
+        || (boxIdx + 1 < index->levelSize[level - 1]
+            && pathIndexNodeHitTest(index, level - 1, boxIdx + 1, pt,
+                ptCount, thickness, rx1, ry1, rx2, ry2));
+}
+
+gboolean hittest_pathIndexed(const HittestPathIndex *index,
+        const DrawPoint *pt, int ptCount, gdouble thickness,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
+{
+    if( index == NULL )
+        return hittest_path(pt, ptCount, thickness, rx1, ry1, rx2, ry2);
+    return pathIndexNodeHitTest(index, index->levelCount - 1, 0, pt, ptCount,
+            thickness, fmin(rx1, rx2), fmin(ry1, ry2),
+            fmax(rx1, rx2), fmax(ry1, ry2));
+}
+
+void hittest_pathIndexFree(HittestPathIndex *index)
+{
+    if( index != NULL ) {
+        g_free(index->boxes);
+        g_free(index);
     }
-    xEnd = pt[ptCount - 1].x;
-    yEnd = pt[ptCount - 1].y;
-    return lineHitTest(xBeg, yBeg, xEnd, yEnd, thickness, rx1, ry1, rx2, ry2);
 }
 
 gboolean hittest_triangle(gdouble txBeg, gdouble tyBeg,
         gdouble txEnd, gdouble tyEnd,
-        gdouble angle, gdouble round, gdouble thickness,
+        gdouble angle, gboolean isRight, gdouble round, gdouble thickness,
         gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
 {
     gdouble d, c, height, txSub, tySub, tx1, ty1, tx2, ty2, tx3, ty3;
 
-    if( txBeg == tyBeg && txEnd == tyEnd )
+    /* the special cases below match sd_pathTriangle */
+    if( txBeg == txEnd && tyBeg == tyEnd )
         return pointHitTest(txBeg, tyBeg, thickness, rx1, ry1, rx2, ry2);
-    d = round / sin(angle * G_PI / 360) - round;
+    if( fabs(angle) < 1 )
+        return lineHitTest(txBeg, tyBeg, txEnd, tyEnd, thickness,
+                rx1, ry1, rx2, ry2);
+    if( angle > 170 )
+        angle = 170;
+    if( isRight )
+        swapEnds(&txBeg, &tyBeg, &txEnd, &tyEnd);
     height = sqrt((txEnd - txBeg) * (txEnd - txBeg)
                 + (tyEnd - tyBeg) * (tyEnd - tyBeg));
+    if( round >= 0.5 * height )
+        return circleHitTest(0.5 * (txBeg + txEnd), 0.5 * (tyBeg + tyEnd),
+                0.5 * (height + thickness), rx1, ry1, rx2, ry2);
+    d = round / sin(angle * G_PI / 360) - round;
     c = tan(angle * G_PI / 360);
     txSub = (txEnd - txBeg) * d / height;
     tySub = (tyEnd - tyBeg) * d / height;
@@ -584,35 +773,94 @@ gboolean hittest_triangle(gdouble txBeg, gdouble tyBeg,
 }
 
 gboolean hittest_rect(gdouble rtx1, gdouble rty1, gdouble rtx2, gdouble rty2,
-        gdouble round, gdouble thickness,
+        gdouble round, gdouble angle, gboolean isRight, gdouble thickness,
         gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
 {
-    gdouble d, xBeg, xEnd, yBeg, yEnd;
+    gdouble ux, uy, xLen, yLen, cx, cy, xHalf, yHalf, radius;
 
     if( rtx1 == rtx2 && rty1 == rty2 )
         return pointHitTest(rtx1, rty1, thickness, rx1, ry1, rx2, ry2);
-    d = 0.5 * thickness;
-    xBeg = fmin(rtx1, rtx2);
-    xEnd = fmax(rtx1, rtx2);
-    yBeg = fmin(rty1, rty2);
-    yEnd = fmax(rty1, rty2);
-    round = fmin(round, 0.5 * G_SQRT2 * fmin(xEnd - xBeg, yEnd - yBeg));
-    xBeg -= (1 - 0.5 * G_SQRT2) * round;
-    yBeg -= (1 - 0.5 * G_SQRT2) * round;
-    xEnd += (1 - 0.5 * G_SQRT2) * round;
-    yEnd += (1 - 0.5 * G_SQRT2) * round;
-    return fmin(rx1, rx2) <= xEnd + d
-        && fmin(ry1, ry2) <= yEnd + d
-        && fmax(rx1, rx2) >= xBeg - d
-        && fmax(ry1, ry2) >= yBeg - d;
+    getRotatedRect(rtx1, rty1, rtx2, rty2, angle, isRight, &ux, &uy,
+            &xLen, &yLen);
+    cx = 0.5 * (rtx1 + rtx2);
+    cy = 0.5 * (rty1 + rty2);
+    round = fmin(round, 0.5 * G_SQRT2 * fmin(xLen, yLen));
+    /* The rounded rectangle is a rectangle enlarged by the round radius,
+     * or, with the stroke, by the radius plus half of the line width.
+     * Without rounding the stroke has sharp corners.
+     */
+    if( round > 0 ) {
+        xHalf = 0.5 * xLen - 0.5 * G_SQRT2 * round;
+        yHalf = 0.5 * yLen - 0.5 * G_SQRT2 * round;
+        radius = round + 0.5 * thickness;
+    }else{
+        xHalf = 0.5 * (xLen + thickness);
+        yHalf = 0.5 * (yLen + thickness);
+        radius = 0;
+    }
+    if( lineHitTest(cx - (xHalf + radius) * ux, cy - (xHalf + radius) * uy,
+                cx + (xHalf + radius) * ux, cy + (xHalf + radius) * uy,
+                2 * yHalf, rx1, ry1, rx2, ry2)
+            || lineHitTest(cx + (yHalf + radius) * uy,
+                cy - (yHalf + radius) * ux, cx - (yHalf + radius) * uy,
+                cy + (yHalf + radius) * ux, 2 * xHalf, rx1, ry1, rx2, ry2) )
+        return TRUE;
+    return radius > 0 && (
+            circleHitTest(cx + xHalf * ux - yHalf * uy,
+                cy + xHalf * uy + yHalf * ux, radius, rx1, ry1, rx2, ry2)
+            || circleHitTest(cx + xHalf * ux + yHalf * uy,
+                cy + xHalf * uy - yHalf * ux, radius, rx1, ry1, rx2, ry2)
+            || circleHitTest(cx - xHalf * ux - yHalf * uy,
+                cy - xHalf * uy + yHalf * ux, radius, rx1, ry1, rx2, ry2)
+            || circleHitTest(cx - xHalf * ux + yHalf * uy,
+                cy - xHalf * uy - yHalf * ux, radius, rx1, ry1, rx2, ry2));
 }
 
+/* The ellipse goes through corners of the rotated rectangle. The stroke
+ * is approximated by ellipse enlarged by half of the line width.
+ */
 gboolean hittest_ellipse(
         gdouble ex1, gdouble ey1, gdouble ex2, gdouble ey2,
+        gdouble angle, gboolean isRight,
         gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2)
 {
+    gdouble ux, uy, xLen, yLen, cx, cy, a, b, qx[4], qy[4];
+    gboolean isNeg = FALSE, isPos = FALSE;
+    gdouble cross;
+    int i, next;
+
     if( ex1 == ex2 && ey1 == ey2 )
         return pointHitTest(ex1, ey1, thickness, rx1, ry1, rx2, ry2);
-    return ellipseHitTest(ex1, ey1, ex2, ey2, thickness, rx1, rx2, ry1, ry2);
+    getRotatedRect(ex1, ey1, ex2, ey2, angle, isRight, &ux, &uy,
+            &xLen, &yLen);
+    cx = 0.5 * (ex1 + ex2);
+    cy = 0.5 * (ey1 + ey2);
+    a = 0.5 * (G_SQRT2 * xLen + thickness);
+    b = 0.5 * (G_SQRT2 * yLen + thickness);
+    if( a == 0 || b == 0 )
+        return lineHitTest(cx - a * ux + b * uy, cy - a * uy - b * ux,
+                cx + a * ux - b * uy, cy + a * uy + b * ux, 0,
+                rx1, ry1, rx2, ry2);
+    /* Transform the rectangle corners to coordinates in which the
+     * ellipse is the unit circle.
+     */
+    qx[0] = qx[3] = rx1 - cx;
+    qx[1] = qx[2] = rx2 - cx;
+    qy[0] = qy[1] = ry1 - cy;
+    qy[2] = qy[3] = ry2 - cy;
+    for(i = 0; i < 4; ++i) {
+        gdouble x = qx[i];
+        qx[i] = (x * ux + qy[i] * uy) / a;
+        qy[i] = (qy[i] * ux - x * uy) / b;
+    }
+    for(i = 0; i < 4; ++i) {
+        next = (i + 1) % 4;
+        if( sectionPtDistSqr(qx[i], qy[i], qx[next], qy[next], 0, 0) <= 1 )
+            return TRUE;
+        cross = qx[i] * qy[next] - qy[i] * qx[next];
+        isNeg = isNeg || cross < 0;
+        isPos = isPos || cross > 0;
+    }
+    /* the circle center is inside the rectangle */
+    return isNeg != isPos;
 }
-
@@ -1,29 +1,108 @@
 #ifndef HITTEST_H
 #define HITTEST_H
 
+#include "config.h"
+
+/* Point of freeform path. The coordinates should be accessed using dp_x,
+ * dp_y and dp_set.
+ */
+#ifdef COMPACT_PATHS
+
+/* Coordinates in 24.8 fixed point, the precision used in file.
+ */
+typedef struct {
+    gint32 x, y;
+} DrawPoint;
+
+static inline gdouble dp_x(const DrawPoint *pt)
+{
+    return pt->x / 256.0;
+}
+
+static inline gdouble dp_y(const DrawPoint *pt)
+{
+    return pt->y / 256.0;
+}
+
+static inline gint32 dp_toFixed(gdouble val)
+{
+    /* round before clamping, so the result is in range of gint32 */
+    val *= 256.0;
+    val = val < 0 ? val - 0.5 : val + 0.5;
+    return CLAMP(val, G_MININT32, G_MAXINT32);
+}
+
+static inline void dp_set(DrawPoint *pt, gdouble x, gdouble y)
+{
+    pt->x = dp_toFixed(x);
+    pt->y = dp_toFixed(y);
+}
+
+#else
+
 typedef struct {
     gdouble x, y;
 } DrawPoint;
 
-gboolean hittest_path(DrawPoint *pt, int ptCount,
+static inline gdouble dp_x(const DrawPoint *pt)
+{
+    return pt->x;
+}
+
+static inline gdouble dp_y(const DrawPoint *pt)
+{
+    return pt->y;
+}
+
+static inline void dp_set(DrawPoint *pt, gdouble x, gdouble y)
+{
+    pt->x = x;
+    pt->y = y;
+}
+
+#endif
+
+gboolean hittest_path(const DrawPoint *pt, int ptCount,
         gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
 
+/* Spatial index of path segments, speeds up hit test of long paths.
+ */
+typedef struct HittestPathIndex HittestPathIndex;
+
+HittestPathIndex *hittest_pathIndexNew(const DrawPoint *pt, int ptCount);
+
+/* Same as hittest_path but visits only segments whose bounding boxes
+ * overlap the rectangle. The index must be created for the same points.
+ */
+gboolean hittest_pathIndexed(const HittestPathIndex*,
+        const DrawPoint *pt, int ptCount, gdouble thickness,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
+
+void hittest_pathIndexFree(HittestPathIndex*);
+
 gboolean hittest_line(gdouble lx1, gdouble ly1, gdouble lx2, gdouble ly2,
         gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
 
+/* Tests the arrow shaft and head, with parameters as for sd_pathArrow.
+ */
 gboolean hittest_arrow(gdouble lx1, gdouble ly1, gdouble lx2, gdouble ly2,
-        gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
+        gdouble thickness, gdouble proportion, gdouble angle, gboolean isRight,
+        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
 
 gboolean hittest_triangle(gdouble txBeg, gdouble tyBeg, gdouble txEnd,
-        gdouble tyEnd, gdouble angle, gdouble round, gdouble thickness,
-        gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
+        gdouble tyEnd, gdouble angle, gboolean isRight, gdouble round,
+        gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
 
+/* Rectangle and ellipse are rotated by the angle, in degrees, as drawn
+ * by sd_pathRect and sd_pathOval.
+ */
 gboolean hittest_rect(gdouble rtx1, gdouble rty1, gdouble rtx2, gdouble rty2,
-        gdouble round, gdouble thickness,
+        gdouble round, gdouble angle, gboolean isRight, gdouble thickness,
         gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
 
 gboolean hittest_ellipse(
         gdouble ex1, gdouble ey1, gdouble ex2, gdouble ey2,
+        gdouble angle, gboolean isRight,
         gdouble thickness, gdouble rx1, gdouble ry1, gdouble rx2, gdouble ry2);
 
 #endif /* HITTEST_H */
@@ -1,39 +1,318 @@
 #include <gtk/gtk.h>
 #include <cairo/cairo-pdf.h>
-#include <cairo/cairo-svg.h>
 #include "drawimage.h"
 #include "imgtype.h"
 #include "imagefile.h"
+#include "pngwriter.h"
 #include <string.h>
+#include <math.h>
 
 
-DrawImage *imgfile_open(const char *fileName, gchar **errLoc,
+enum {
+    EXPORT_BAND_HEIGHT = 64,
+    EXPORT_BAND_COUNT = 3       /* bands being rendered or encoded */
+};
+
+typedef struct {
+    const DrawImageSnapshot *snapshot;
+    gint width, height;
+    gdouble zoom;
+    GAsyncQueue *freeBands;     /* band surfaces available for rendering */
+    GAsyncQueue *readyBands;    /* rendered bands, in order from the top */
+    gint isCancelled;
+} BandRenderer;
+
+/* One output file of imgfile_saveScaled
+ */
+typedef struct {
+    const DrawImageSnapshot *snapshot;
+    gint width, height;
+    gdouble zoom;
+    const char *fileName;
+    const char *typeId;         /* gdk-pixbuf format name */
+    gint compressionLevel;      /* for PNG */
+    gboolean isOK;
+    gchar *err;
+} ScaledOutput;
+
+/* Returns MIME type of image file contents which may be embedded as is
+ * in PDF or SVG file, NULL if the format is not embeddable.
+ */
+static const char *getEmbeddableMimeType(GdkPixbufLoader *loader)
+{
+    GdkPixbufFormat *format = gdk_pixbuf_loader_get_format(loader);
+    gchar *name;
+    const char *res = NULL;
+
+    if( format != NULL ) {
+        name = gdk_pixbuf_format_get_name(format);
+        if( !strcmp(name, "jpeg") )
+            res = CAIRO_MIME_TYPE_JPEG;
+        else if( !strcmp(name, "png") )
+            res = CAIRO_MIME_TYPE_PNG;
+        g_free(name);
+    }
+    return res;
+}
+
+/* Decodes the image using the file contents read into memory. The contents
+ * are kept with base image when they may be written to PDF or SVG as is.
+ */
+static DrawImage *openPixbufImage(const char *fileName, gchar **errLoc,
         gboolean *isNoEntErr)
 {
     DrawImage *di = NULL;
-    int nameLen = strlen(fileName);
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf = NULL;
+    const char *mimeType;
+    gchar *contents;
+    gsize length;
     GError *gerr = NULL;
 
-    if( nameLen >= 4 && !strcasecmp(fileName + nameLen - 4, ".wlq") ) {
-        di = di_openWLQ(fileName, errLoc, isNoEntErr);
+    if( ! g_file_get_contents(fileName, &contents, &length, &gerr) ) {
+        *isNoEntErr = g_error_matches(gerr, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+        *errLoc = g_strdup(gerr->message);
+        g_error_free(gerr);
+        return NULL;
+    }
+    loader = gdk_pixbuf_loader_new();
+    if( gdk_pixbuf_loader_write(loader, (const guchar*)contents, length,
+                &gerr) && gdk_pixbuf_loader_close(loader, &gerr) )
+    {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
     }else{
-        GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(fileName, &gerr);
-        if( pixbuf != NULL ) {
-            di = di_new(gdk_pixbuf_get_width(pixbuf),
-                    gdk_pixbuf_get_height(pixbuf), pixbuf);
-            g_object_unref(pixbuf);
-        }else{
-            *isNoEntErr =
-                    g_error_matches(gerr, G_FILE_ERROR, G_FILE_ERROR_NOENT)
-                || g_error_matches(gerr, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
-            *errLoc = g_strdup(gerr->message);
-            g_error_free(gerr);
+        /* the loader should be closed even after failed write */
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+    if( pixbuf != NULL ) {
+        di = di_new(gdk_pixbuf_get_width(pixbuf),
+                gdk_pixbuf_get_height(pixbuf), pixbuf);
+        mimeType = getEmbeddableMimeType(loader);
+        if( mimeType != NULL ) {
+            di_setBaseImageMimeData(di, mimeType, (guchar*)contents, length);
+            contents = NULL;
         }
+    }else{
+        *errLoc = g_strdup_printf("%s: %s", fileName, gerr != NULL ?
+                gerr->message : "unrecognized image file format");
     }
+    if( gerr != NULL )
+        g_error_free(gerr);
+    g_object_unref(loader);
+    g_free(contents);
     return di;
 }
 
-gboolean imgfile_save(DrawImage *di, const char *fileName, gchar **errLoc)
+DrawImage *imgfile_open(const char *fileName, gchar **errLoc,
+        gboolean *isNoEntErr)
+{
+    int nameLen = strlen(fileName);
+
+    if( nameLen >= 4 && !strcasecmp(fileName + nameLen - 4, ".wlq") )
+        return di_openWLQ(fileName, errLoc, isNoEntErr);
+    return openPixbufImage(fileName, errLoc, isNoEntErr);
+}
+
+/* Renders the image in horizontal bands, in a separate thread.
+ */
+static gpointer renderBands(gpointer data)
+{
+    BandRenderer *br = data;
+    cairo_surface_t *band;
+    cairo_t *cr;
+    gint y;
+
+    for(y = 0; y < br->height; y += EXPORT_BAND_HEIGHT) {
+        band = g_async_queue_pop(br->freeBands);
+        if( g_atomic_int_get(&br->isCancelled) ) {
+            g_async_queue_push(br->freeBands, band);
+            break;
+        }
+        cr = cairo_create(band);
+        cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+        cairo_paint(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+        cairo_translate(cr, 0, -y);
+        di_snapshotDraw(br->snapshot, cr, br->zoom);
+        cairo_destroy(cr);
+        cairo_surface_flush(band);
+        g_async_queue_push(br->readyBands, band);
+    }
+    return NULL;
+}
+
+/* Renders the snapshot at zoom and writes it to PNG file. The width and
+ * height are the zoomed image size. May be called by any thread.
+ */
+static gboolean writePNG(const DrawImageSnapshot *snapshot, gint width,
+        gint height, gdouble zoom, const char *fileName,
+        gint compressionLevel, gchar **errLoc)
+{
+    BandRenderer br;
+    PngWriter *pw;
+    GThread *thread;
+    cairo_surface_t *band;
+    cairo_status_t status = CAIRO_STATUS_SUCCESS;
+    gint y, i;
+    gboolean isOK;
+
+    br.snapshot = snapshot;
+    br.width = width;
+    br.height = height;
+    br.zoom = zoom;
+    br.freeBands = g_async_queue_new_full(
+            (GDestroyNotify)cairo_surface_destroy);
+    br.readyBands = g_async_queue_new_full(
+            (GDestroyNotify)cairo_surface_destroy);
+    br.isCancelled = FALSE;
+    for(i = 0; i < EXPORT_BAND_COUNT; ++i) {
+        band = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, br.width,
+                EXPORT_BAND_HEIGHT);
+        if( status == CAIRO_STATUS_SUCCESS )
+            status = cairo_surface_status(band);
+        g_async_queue_push(br.freeBands, band);
+    }
+    if( status != CAIRO_STATUS_SUCCESS ) {
+        *errLoc = g_strdup_printf("%s: %s", fileName,
+                cairo_status_to_string(status));
+        isOK = FALSE;
+    }else if( (pw = pngw_create(fileName, br.width, br.height,
+                    compressionLevel, errLoc)) != NULL )
+    {
+        thread = g_thread_new("export", renderBands, &br);
+        isOK = TRUE;
+        for(y = 0; y < br.height && isOK; y += EXPORT_BAND_HEIGHT) {
+            band = g_async_queue_pop(br.readyBands);
+            isOK = pngw_writeRows(pw, cairo_image_surface_get_data(band),
+                    cairo_image_surface_get_stride(band),
+                    MIN(EXPORT_BAND_HEIGHT, br.height - y), errLoc);
+            /* set before the band is returned, so the render thread
+             * does not wait for bands which will not be returned */
+            if( ! isOK )
+                g_atomic_int_set(&br.isCancelled, TRUE);
+            g_async_queue_push(br.freeBands, band);
+        }
+        g_thread_join(thread);
+        if( isOK )
+            isOK = pngw_finish(pw, errLoc);
+        else
+            pngw_abort(pw);
+    }else
+        isOK = FALSE;
+    g_async_queue_unref(br.freeBands);
+    g_async_queue_unref(br.readyBands);
+    return isOK;
+}
+
+gboolean imgfile_savePNG(DrawImage *di, const char *fileName,
+        gint compressionLevel, gchar **errLoc)
+{
+    DrawImageSnapshot *snapshot = di_snapshotNew(di, FALSE);
+    gboolean isOK;
+
+    isOK = writePNG(snapshot, di_getWidth(di), di_getHeight(di), 1.0,
+            fileName, compressionLevel, errLoc);
+    di_snapshotFree(snapshot);
+    return isOK;
+}
+
+/* Writes one output of imgfile_saveScaled, in a separate thread.
+ */
+static gpointer writeScaledOutput(gpointer data)
+{
+    ScaledOutput *out = data;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    GdkPixbuf *pixbuf;
+    GError *gerr = NULL;
+
+    if( !strcmp(out->typeId, "png") ) {
+        out->isOK = writePNG(out->snapshot, out->width, out->height,
+                out->zoom, out->fileName, out->compressionLevel, &out->err);
+        return NULL;
+    }
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            out->width, out->height);
+    cr = cairo_create(surface);
+    di_snapshotDraw(out->snapshot, cr, out->zoom);
+    cairo_destroy(cr);
+    pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0,
+            out->width, out->height);
+    cairo_surface_destroy(surface);
+    if( pixbuf != NULL ) {
+        out->isOK = gdk_pixbuf_save(pixbuf, out->fileName, out->typeId,
+                &gerr, NULL);
+        g_object_unref(pixbuf);
+        if( ! out->isOK ) {
+            out->err = g_strdup(gerr->message);
+            g_error_free(gerr);
+        }
+    }else{
+        out->err = g_strdup_printf("%s: not enough memory", out->fileName);
+        out->isOK = FALSE;
+    }
+    return NULL;
+}
+
+gboolean imgfile_saveScaled(const DrawImage *di, gint count,
+        const gdouble *scales, const char *const *fileNames,
+        gint compressionLevel, gchar **errLoc)
+{
+    DrawImageSnapshot *snapshot;
+    ScaledOutput *outputs;
+    GThread **threads;
+    gdouble minScale = 1.0;
+    gint i, typeIdx;
+    gboolean isOK = TRUE;
+
+    for(i = 0; i < count; ++i) {
+        typeIdx = imgtype_getIdxByFileName(fileNames[i]);
+        if( typeIdx < 0 || ! imgtype_isWritable(typeIdx)
+                || !strcmp(imgtype_getId(typeIdx), "wilqpaint")
+                || !g_ascii_strcasecmp(imgtype_getId(typeIdx), "pdf")
+                || !g_ascii_strcasecmp(imgtype_getId(typeIdx), "svg") )
+        {
+            *errLoc = g_strdup_printf("%s: file format is unsupported"
+                    " for scaled export", fileNames[i]);
+            return FALSE;
+        }
+        minScale = MIN(minScale, scales[i]);
+    }
+    snapshot = di_snapshotNew(di, FALSE);
+    di_snapshotSetSelectionEmpty(snapshot);
+    di_snapshotAddBaseImageLevels(snapshot, minScale);
+    outputs = g_malloc(count * sizeof(ScaledOutput));
+    threads = g_malloc(count * sizeof(GThread*));
+    for(i = 0; i < count; ++i) {
+        outputs[i].snapshot = snapshot;
+        outputs[i].width = MAX(round(di_getWidth(di) * scales[i]), 1);
+        outputs[i].height = MAX(round(di_getHeight(di) * scales[i]), 1);
+        outputs[i].zoom = scales[i];
+        outputs[i].fileName = fileNames[i];
+        outputs[i].typeId = imgtype_getId(
+                imgtype_getIdxByFileName(fileNames[i]));
+        outputs[i].compressionLevel = compressionLevel;
+        outputs[i].isOK = FALSE;
+        outputs[i].err = NULL;
+        threads[i] = g_thread_new("export", writeScaledOutput, outputs + i);
+    }
+    for(i = 0; i < count; ++i) {
+        g_thread_join(threads[i]);
+        if( isOK && ! outputs[i].isOK ) {
+            *errLoc = outputs[i].err;
+            outputs[i].err = NULL;
+            isOK = FALSE;
+        }
+        g_free(outputs[i].err);
+    }
+    di_snapshotFree(snapshot);
+    g_free(threads);
+    g_free(outputs);
+    return isOK;
+}
+
+gboolean imgfile_save(DrawImage *di, const char *fileName,
+        gboolean isBaseImageLinked, gchar **errLoc)
 {
     int nameLen = strlen(fileName);
     GError *gerr = NULL;
@@ -52,6 +331,7 @@ gboolean imgfile_save(DrawImage *di, const char *fileName, gchar **errLoc)
         cairo_status_t status = cairo_surface_status(paintImage);
         isOK = status == CAIRO_STATUS_SUCCESS;
         if( isOK ) {
+            di_prepareVectorExport(di);
             cairo_t *cr = cairo_create(paintImage);
             di_draw(di, cr, 1.0);
             cairo_destroy(cr);
@@ -61,22 +341,13 @@ gboolean imgfile_save(DrawImage *di, const char *fileName, gchar **errLoc)
         }
         cairo_surface_destroy(paintImage);
     }else if( nameLen >= 4 && !strcasecmp(fileName + nameLen - 4, ".svg") ) {
-        cairo_surface_t *paintImage = cairo_svg_surface_create(fileName,
-                imgWidth, imgHeight);
-        cairo_status_t status = cairo_surface_status(paintImage);
-        isOK = status == CAIRO_STATUS_SUCCESS;
-        if( isOK ) {
-            cairo_t *cr = cairo_create(paintImage);
-            di_draw(di, cr, 1.0);
-            cairo_destroy(cr);
-        }else{
-            *errLoc = g_strdup_printf("%s: %s", fileName,
-                    cairo_status_to_string(status));
-        }
-        cairo_surface_destroy(paintImage);
+        di_prepareVectorExport(di);
+        isOK = di_saveSVG(di, fileName, isBaseImageLinked, errLoc);
     }else{
         typeIdx = imgtype_getIdxByFileName(fileName);
-        if( typeIdx >= 0 && imgtype_isWritable(typeIdx) ) {
+        if( typeIdx >= 0 && !strcmp(imgtype_getId(typeIdx), "png") ) {
+            isOK = imgfile_savePNG(di, fileName, -1, errLoc);
+        }else if( typeIdx >= 0 && imgtype_isWritable(typeIdx) ) {
             GdkPixbuf *pixbuf = di_toPixbuf(di);
             isOK = gdk_pixbuf_save(pixbuf, fileName,
                     imgtype_getId(typeIdx), &gerr, NULL);
@@ -3,7 +3,28 @@
 
 DrawImage *imgfile_open(const char *fileName, gchar **errLoc,
         gboolean *isNoEntErr);
-gboolean imgfile_save(DrawImage*, const char *fileName, gchar **errLoc);
+/* Saves the image in format determined by the file name extension. When
+ * isBaseImageLinked is set, the base image of SVG file is written to
+ * a separate file.
+ */
+gboolean imgfile_save(DrawImage*, const char *fileName,
+        gboolean isBaseImageLinked, gchar **errLoc);
+
+/* Writes the image to PNG file. The image is rendered and encoded in
+ * parts, so the whole rendered image is never kept in memory.
+ * The compressionLevel is 0 (none) to 9 (best), -1 for default.
+ */
+gboolean imgfile_savePNG(DrawImage*, const char *fileName,
+        gint compressionLevel, gchar **errLoc);
+
+/* Writes the image scaled by each of scales to the corresponding file.
+ * The files are rendered concurrently, from a shared image snapshot.
+ * Only raster formats are supported. The compressionLevel is used for PNG
+ * files, as in imgfile_savePNG.
+ */
+gboolean imgfile_saveScaled(const DrawImage*, gint count,
+        const gdouble *scales, const char *const *fileNames,
+        gint compressionLevel, gchar **errLoc);
 
 
 #endif /* IMAGEFILE_H */
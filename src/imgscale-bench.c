@@ -0,0 +1,95 @@
+/* Measures speed of imgscale_scale for each of the filters, scaling
+ * an image down and up. The speed is reported in megapixels of the
+ * result per second.
+ */
+#include <gtk/gtk.h>
+#include "imgscale.h"
+#include <stdio.h>
+
+
+enum {
+    SOURCE_WIDTH = 2000,
+    SOURCE_HEIGHT = 1500,
+    BENCH_TIME_MIN = 500000     /* microseconds */
+};
+
+static const struct {
+    const char *name;
+    ImageScaleFilter filter;
+} gFilters[] = {
+    { "box",        ISF_BOX },
+    { "bilinear",   ISF_BILINEAR },
+    { "Lanczos3",   ISF_LANCZOS3 }
+};
+
+static const gdouble gScales[] = { 0.3, 0.5, 1.5 };
+
+/* Fills the image with random premultiplied pixels
+ */
+static cairo_surface_t *createSourceImage(void)
+{
+    cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            SOURCE_WIDTH, SOURCE_HEIGHT);
+    GRand *rand = g_rand_new_with_seed(1);
+    guint32 *row, alpha;
+    gint x, y, k;
+
+    cairo_surface_flush(image);
+    for(y = 0; y < SOURCE_HEIGHT; ++y) {
+        row = (guint32*)(cairo_image_surface_get_data(image)
+                + y * cairo_image_surface_get_stride(image));
+        for(x = 0; x < SOURCE_WIDTH; ++x) {
+            alpha = g_rand_int_range(rand, 0, 256);
+            row[x] = alpha << 24;
+            for(k = 0; k < 3; ++k)
+                row[x] |= g_rand_int_range(rand, 0, alpha + 1) << 8 * k;
+        }
+    }
+    cairo_surface_mark_dirty(image);
+    g_rand_free(rand);
+    return image;
+}
+
+/* Returns megapixels of the result per second
+ */
+static gdouble benchScale(cairo_surface_t *src, gdouble scale,
+        ImageScaleFilter filter)
+{
+    gint width = MAX(SOURCE_WIDTH * scale, 1);
+    gint height = MAX(SOURCE_HEIGHT * scale, 1);
+    gint64 start = g_get_monotonic_time(), elapsed;
+    gint count = 0;
+
+    do {
+        cairo_surface_destroy(imgscale_scale(src, width, height, filter));
+        ++count;
+        elapsed = g_get_monotonic_time() - start;
+    } while( elapsed < BENCH_TIME_MIN );
+    return (gdouble)width * height * count / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    cairo_surface_t *src = createSourceImage();
+    gint i, j;
+
+    if( cairo_surface_status(src) != CAIRO_STATUS_SUCCESS ) {
+        fprintf(stderr, "unable to create source image\n");
+        return 1;
+    }
+    printf("%dx%d source image, result MP/s on %d threads\n",
+            SOURCE_WIDTH, SOURCE_HEIGHT, g_get_num_processors());
+    printf("%-10s", "filter");
+    for(j = 0; j < G_N_ELEMENTS(gScales); ++j)
+        printf("   scale %-4g", gScales[j]);
+    printf("\n");
+    for(i = 0; i < G_N_ELEMENTS(gFilters); ++i) {
+        printf("%-10s", gFilters[i].name);
+        for(j = 0; j < G_N_ELEMENTS(gScales); ++j)
+            printf(" %12.1f", benchScale(src, gScales[j],
+                        gFilters[i].filter));
+        printf("\n");
+    }
+    cairo_surface_destroy(src);
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <gtk/gtk.h>
+#include "imgscale.h"
+#include <math.h>
+#include <string.h>
+
+
+enum {
+    ROWS_PER_THREAD_MIN = 32
+};
+
+/* Four channels of a pixel. The channels are filtered independently,
+ * so with GCC vector extension all of them are computed by single SIMD
+ * instruction. The buffers are not assumed aligned to the vector size.
+ */
+#ifdef __GNUC__
+typedef gfloat Pixel __attribute__((vector_size(4 * sizeof(gfloat)),
+            aligned(sizeof(gfloat))));
+#else
+typedef struct {
+    gfloat c[4];
+} Pixel;
+#endif
+
+/* Adds src multiplied by weight to acc
+ */
+static inline void pixelAddWeighted(Pixel *acc, gfloat weight,
+        const Pixel *src)
+{
+#ifdef __GNUC__
+    *acc += weight * *src;
+#else
+    gint k;
+
+    for(k = 0; k < 4; ++k)
+        acc->c[k] += weight * src->c[k];
+#endif
+}
+
+/* Source pixels contributing to each destination pixel, along one axis.
+ */
+typedef struct {
+    gint taps;          /* weights allocated per destination pixel */
+    gint *start;        /* first contributing source pixel */
+    gint *count;        /* number of contributing source pixels */
+    gfloat *weights;
+} Contributions;
+
+typedef struct {
+    const guchar *srcData;
+    gint srcWidth, srcStride;
+    guchar *destData;
+    gint destWidth, destStride;
+    Contributions horiz, vert;
+} ScaleJob;
+
+typedef struct {
+    const ScaleJob *job;
+    gint rowFirst, rowEnd;
+} ScaleBand;
+
+static gdouble filterSupport(ImageScaleFilter filter)
+{
+    switch( filter ) {
+    case ISF_BOX:
+        return 0.5;
+    case ISF_BILINEAR:
+        return 1.0;
+    default:
+        return 3.0;
+    }
+}
+
+static gdouble sinc(gdouble x)
+{
+    return x == 0.0 ? 1.0 : sin(G_PI * x) / (G_PI * x);
+}
+
+static gdouble filterValue(ImageScaleFilter filter, gdouble x)
+{
+    x = fabs(x);
+    switch( filter ) {
+    case ISF_BOX:
+        return x <= 0.5 ? 1.0 : 0.0;
+    case ISF_BILINEAR:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    default:
+        return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    }
+}
+
+/* Computes the filter weights. Source pixels outside of the image are
+ * replaced by the nearest edge pixel.
+ */
+static void initContributions(Contributions *contrib, gint srcLen,
+        gint destLen, ImageScaleFilter filter)
+{
+    gdouble scale = (gdouble)destLen / srcLen;
+    gdouble filterScale = scale < 1.0 ? scale : 1.0;
+    gdouble support = filterSupport(filter) / filterScale;
+    gdouble center, weight, weightSum;
+    gfloat *weights;
+    gint i, j, lo, hi, first, last;
+
+    contrib->taps = MIN((gint)floor(2.0 * support) + 2, srcLen);
+    contrib->start = g_malloc(destLen * sizeof(gint));
+    contrib->count = g_malloc(destLen * sizeof(gint));
+    contrib->weights = g_malloc0(destLen * contrib->taps * sizeof(gfloat));
+    for(i = 0; i < destLen; ++i) {
+        center = (i + 0.5) / scale - 0.5;
+        lo = ceil(center - support);
+        hi = floor(center + support);
+        first = CLAMP(lo, 0, srcLen - 1);
+        last = CLAMP(hi, 0, srcLen - 1);
+        weights = contrib->weights + i * contrib->taps;
+        weightSum = 0.0;
+        for(j = lo; j <= hi; ++j) {
+            weight = filterValue(filter, (j - center) * filterScale);
+            weights[CLAMP(j, 0, srcLen - 1) - first] += weight;
+            weightSum += weight;
+        }
+        if( weightSum != 0.0 ) {
+            for(j = 0; j <= last - first; ++j)
+                weights[j] /= weightSum;
+        }
+        contrib->start[i] = first;
+        contrib->count[i] = last - first + 1;
+    }
+}
+
+static void freeContributions(Contributions *contrib)
+{
+    g_free(contrib->start);
+    g_free(contrib->count);
+    g_free(contrib->weights);
+}
+
+/* Converts the row to floats. The channel order does not matter, except
+ * the alpha channel is the last one.
+ */
+static void unpackRow(gfloat *dest, const guint32 *src, gint width)
+{
+    guint32 pixel;
+    gint i;
+
+    for(i = 0; i < width; ++i) {
+        pixel = src[i];
+        dest[0] = pixel & 0xff;
+        dest[1] = pixel >> 8 & 0xff;
+        dest[2] = pixel >> 16 & 0xff;
+        dest[3] = pixel >> 24;
+        dest += 4;
+    }
+}
+
+static void packRow(guint32 *dest, const gfloat *src, gint width)
+{
+    guint32 pixel, alpha;
+    gint i, k;
+
+    for(i = 0; i < width; ++i) {
+        /* the filter may overshoot; color of premultiplied pixel cannot
+         * exceed the alpha */
+        alpha = CLAMP((gint)(src[3] + 0.5f), 0, 255);
+        pixel = alpha << 24;
+        for(k = 0; k < 3; ++k)
+            pixel |= (guint32)CLAMP((gint)(src[k] + 0.5f), 0,
+                    (gint)alpha) << 8 * k;
+        dest[i] = pixel;
+        src += 4;
+    }
+}
+
+static void scaleRowHorizontally(const ScaleJob *job, gint srcY,
+        gfloat *srcRow, gfloat *dest)
+{
+    const Contributions *contrib = &job->horiz;
+    const gfloat *weights;
+    const Pixel *src;
+    Pixel sum;
+    gint x, t;
+
+    unpackRow(srcRow, (const guint32*)(job->srcData + srcY * job->srcStride),
+            job->srcWidth);
+    for(x = 0; x < job->destWidth; ++x) {
+        weights = contrib->weights + x * contrib->taps;
+        src = (const Pixel*)srcRow + contrib->start[x];
+        memset(&sum, 0, sizeof(sum));
+        for(t = 0; t < contrib->count[x]; ++t)
+            pixelAddWeighted(&sum, weights[t], src + t);
+        ((Pixel*)dest)[x] = sum;
+    }
+}
+
+/* Computes destination rows of the band. Source rows scaled horizontally
+ * are kept in a ring buffer, as the subsequent destination rows use
+ * mostly the same source rows.
+ */
+static gpointer scaleBand(gpointer data)
+{
+    const ScaleBand *band = data;
+    const ScaleJob *job = band->job;
+    const Contributions *contrib = &job->vert;
+    gint rowLen = 4 * job->destWidth;
+    gfloat *srcRow = g_malloc(4 * job->srcWidth * sizeof(gfloat));
+    gfloat *rows = g_malloc(contrib->taps * rowLen * sizeof(gfloat));
+    gint *rowSrcY = g_malloc(contrib->taps * sizeof(gint));
+    gfloat *acc = g_malloc(rowLen * sizeof(gfloat));
+    const gfloat *weights;
+    const Pixel *row;
+    gint y, t, x, srcY, slot;
+
+    for(t = 0; t < contrib->taps; ++t)
+        rowSrcY[t] = -1;
+    for(y = band->rowFirst; y < band->rowEnd; ++y) {
+        weights = contrib->weights + y * contrib->taps;
+        memset(acc, 0, rowLen * sizeof(gfloat));
+        for(t = 0; t < contrib->count[y]; ++t) {
+            srcY = contrib->start[y] + t;
+            slot = srcY % contrib->taps;
+            if( rowSrcY[slot] != srcY ) {
+                scaleRowHorizontally(job, srcY, srcRow, rows + slot * rowLen);
+                rowSrcY[slot] = srcY;
+            }
+            row = (const Pixel*)(rows + slot * rowLen);
+            for(x = 0; x < job->destWidth; ++x)
+                pixelAddWeighted((Pixel*)acc + x, weights[t], row + x);
+        }
+        packRow((guint32*)(job->destData + y * job->destStride), acc,
+                job->destWidth);
+    }
+    g_free(srcRow);
+    g_free(rows);
+    g_free(rowSrcY);
+    g_free(acc);
+    return NULL;
+}
+
+cairo_surface_t *imgscale_scale(cairo_surface_t *src, gint width,
+        gint height, ImageScaleFilter filter)
+{
+    cairo_surface_t *dest;
+    ScaleJob job;
+    ScaleBand *bands;
+    GThread **threads;
+    gint threadCount, i;
+
+    dest = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    if( cairo_surface_status(dest) != CAIRO_STATUS_SUCCESS )
+        return dest;
+    cairo_surface_flush(src);
+    cairo_surface_flush(dest);
+    job.srcData = cairo_image_surface_get_data(src);
+    job.srcWidth = cairo_image_surface_get_width(src);
+    job.srcStride = cairo_image_surface_get_stride(src);
+    job.destData = cairo_image_surface_get_data(dest);
+    job.destWidth = width;
+    job.destStride = cairo_image_surface_get_stride(dest);
+    initContributions(&job.horiz, job.srcWidth, width, filter);
+    initContributions(&job.vert, cairo_image_surface_get_height(src),
+            height, filter);
+    threadCount = CLAMP(height / ROWS_PER_THREAD_MIN, 1,
+            g_get_num_processors());
+    bands = g_malloc(threadCount * sizeof(ScaleBand));
+    threads = g_malloc(threadCount * sizeof(GThread*));
+    for(i = 0; i < threadCount; ++i) {
+        bands[i].job = &job;
+        bands[i].rowFirst = height * i / threadCount;
+        bands[i].rowEnd = height * (i + 1) / threadCount;
+    }
+    /* the last band is computed by the calling thread */
+    for(i = 0; i < threadCount - 1; ++i)
+        threads[i] = g_thread_new("scale", scaleBand, bands + i);
+    scaleBand(bands + threadCount - 1);
+    for(i = 0; i < threadCount - 1; ++i)
+        g_thread_join(threads[i]);
+    g_free(threads);
+    g_free(bands);
+    freeContributions(&job.horiz);
+    freeContributions(&job.vert);
+    cairo_surface_mark_dirty(dest);
+    return dest;
+}
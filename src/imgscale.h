@@ -0,0 +1,20 @@
+#ifndef IMGSCALE_H
+#define IMGSCALE_H
+
+typedef enum {
+    ISF_BOX,            /* averages covered pixels; fast */
+    ISF_BILINEAR,
+    ISF_LANCZOS3        /* sharpest, slowest */
+} ImageScaleFilter;
+
+/* Returns new ARGB32 image with the source image resampled to the given
+ * size using the filter. When the image is scaled down, the filter is
+ * widened to cover all source pixels, so the result is not aliased.
+ * Rows of the result are computed in parallel threads. When the image
+ * cannot be created, returns a surface in error state, as
+ * cairo_image_surface_create does.
+ */
+cairo_surface_t *imgscale_scale(cairo_surface_t *src, gint width,
+        gint height, ImageScaleFilter);
+
+#endif /* IMGSCALE_H */
@@ -46,9 +46,14 @@ static void on_updatePreview(GtkFileChooser *chooser, gpointer user_data)
             if( imgHeight > 480 )
                 scaleY = 480.0 / imgHeight;
             if( scaleX < 1.0 || scaleY < 1.0 ) {
-                di_scale(par->di, scaleX < scaleY ? scaleX : scaleY);
-                imgWidth = di_getWidth(par->di);
-                imgHeight = di_getHeight(par->di);
+                /* on failure the preview is shown clipped */
+                if( di_scale(par->di, scaleX < scaleY ? scaleX : scaleY,
+                            ISF_BOX, &err) )
+                {
+                    imgWidth = di_getWidth(par->di);
+                    imgHeight = di_getHeight(par->di);
+                }else
+                    g_free(err);
             }
             gtk_widget_set_size_request(GTK_WIDGET(par->previewImage),
                     imgWidth, imgHeight);
@@ -0,0 +1,314 @@
+#include <gtk/gtk.h>
+#include "pngwriter.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+enum {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVERAGE,
+    PNG_FILTER_PAETH,
+    PNG_FILTER_COUNT
+};
+
+enum {
+    PNG_BYTES_PER_PIXEL = 4,    /* RGBA, 8 bits per sample */
+    IDAT_SIZE_MAX = 65536
+};
+
+static const guchar pngSignature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+};
+
+struct PngWriter {
+    GOutputStream *outStrm;
+    GCancellable *cancellable;      /* cancelled on abort */
+    GConverter *compressor;
+    gint width, height;
+    gint rowBytes;
+    guchar *prevRow, *curRow;       /* unpremultiplied RGBA */
+    guchar *filtered[PNG_FILTER_COUNT];  /* filter type followed by row */
+    guchar outBuf[IDAT_SIZE_MAX];   /* compressed data not written yet */
+    gsize outLen;
+};
+
+static guint32 crcTable[256];
+
+static gpointer initCrcTable(gpointer data)
+{
+    guint32 c;
+    int n, k;
+
+    for(n = 0; n < 256; ++n) {
+        c = n;
+        for(k = 0; k < 8; ++k)
+            c = c & 1 ? 0xedb88320u ^ c >> 1 : c >> 1;
+        crcTable[n] = c;
+    }
+    return NULL;
+}
+
+static guint32 updateCrc(guint32 crc, const guchar *data, gsize len)
+{
+    static GOnce crcOnce = G_ONCE_INIT;
+    gsize i;
+
+    g_once(&crcOnce, initCrcTable, NULL);
+    for(i = 0; i < len; ++i)
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ crc >> 8;
+    return crc;
+}
+
+static void putU32(guchar *dest, guint32 val)
+{
+    dest[0] = val >> 24;
+    dest[1] = val >> 16;
+    dest[2] = val >> 8;
+    dest[3] = val;
+}
+
+static gboolean writeAll(PngWriter *pw, const void *data, gsize size,
+        gchar **errLoc)
+{
+    GError *gerr = NULL;
+
+    if( g_output_stream_write_all(pw->outStrm, data, size, NULL,
+                pw->cancellable, &gerr) )
+        return TRUE;
+    *errLoc = g_strdup(gerr->message);
+    g_error_free(gerr);
+    return FALSE;
+}
+
+static gboolean writeChunk(PngWriter *pw, const char *type,
+        const guchar *data, gsize len, gchar **errLoc)
+{
+    guchar lenBuf[4], crcBuf[4];
+    guint32 crc = 0xffffffffu;
+
+    crc = updateCrc(crc, (const guchar*)type, 4);
+    crc = updateCrc(crc, data, len);
+    putU32(lenBuf, len);
+    putU32(crcBuf, crc ^ 0xffffffffu);
+    return writeAll(pw, lenBuf, 4, errLoc)
+        && writeAll(pw, type, 4, errLoc)
+        && writeAll(pw, data, len, errLoc)
+        && writeAll(pw, crcBuf, 4, errLoc);
+}
+
+/* Compresses the data. The compressed data is written in IDAT chunks
+ * of maximum size. With atEnd set, flushes the compressor and writes
+ * the remaining data.
+ */
+static gboolean compressData(PngWriter *pw, const guchar *data, gsize len,
+        gboolean atEnd, gchar **errLoc)
+{
+    GConverterResult res;
+    gsize bytesRead, bytesWritten;
+    GError *gerr = NULL;
+
+    do {
+        res = g_converter_convert(pw->compressor, data, len,
+                pw->outBuf + pw->outLen, IDAT_SIZE_MAX - pw->outLen,
+                atEnd ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+                &bytesRead, &bytesWritten, &gerr);
+        if( res == G_CONVERTER_ERROR ) {
+            *errLoc = g_strdup(gerr->message);
+            g_error_free(gerr);
+            return FALSE;
+        }
+        data += bytesRead;
+        len -= bytesRead;
+        pw->outLen += bytesWritten;
+        if( pw->outLen == IDAT_SIZE_MAX
+                || (res == G_CONVERTER_FINISHED && pw->outLen > 0) )
+        {
+            if( ! writeChunk(pw, "IDAT", pw->outBuf, pw->outLen, errLoc) )
+                return FALSE;
+            pw->outLen = 0;
+        }
+    } while( len > 0 || (atEnd && res != G_CONVERTER_FINISHED) );
+    return TRUE;
+}
+
+PngWriter *pngw_create(const char *fileName, gint width, gint height,
+        gint compressionLevel, gchar **errLoc)
+{
+    GFile *gf;
+    GFileOutputStream *outStrm;
+    PngWriter *pw;
+    guchar ihdr[13];
+    GError *gerr = NULL;
+    int i;
+
+    gf = g_file_new_for_path(fileName);
+    outStrm = g_file_replace(gf, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &gerr);
+    g_object_unref(gf);
+    if( outStrm == NULL ) {
+        *errLoc = g_strdup(gerr->message);
+        g_error_free(gerr);
+        return NULL;
+    }
+    pw = g_malloc(sizeof(PngWriter));
+    pw->outStrm = G_OUTPUT_STREAM(outStrm);
+    pw->cancellable = g_cancellable_new();
+    pw->compressor = G_CONVERTER(g_zlib_compressor_new(
+                G_ZLIB_COMPRESSOR_FORMAT_ZLIB, compressionLevel));
+    pw->width = width;
+    pw->height = height;
+    pw->rowBytes = PNG_BYTES_PER_PIXEL * width;
+    pw->prevRow = g_malloc0(pw->rowBytes);
+    pw->curRow = g_malloc(pw->rowBytes);
+    for(i = 0; i < PNG_FILTER_COUNT; ++i) {
+        pw->filtered[i] = g_malloc(pw->rowBytes + 1);
+        pw->filtered[i][0] = i;
+    }
+    pw->outLen = 0;
+    putU32(ihdr, width);
+    putU32(ihdr + 4, height);
+    ihdr[8] = 8;        /* bit depth */
+    ihdr[9] = 6;        /* color type: RGBA */
+    ihdr[10] = 0;       /* compression method */
+    ihdr[11] = 0;       /* filter method */
+    ihdr[12] = 0;       /* no interlace */
+    if( ! writeAll(pw, pngSignature, sizeof(pngSignature), errLoc)
+            || ! writeChunk(pw, "IHDR", ihdr, sizeof(ihdr), errLoc) )
+    {
+        pngw_abort(pw);
+        pw = NULL;
+    }
+    return pw;
+}
+
+static void unpremultiplyRow(guchar *dest, const guint32 *src, gint width)
+{
+    guint32 pixel;
+    guint alpha;
+    gint i;
+
+    for(i = 0; i < width; ++i) {
+        pixel = src[i];
+        alpha = pixel >> 24;
+        if( alpha == 0 ) {
+            dest[0] = dest[1] = dest[2] = dest[3] = 0;
+        }else{
+            dest[0] = ((pixel >> 16 & 0xff) * 255 + alpha / 2) / alpha;
+            dest[1] = ((pixel >> 8 & 0xff) * 255 + alpha / 2) / alpha;
+            dest[2] = ((pixel & 0xff) * 255 + alpha / 2) / alpha;
+            dest[3] = alpha;
+        }
+        dest += 4;
+    }
+}
+
+static inline guchar paethPredictor(gint a, gint b, gint c)
+{
+    gint p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if( pa <= pb && pa <= pc )
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/* Applies all filters to the current row. Returns the filter giving
+ * the least sum of absolute differences, as suggested by PNG
+ * specification.
+ */
+static gint filterRow(PngWriter *pw)
+{
+    const guchar *cur = pw->curRow, *prev = pw->prevRow;
+    guchar *none = pw->filtered[PNG_FILTER_NONE] + 1;
+    guchar *sub = pw->filtered[PNG_FILTER_SUB] + 1;
+    guchar *up = pw->filtered[PNG_FILTER_UP] + 1;
+    guchar *avg = pw->filtered[PNG_FILTER_AVERAGE] + 1;
+    guchar *paeth = pw->filtered[PNG_FILTER_PAETH] + 1;
+    gulong sums[PNG_FILTER_COUNT] = { 0 };
+    gint i, left, upLeft, best;
+
+    for(i = 0; i < pw->rowBytes; ++i) {
+        left = i >= PNG_BYTES_PER_PIXEL ? cur[i - PNG_BYTES_PER_PIXEL] : 0;
+        upLeft = i >= PNG_BYTES_PER_PIXEL ? prev[i - PNG_BYTES_PER_PIXEL] : 0;
+        none[i] = cur[i];
+        sub[i] = cur[i] - left;
+        up[i] = cur[i] - prev[i];
+        avg[i] = cur[i] - (left + prev[i]) / 2;
+        paeth[i] = cur[i] - paethPredictor(left, prev[i], upLeft);
+        sums[PNG_FILTER_NONE] += abs((gint8)none[i]);
+        sums[PNG_FILTER_SUB] += abs((gint8)sub[i]);
+        sums[PNG_FILTER_UP] += abs((gint8)up[i]);
+        sums[PNG_FILTER_AVERAGE] += abs((gint8)avg[i]);
+        sums[PNG_FILTER_PAETH] += abs((gint8)paeth[i]);
+    }
+    best = PNG_FILTER_NONE;
+    for(i = 1; i < PNG_FILTER_COUNT; ++i) {
+        if( sums[i] < sums[best] )
+            best = i;
+    }
+    return best;
+}
+
+gboolean pngw_writeRows(PngWriter *pw, const guchar *data, gint stride,
+        gint rowCount, gchar **errLoc)
+{
+    guchar *tmp;
+    gint i, filter;
+
+    for(i = 0; i < rowCount; ++i) {
+        unpremultiplyRow(pw->curRow, (const guint32*)(data + i * stride),
+                pw->width);
+        filter = filterRow(pw);
+        if( ! compressData(pw, pw->filtered[filter], pw->rowBytes + 1,
+                    FALSE, errLoc) )
+            return FALSE;
+        tmp = pw->prevRow;
+        pw->prevRow = pw->curRow;
+        pw->curRow = tmp;
+    }
+    return TRUE;
+}
+
+static void freeWriter(PngWriter *pw)
+{
+    int i;
+
+    g_object_unref(pw->outStrm);
+    g_object_unref(pw->cancellable);
+    g_object_unref(pw->compressor);
+    g_free(pw->prevRow);
+    g_free(pw->curRow);
+    for(i = 0; i < PNG_FILTER_COUNT; ++i)
+        g_free(pw->filtered[i]);
+    g_free(pw);
+}
+
+gboolean pngw_finish(PngWriter *pw, gchar **errLoc)
+{
+    GError *gerr = NULL;
+    gboolean isOK;
+
+    isOK = compressData(pw, NULL, 0, TRUE, errLoc)
+        && writeChunk(pw, "IEND", NULL, 0, errLoc);
+    if( isOK ) {
+        isOK = g_output_stream_close(pw->outStrm, NULL, &gerr);
+        if( ! isOK ) {
+            *errLoc = g_strdup(gerr->message);
+            g_error_free(gerr);
+        }
+    }
+    if( isOK )
+        freeWriter(pw);
+    else
+        pngw_abort(pw);
+    return isOK;
+}
+
+void pngw_abort(PngWriter *pw)
+{
+    /* closing replaced file with cancelled operation leaves the original
+     * file unchanged */
+    g_cancellable_cancel(pw->cancellable);
+    g_output_stream_close(pw->outStrm, pw->cancellable, NULL);
+    freeWriter(pw);
+}
@@ -0,0 +1,28 @@
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+/* PNG file writer taking image rows in parts, so the whole image
+ * does not need to be kept in memory.
+ */
+typedef struct PngWriter PngWriter;
+
+/* Creates the file and writes the PNG header. The compressionLevel is
+ * zlib compression level, 0 (none) to 9 (best), -1 for default.
+ */
+PngWriter *pngw_create(const char *fileName, gint width, gint height,
+        gint compressionLevel, gchar **errLoc);
+
+/* Writes next image rows. The data is in CAIRO_FORMAT_ARGB32 format.
+ */
+gboolean pngw_writeRows(PngWriter*, const guchar *data, gint stride,
+        gint rowCount, gchar **errLoc);
+
+/* Writes the file end and closes the file. Frees the writer.
+ */
+gboolean pngw_finish(PngWriter*, gchar **errLoc);
+
+/* Closes the file without finishing it. Frees the writer.
+ */
+void pngw_abort(PngWriter*);
+
+#endif /* PNGWRITER_H */
@@ -5,7 +5,7 @@
 #include "imagefile.h"
 
 
-void on_fileFilter_changed(GtkComboBox *combo, gpointer user_data)
+void on_fileFilter_changed(GtkComboBox *combo, gpointer linkBaseImage)
 {
     GtkFileChooser *chooser;
     char *fname, *fnameNew, *dot;
@@ -20,15 +20,20 @@ void on_fileFilter_changed(GtkComboBox *combo, gpointer user_data)
             g_object_ref(imgtype_getFilter(idx)));
     fnameNew = g_strdup_printf("%s.%s", fname, imgtype_getDefaultExt(idx));
     gtk_file_chooser_set_current_name(chooser, fnameNew);
+    /* base image may be linked only from SVG file */
+    gtk_widget_set_visible(GTK_WIDGET(linkBaseImage),
+            !g_ascii_strcasecmp(imgtype_getId(idx), "svg"));
     g_free(fname);
     g_free(fnameNew);
 }
 
-gchar *showSaveFileDialog(GtkWindow *owner, const char *curFileName)
+gchar *showSaveFileDialog(GtkWindow *owner, const char *curFileName,
+        gboolean *isBaseImageLinked)
 {
     GtkBuilder *builder;
     GtkFileChooser *chooser;
     GtkComboBoxText *fileType;
+    GtkToggleButton *linkBaseImage;
     gchar *curName, *result = NULL;
     int i;
 
@@ -36,7 +41,10 @@ gchar *showSaveFileDialog(GtkWindow *owner, const char *curFileName)
             "/org/rafaello7/wilqpaint/savedialog.ui");
     chooser = GTK_FILE_CHOOSER(gtk_builder_get_object(builder, "saveDialog"));
     fileType = GTK_COMBO_BOX_TEXT(gtk_builder_get_object(builder, "fileType"));
+    linkBaseImage = GTK_TOGGLE_BUTTON(gtk_builder_get_object(builder,
+                "linkBaseImage"));
     g_object_unref(builder);
+    gtk_toggle_button_set_active(linkBaseImage, *isBaseImageLinked);
     if( curFileName != NULL ) {
         char *dirname = g_path_get_dirname(curFileName);
         gtk_file_chooser_set_current_folder(chooser, dirname);
@@ -52,7 +60,7 @@ gchar *showSaveFileDialog(GtkWindow *owner, const char *curFileName)
     gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
     gtk_file_chooser_set_current_name(chooser, curName);
     g_signal_connect(fileType, "changed",
-            G_CALLBACK(on_fileFilter_changed), NULL);
+            G_CALLBACK(on_fileFilter_changed), linkBaseImage);
     /* the manual set causes also "changed" signal to emit */
     i = imgtype_getIdxByFileName(curName);
     if( i >= 0 && imgtype_isWritable(i) )
@@ -60,8 +68,10 @@ gchar *showSaveFileDialog(GtkWindow *owner, const char *curFileName)
     else
         gtk_combo_box_set_active(GTK_COMBO_BOX(fileType), 0);
     gtk_window_set_transient_for(GTK_WINDOW(chooser), owner);
-    if( gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT )
+    if( gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT ) {
         result = gtk_file_chooser_get_filename(chooser);
+        *isBaseImageLinked = gtk_toggle_button_get_active(linkBaseImage);
+    }
     gtk_widget_destroy(GTK_WIDGET(chooser));
     g_free(curName);
     return result;
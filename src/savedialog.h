@@ -1,6 +1,10 @@
 #ifndef SAVEDIALOG_H
 #define SAVEDIALOG_H
 
-gchar *showSaveFileDialog(GtkWindow *owner, const char *fileName);
+/* Returns the chosen file name. The isBaseImageLinked is an option of SVG
+ * files, set initially and returned when the dialog is accepted.
+ */
+gchar *showSaveFileDialog(GtkWindow *owner, const char *fileName,
+        gboolean *isBaseImageLinked);
 
 #endif /* SAVEDIALOG_H */
@@ -0,0 +1,187 @@
+#include <gtk/gtk.h>
+#include "selection.h"
+#include <string.h>
+
+
+enum {
+    SEL_WORD_BITS = 8 * sizeof(gulong)
+};
+
+struct Selection {
+    gulong *words;
+    gint wordCount;
+};
+
+Selection *sel_new(void)
+{
+    Selection *sel = g_malloc(sizeof(Selection));
+    sel->words = NULL;
+    sel->wordCount = 0;
+    return sel;
+}
+
+Selection *sel_copyOf(const Selection *sel)
+{
+    Selection *res = sel_new();
+
+    if( sel->wordCount ) {
+        res->words = g_malloc(sel->wordCount * sizeof(gulong));
+        memcpy(res->words, sel->words, sel->wordCount * sizeof(gulong));
+        res->wordCount = sel->wordCount;
+    }
+    return res;
+}
+
+static void ensureCapacity(Selection *sel, gint wordCount)
+{
+    gint newCount;
+
+    if( wordCount > sel->wordCount ) {
+        newCount = sel->wordCount ? sel->wordCount : 4;
+        while( newCount < wordCount )
+            newCount *= 2;
+        sel->words = g_realloc(sel->words, newCount * sizeof(gulong));
+        memset(sel->words + sel->wordCount, 0,
+                (newCount - sel->wordCount) * sizeof(gulong));
+        sel->wordCount = newCount;
+    }
+}
+
+static inline int bitCount(gulong word)
+{
+#ifdef __GNUC__
+    return __builtin_popcountl(word);
+#else
+    int res = 0;
+    while( word ) {
+        word &= word - 1;
+        ++res;
+    }
+    return res;
+#endif
+}
+
+gboolean sel_contains(const Selection *sel, gint idx)
+{
+    gint wordIdx = idx / SEL_WORD_BITS;
+
+    return wordIdx < sel->wordCount
+        && (sel->words[wordIdx] & 1ul << idx % SEL_WORD_BITS) != 0;
+}
+
+void sel_add(Selection *sel, gint idx)
+{
+    ensureCapacity(sel, idx / SEL_WORD_BITS + 1);
+    sel->words[idx / SEL_WORD_BITS] |= 1ul << idx % SEL_WORD_BITS;
+}
+
+void sel_remove(Selection *sel, gint idx)
+{
+    gint wordIdx = idx / SEL_WORD_BITS;
+
+    if( wordIdx < sel->wordCount )
+        sel->words[wordIdx] &= ~(1ul << idx % SEL_WORD_BITS);
+}
+
+void sel_addRange(Selection *sel, gint first, gint count)
+{
+    gint wordIdx, lastWordIdx, last = first + count - 1;
+    gulong mask;
+
+    if( count <= 0 )
+        return;
+    wordIdx = first / SEL_WORD_BITS;
+    lastWordIdx = last / SEL_WORD_BITS;
+    ensureCapacity(sel, lastWordIdx + 1);
+    mask = ~0ul << first % SEL_WORD_BITS;
+    while( wordIdx < lastWordIdx ) {
+        sel->words[wordIdx++] |= mask;
+        mask = ~0ul;
+    }
+    mask &= ~0ul >> (SEL_WORD_BITS - 1 - last % SEL_WORD_BITS);
+    sel->words[wordIdx] |= mask;
+}
+
+void sel_addSet(Selection *sel, const Selection *other)
+{
+    gint i;
+
+    ensureCapacity(sel, other->wordCount);
+    for(i = 0; i < other->wordCount; ++i)
+        sel->words[i] |= other->words[i];
+}
+
+void sel_removeSet(Selection *sel, const Selection *other)
+{
+    gint i, count = MIN(sel->wordCount, other->wordCount);
+
+    for(i = 0; i < count; ++i)
+        sel->words[i] &= ~other->words[i];
+}
+
+void sel_clear(Selection *sel)
+{
+    if( sel->wordCount )
+        memset(sel->words, 0, sel->wordCount * sizeof(gulong));
+}
+
+gboolean sel_isEmpty(const Selection *sel)
+{
+    gint i;
+
+    for(i = 0; i < sel->wordCount; ++i) {
+        if( sel->words[i] )
+            return FALSE;
+    }
+    return TRUE;
+}
+
+gint sel_count(const Selection *sel)
+{
+    gint i, res = 0;
+
+    for(i = 0; i < sel->wordCount; ++i)
+        res += bitCount(sel->words[i]);
+    return res;
+}
+
+gint sel_next(const Selection *sel, gint idx)
+{
+    gint wordIdx = idx / SEL_WORD_BITS, bit;
+
+    if( idx < 0 )
+        return sel_next(sel, 0);
+    if( wordIdx >= sel->wordCount )
+        return -1;
+    bit = g_bit_nth_lsf(sel->words[wordIdx], idx % SEL_WORD_BITS - 1);
+    while( bit < 0 ) {
+        if( ++wordIdx == sel->wordCount )
+            return -1;
+        bit = g_bit_nth_lsf(sel->words[wordIdx], -1);
+    }
+    return wordIdx * SEL_WORD_BITS + bit;
+}
+
+void sel_move(Selection *sel, gint from, gint to)
+{
+    gboolean isSelected = sel_contains(sel, from);
+    gint step = from < to ? 1 : -1;
+
+    while( from != to ) {
+        if( sel_contains(sel, from + step) )
+            sel_add(sel, from);
+        else
+            sel_remove(sel, from);
+        from += step;
+    }
+    if( isSelected )
+        sel_add(sel, to);
+    else
+        sel_remove(sel, to);
+}
+
+void sel_free(Selection *sel)
+{
+    g_free(sel->words);
+    g_free(sel);
+}
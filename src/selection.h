@@ -0,0 +1,43 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+/* Set of shape indexes, stored as a bit set.
+ */
+typedef struct Selection Selection;
+
+Selection *sel_new(void);
+Selection *sel_copyOf(const Selection*);
+
+gboolean sel_contains(const Selection*, gint idx);
+void sel_add(Selection*, gint idx);
+void sel_remove(Selection*, gint idx);
+
+/* Adds indexes from range [first, first + count)
+ */
+void sel_addRange(Selection*, gint first, gint count);
+
+/* Adds all indexes contained in "other" to the selection.
+ */
+void sel_addSet(Selection*, const Selection *other);
+
+/* Removes all indexes contained in "other" from the selection.
+ */
+void sel_removeSet(Selection*, const Selection *other);
+
+void sel_clear(Selection*);
+gboolean sel_isEmpty(const Selection*);
+gint sel_count(const Selection*);
+
+/* Returns the lowest index in selection greater than or equal to idx.
+ * Returns -1 when there is no such index.
+ */
+gint sel_next(const Selection*, gint idx);
+
+/* Updates indexes after an element is moved from position "from" to
+ * position "to" in an array. Indexes between are shifted by one.
+ */
+void sel_move(Selection*, gint from, gint to);
+
+void sel_free(Selection*);
+
+#endif /* SELECTION_H */
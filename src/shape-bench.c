@@ -0,0 +1,113 @@
+/* Measures drawing of 1000 rectangles with translucent stroke and fill.
+ * Such shapes are drawn through an intermediate group, clipped to the
+ * shape area. For reference, the same rectangles are drawn also through
+ * groups covering the whole image.
+ */
+#include <gtk/gtk.h>
+#include "shape.h"
+#include <stdio.h>
+
+
+enum {
+    IMAGE_WIDTH = 1920,
+    IMAGE_HEIGHT = 1080,
+    SHAPE_COUNT = 1000,
+    BENCH_TIME_MIN = 1000000    /* microseconds */
+};
+
+typedef struct {
+    gdouble x1, y1, x2, y2;
+} Rect;
+
+static const ShapeParams gParams = {
+    .strokeColor = { 1.0, 1.0, 0.0, 0.5 },
+    .fillColor = { 0.0, 0.5, 1.0, 0.3 },
+    .textColor = { 0.0, 0.0, 0.0, 1.0 },
+    .thickness = 8
+};
+
+static void drawShapes(Shape **shapes, const Rect *rects, cairo_t *cr)
+{
+    gint i;
+
+    for(i = 0; i < SHAPE_COUNT; ++i)
+        shape_draw(shapes[i], cr, 1.0, FALSE, FALSE, FALSE);
+}
+
+/* Draws the rectangles as strokeAndFillShape did before the group was
+ * clipped.
+ */
+static void drawUnclipped(Shape **shapes, const Rect *rects, cairo_t *cr)
+{
+    gint i;
+
+    for(i = 0; i < SHAPE_COUNT; ++i) {
+        cairo_rectangle(cr, rects[i].x1, rects[i].y1,
+                rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+        cairo_push_group(cr);
+        gdk_cairo_set_source_rgba(cr, &gParams.fillColor);
+        cairo_fill_preserve(cr);
+        gdk_cairo_set_source_rgba(cr, &gParams.strokeColor);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_set_line_width(cr, gParams.thickness);
+        cairo_stroke(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+        cairo_pop_group_to_source(cr);
+        cairo_paint(cr);
+    }
+}
+
+/* Returns milliseconds per drawing of all shapes
+ */
+static gdouble benchDraw(void (*draw)(Shape**, const Rect*, cairo_t*),
+        Shape **shapes, const Rect *rects)
+{
+    cairo_surface_t *surface = cairo_image_surface_create(
+            CAIRO_FORMAT_ARGB32, IMAGE_WIDTH, IMAGE_HEIGHT);
+    cairo_t *cr = cairo_create(surface);
+    gint64 start = g_get_monotonic_time(), elapsed;
+    gint count = 0;
+
+    do {
+        cairo_save(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+        cairo_paint(cr);
+        cairo_restore(cr);
+        draw(shapes, rects, cr);
+        cairo_surface_flush(surface);
+        ++count;
+        elapsed = g_get_monotonic_time() - start;
+    } while( elapsed < BENCH_TIME_MIN );
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    return elapsed / 1000.0 / count;
+}
+
+int main(int argc, char *argv[])
+{
+    GRand *rand = g_rand_new_with_seed(1);
+    Shape *shapes[SHAPE_COUNT];
+    Rect rects[SHAPE_COUNT];
+    gint i;
+
+    for(i = 0; i < SHAPE_COUNT; ++i) {
+        rects[i].x1 = g_rand_int_range(rand, 0, IMAGE_WIDTH - 40);
+        rects[i].y1 = g_rand_int_range(rand, 0, IMAGE_HEIGHT - 40);
+        rects[i].x2 = MIN(rects[i].x1 + g_rand_int_range(rand, 20, 300),
+                IMAGE_WIDTH);
+        rects[i].y2 = MIN(rects[i].y1 + g_rand_int_range(rand, 20, 300),
+                IMAGE_HEIGHT);
+        shapes[i] = shape_new(ST_RECT, rects[i].x1, rects[i].y1, &gParams);
+        shape_layoutNew(shapes[i], rects[i].x2, rects[i].y2, FALSE);
+    }
+    printf("%d translucent rectangles on %dx%d image\n", SHAPE_COUNT,
+            IMAGE_WIDTH, IMAGE_HEIGHT);
+    printf("groups clipped to shape:  %8.2f ms\n",
+            benchDraw(drawShapes, shapes, rects));
+    printf("groups covering image:    %8.2f ms\n",
+            benchDraw(drawUnclipped, shapes, rects));
+    for(i = 0; i < SHAPE_COUNT; ++i)
+        shape_unref(shapes[i]);
+    g_rand_free(rand);
+    return 0;
+}
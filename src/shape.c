@@ -6,20 +6,127 @@
 #include <string.h>
 
 
+enum {
+    SIMPLIFY_WINDOW_MAX = 64,   /* max number of points dropped in a row */
+    PATHINDEX_MIN_POINTS = 64,  /* min path length to create path index */
+    LOD_MIN_POINTS = 64,        /* min path length to simplify when drawn */
+    LOD_LEVEL_COUNT = 8
+};
+
+/* Freeform paths simplified for drawing at low zoom. Level k is used for
+ * zoom in range (2^-(k+1), 2^-k] and has tolerance 2^k / 4. Levels are
+ * created on demand. Shared between copies of a shape until the path
+ * changes; guarded by pathCacheLock.
+ */
+typedef struct {
+    int refCount;
+    cairo_path_t *levels[LOD_LEVEL_COUNT];
+} PathLod;
+
+/* Points of freeform path, shared between copies of a shape. Points below
+ * count are not modified while shared: a shape appends points in place
+ * only when it has all of them, otherwise the points are copied first.
+ * Accessed by the main thread only; other threads just read the points.
+ */
+typedef struct {
+    int refCount;
+    int count;          /* points written */
+    int alloc;
+    DrawPoint points[];
+} PathPoints;
+
+/* Shape outline relative to xLeft, yTop, built at the zoom. Immutable;
+ * shared between copies of a shape and the threads drawing it.
+ */
+typedef struct {
+    gint refCount;          /* atomic */
+    cairo_path_t *path;
+    gdouble zoom;
+} PathCache;
+
+/* Guards drawn text size, bounds and text mask of shapes. Shapes are drawn
+ * also by the render thread, which updates these when a text is drawn.
+ */
+static GMutex drawCacheLock;
+
+/* Guards path cache of shapes.
+ */
+static GMutex pathCacheLock;
+
 struct Shape {
     ShapeType type;
     gdouble xLeft;
     gdouble xRight;
     gdouble yTop;
     gdouble yBottom;
-    DrawPoint *path;
+    PathPoints *path;
     int ptCount;
+    gdouble pathTolerance;      /* freeform simplification, 0 - none */
+    DrawPoint *dropped;         /* points dropped since the last kept one */
+    int droppedCount;
+    HittestPathIndex *pathIndex;    /* created on demand by shape_hitTest */
     ShapeParams params;
     int drawnTextWidth;
     int drawnTextHeight;
+    gboolean isBoundsValid;     /* bounds computed by shape_getBounds */
+    gdouble boundsX1, boundsY1, boundsX2, boundsY2;
+    cairo_surface_t *textMask;  /* text rendered for fast drawing */
+    gdouble textMaskZoom;
+    int textMaskX, textMaskY;   /* mask position relative to text box */
+    int textMaskWidth, textMaskHeight;  /* text box size */
+    PathCache *pathCache;
+    PathLod *pathLod;           /* freeform only, NULL when not drawn yet */
     int refCount;
 };
 
+static void freePath(cairo_path_t *path)
+{
+    g_free(path->data);
+    g_free(path);
+}
+
+static void pathPointsUnref(PathPoints *points)
+{
+    if( points != NULL && --points->refCount == 0 )
+        g_free(points);
+}
+
+/* Returns NULL when there is not enough memory
+ */
+static PathPoints *pathPointsTryNew(int alloc)
+{
+    PathPoints *points = g_try_malloc(sizeof(PathPoints)
+            + alloc * sizeof(DrawPoint));
+
+    if( points != NULL ) {
+        points->refCount = 1;
+        points->count = 0;
+        points->alloc = alloc;
+    }
+    return points;
+}
+
+static void pathCacheUnref(PathCache *cache)
+{
+    if( cache != NULL && g_atomic_int_dec_and_test(&cache->refCount) ) {
+        cairo_path_destroy(cache->path);
+        g_free(cache);
+    }
+}
+
+static void pathLodUnref(PathLod *lod)
+{
+    int i;
+
+    if( lod != NULL && --lod->refCount == 0 ) {
+        for(i = 0; i < LOD_LEVEL_COUNT; ++i) {
+            if( lod->levels[i] != NULL )
+                freePath(lod->levels[i]);
+        }
+        g_free(lod);
+    }
+}
+
 Shape *shape_new(ShapeType type, gdouble xRef, gdouble yRef,
         const ShapeParams *shapeParams)
 {
@@ -29,6 +136,10 @@ Shape *shape_new(ShapeType type, gdouble xRef, gdouble yRef,
     shape->yTop = shape->yBottom = yRef;
     shape->path = NULL;
     shape->ptCount = 0;
+    shape->pathTolerance = 0;
+    shape->dropped = NULL;
+    shape->droppedCount = 0;
+    shape->pathIndex = NULL;
     shape->params = *shapeParams;
     if( shapeParams->text != NULL && shapeParams->text[0] &&
             shapeParams->fontName != NULL && shapeParams->fontName[0] )
@@ -41,6 +152,10 @@ Shape *shape_new(ShapeType type, gdouble xRef, gdouble yRef,
     }
     shape->drawnTextWidth = 0;
     shape->drawnTextHeight = 0;
+    shape->isBoundsValid = FALSE;
+    shape->textMask = NULL;
+    shape->pathCache = NULL;
+    shape->pathLod = NULL;
     shape->refCount = 1;
     return shape;
 }
@@ -53,30 +168,66 @@ void shape_ref(Shape *shape)
 void shape_unref(Shape *shape)
 {
     if( --shape->refCount == 0 ) {
-        g_free(shape->path);
+        pathPointsUnref(shape->path);
+        g_free(shape->dropped);
+        hittest_pathIndexFree(shape->pathIndex);
         g_free((void*)shape->params.text);
         g_free((void*)shape->params.fontName);
+        if( shape->textMask != NULL )
+            cairo_surface_destroy(shape->textMask);
+        pathCacheUnref(shape->pathCache);
+        pathLodUnref(shape->pathLod);
     }
 }
 
-Shape *shape_copyOf(const Shape *shape)
+/* Should be called when layout or parameters are changed.
+ */
+static void invalidatePath(Shape *shape)
 {
-    int i;
+    pathCacheUnref(shape->pathCache);
+    shape->pathCache = NULL;
+}
 
+/* Should be called when text or font is changed. The text size is
+ * unknown until the shape is drawn again, so are the shape bounds.
+ */
+static void invalidateText(Shape *shape)
+{
+    if( shape->textMask != NULL ) {
+        cairo_surface_destroy(shape->textMask);
+        shape->textMask = NULL;
+    }
+    shape->drawnTextWidth = 0;
+    shape->drawnTextHeight = 0;
+}
+
+Shape *shape_copyOf(const Shape *shape)
+{
     Shape *copy = shape_new(shape->type, shape->xLeft, shape->yTop,
             &shape->params);
     if( shape->path != NULL ) {
-        copy->path = g_malloc(shape->ptCount * sizeof(*shape->path));
-        for(i = 0; i < shape->ptCount; ++i)
-            copy->path[i] = shape->path[i];
+        copy->path = shape->path;
+        ++copy->path->refCount;
         copy->ptCount = shape->ptCount;
     }
     copy->xLeft = shape->xLeft;
     copy->xRight = shape->xRight;
     copy->yTop = shape->yTop;
     copy->yBottom = shape->yBottom;
+    g_mutex_lock(&drawCacheLock);
     copy->drawnTextWidth = shape->drawnTextWidth;
     copy->drawnTextHeight = shape->drawnTextHeight;
+    g_mutex_unlock(&drawCacheLock);
+    g_mutex_lock(&pathCacheLock);
+    if( shape->pathCache != NULL ) {
+        copy->pathCache = shape->pathCache;
+        g_atomic_int_inc(&copy->pathCache->refCount);
+    }
+    if( shape->pathLod != NULL ) {
+        copy->pathLod = shape->pathLod;
+        ++copy->pathLod->refCount;
+    }
+    g_mutex_unlock(&pathCacheLock);
     return copy;
 }
 
@@ -90,6 +241,104 @@ Shape *shape_replaceDup(Shape **pShape)
     return *pShape;
 }
 
+/* Makes the path points owned by the shape only, with room for at least
+ * alloc points.
+ */
+static void pathPointsForModify(Shape *shape, int alloc)
+{
+    PathPoints *points;
+
+    if( shape->path == NULL || shape->path->refCount > 1 ) {
+        points = g_malloc(sizeof(PathPoints) + alloc * sizeof(DrawPoint));
+        points->refCount = 1;
+        points->alloc = alloc;
+        if( shape->ptCount > 0 ) {
+            memcpy(points->points, shape->path->points,
+                    shape->ptCount * sizeof(DrawPoint));
+        }
+        pathPointsUnref(shape->path);
+        shape->path = points;
+    }else if( shape->path->alloc < alloc ) {
+        shape->path = g_realloc(shape->path,
+                sizeof(PathPoints) + alloc * sizeof(DrawPoint));
+        shape->path->alloc = alloc;
+    }
+    shape->path->count = shape->ptCount;
+}
+
+static void appendPathPoint(Shape *shape, gdouble x, gdouble y)
+{
+    PathPoints *path = shape->path;
+
+    /* points of other shapes sharing the path are not overwritten */
+    if( path == NULL || path->count != shape->ptCount
+            || path->count == path->alloc )
+    {
+        pathPointsForModify(shape, MAX(2 * shape->ptCount, 16));
+    }
+    dp_set(shape->path->points + shape->ptCount, x, y);
+    shape->path->count = ++shape->ptCount;
+}
+
+/* Returns distance of point pt from segment (beg, end).
+ */
+static gdouble segmentDistance(const DrawPoint *pt, const DrawPoint *beg,
+        const DrawPoint *end)
+{
+    gdouble dx = dp_x(end) - dp_x(beg), dy = dp_y(end) - dp_y(beg);
+    gdouble px = dp_x(pt) - dp_x(beg), py = dp_y(pt) - dp_y(beg);
+    gdouble len2 = dx * dx + dy * dy, t = 0;
+
+    if( len2 > 0 ) {
+        t = (px * dx + py * dy) / len2;
+        t = CLAMP(t, 0, 1);
+    }
+    return hypot(px - t * dx, py - t * dy);
+}
+
+/* Adds point to freeform path. When path tolerance is set, the last path
+ * point is replaced by the new one provided that all points dropped since
+ * the previous kept point lie within tolerance from the new segment.
+ */
+static void addPathPoint(Shape *shape, gdouble x, gdouble y)
+{
+    DrawPoint pt, anchor, *last;
+    gboolean canDrop;
+    int i;
+
+    if( shape->pathTolerance > 0 && shape->ptCount > 0 ) {
+        dp_set(&pt, x, y);
+        if( shape->ptCount > 1 )
+            anchor = shape->path->points[shape->ptCount - 2];
+        else
+            dp_set(&anchor, 0, 0);
+        last = shape->path->points + shape->ptCount - 1;
+        canDrop = shape->droppedCount < SIMPLIFY_WINDOW_MAX
+            && segmentDistance(last, &anchor, &pt) <= shape->pathTolerance;
+        for(i = 0; i < shape->droppedCount && canDrop; ++i) {
+            canDrop = segmentDistance(shape->dropped + i, &anchor, &pt)
+                <= shape->pathTolerance;
+        }
+        if( canDrop ) {
+            if( shape->dropped == NULL )
+                shape->dropped = g_malloc(SIMPLIFY_WINDOW_MAX
+                        * sizeof(DrawPoint));
+            shape->dropped[shape->droppedCount++] = *last;
+            pathPointsForModify(shape, shape->path->alloc);
+            shape->path->points[shape->ptCount - 1] = pt;
+            return;
+        }
+        shape->droppedCount = 0;
+    }
+    appendPathPoint(shape, x, y);
+}
+
+void shape_setPathTolerance(Shape *shape, gdouble tolerance)
+{
+    shape->pathTolerance = tolerance;
+    shape->droppedCount = 0;
+}
+
 void shape_layoutNew(Shape *shape, gdouble xRight, gdouble yBottom,
         gboolean even)
 {
@@ -129,11 +378,14 @@ void shape_layoutNew(Shape *shape, gdouble xRight, gdouble yBottom,
     shape->xRight = xRight;
     shape->yBottom = yBottom;
     if( shape->type == ST_FREEFORM ) {
-        shape->path = g_realloc(shape->path,
-                ++shape->ptCount * sizeof(DrawPoint));
-        shape->path[shape->ptCount-1].x = xRight - shape->xLeft;
-        shape->path[shape->ptCount-1].y = yBottom - shape->yTop;
+        addPathPoint(shape, xRight - shape->xLeft, yBottom - shape->yTop);
+        hittest_pathIndexFree(shape->pathIndex);
+        shape->pathIndex = NULL;
+        pathLodUnref(shape->pathLod);
+        shape->pathLod = NULL;
     }
+    invalidatePath(shape);
+    shape->isBoundsValid = FALSE;
 }
 
 void shape_layout(Shape *shape, const Shape *prev, gdouble x, gdouble y,
@@ -200,6 +452,8 @@ void shape_layout(Shape *shape, const Shape *prev, gdouble x, gdouble y,
             break;
         }
     }
+    invalidatePath(shape);
+    shape->isBoundsValid = FALSE;
 }
 
 void shape_move(Shape *shape, const Shape *prev, gdouble x, gdouble y)
@@ -208,6 +462,7 @@ void shape_move(Shape *shape, const Shape *prev, gdouble x, gdouble y)
     shape->yTop = prev->yTop + y;
     shape->xRight = prev->xRight + x;
     shape->yBottom = prev->yBottom + y;
+    shape->isBoundsValid = FALSE;
 }
 
 ShapeType shape_getType(const Shape *shape)
@@ -215,19 +470,48 @@ ShapeType shape_getType(const Shape *shape)
     return shape->type;
 }
 
+int shape_getPathPointCount(const Shape *shape)
+{
+    return shape->ptCount;
+}
+
+gsize shape_getMemSize(const Shape *shape)
+{
+    gsize res = sizeof(Shape);
+
+    /* shared points are counted once for each shape */
+    if( shape->path != NULL )
+        res += sizeof(PathPoints) + shape->path->alloc * sizeof(DrawPoint);
+
+    if( shape->dropped != NULL )
+        res += SIMPLIFY_WINDOW_MAX * sizeof(DrawPoint);
+    if( shape->params.text != NULL )
+        res += strlen(shape->params.text) + 1;
+    if( shape->params.fontName != NULL )
+        res += strlen(shape->params.fontName) + 1;
+    return res;
+}
+
 void shape_scale(Shape *shape, gdouble factor)
 {
     int i;
+    DrawPoint *pt;
     PangoFontDescription *desc;
 
     shape->xLeft *= factor;
     shape->xRight *= factor;
     shape->yTop *= factor;
     shape->yBottom *= factor;
+    if( shape->path != NULL )
+        pathPointsForModify(shape, shape->path->alloc);
     for(i = 0; i < shape->ptCount; ++i) {
-        shape->path[i].x *= factor;
-        shape->path[i].y *= factor;
+        pt = shape->path->points + i;
+        dp_set(pt, factor * dp_x(pt), factor * dp_y(pt));
     }
+    hittest_pathIndexFree(shape->pathIndex);
+    shape->pathIndex = NULL;
+    pathLodUnref(shape->pathLod);
+    shape->pathLod = NULL;
     shape->params.thickness *= factor;
     shape->params.round *= factor;
     if( shape->params.fontName != NULL ) {
@@ -237,7 +521,10 @@ void shape_scale(Shape *shape, gdouble factor)
         g_free((void*)shape->params.fontName);
         shape->params.fontName = pango_font_description_to_string(desc);
         pango_font_description_free(desc);
+        invalidateText(shape);
     }
+    invalidatePath(shape);
+    shape->isBoundsValid = FALSE;
 }
 
 void shape_getParams(const Shape *shape, ShapeParams *shapeParams)
@@ -282,14 +569,18 @@ void shape_setParam(Shape *shape, enum ShapeParam shapeParam,
         }else{
             shape->params.text = NULL;
         }
+        invalidateText(shape);
         break;
     case SP_FONTNAME:
         if( shapeParams->fontName != NULL && shapeParams->fontName[0] ) {
             g_free((void*)shape->params.fontName);
             shape->params.fontName = g_strdup(shapeParams->fontName);
+            invalidateText(shape);
         }
         break;
     }
+    invalidatePath(shape);
+    shape->isBoundsValid = FALSE;
 }
 
 enum ShapeCorner shape_cornerHitTest(const Shape *shape, gdouble x,
@@ -324,10 +615,20 @@ enum ShapeCorner shape_cornerHitTest(const Shape *shape, gdouble x,
     return res;
 }
 
+/* Returns ratio of arrow head width to line width
+ */
+static gdouble getArrowProportion(const Shape *shape)
+{
+    return 1.0 + shape->params.round
+        * (0.02 + 0.1 / fmax(shape->params.thickness, 1.0));
+}
+
 gboolean shape_hitTest(const Shape *shape, gdouble xBeg, gdouble yBeg,
         gdouble xEnd, gdouble yEnd)
 {
     gboolean res = FALSE;
+    int textWidth, textHeight;
+    gdouble angle, xHalf, yHalf;
 
     if( xEnd < xBeg ) {
         gdouble t = xBeg;
@@ -341,8 +642,15 @@ gboolean shape_hitTest(const Shape *shape, gdouble xBeg, gdouble yBeg,
     }
     switch( shape->type ) {
     case ST_FREEFORM:
-        res = hittest_path(shape->path, shape->ptCount,
-                shape->params.thickness,
+        if( shape->pathIndex == NULL
+                && shape->ptCount >= PATHINDEX_MIN_POINTS )
+        {
+            /* the index is a cache, not a part of shape state */
+            ((Shape*)shape)->pathIndex = hittest_pathIndexNew(
+                    shape->path->points, shape->ptCount);
+        }
+        res = hittest_pathIndexed(shape->pathIndex, shape->path->points,
+                shape->ptCount, shape->params.thickness,
                 xBeg - shape->xLeft, yBeg - shape->yTop,
                 xEnd - shape->xLeft, yEnd - shape->yTop);
         break;
@@ -354,32 +662,47 @@ gboolean shape_hitTest(const Shape *shape, gdouble xBeg, gdouble yBeg,
     case ST_TRIANGLE:
         res = hittest_triangle(shape->xLeft, shape->yTop,
                 shape->xRight, shape->yBottom,
-                shape->params.angle, shape->params.round,
-                shape->params.thickness, xBeg, yBeg, xEnd, yEnd);
+                shape->params.angle, shape->params.isRight,
+                shape->params.round, shape->params.thickness,
+                xBeg, yBeg, xEnd, yEnd);
         break;
     case ST_RECT:
         res = hittest_rect(shape->xLeft, shape->yTop,
                 shape->xRight, shape->yBottom,
-                shape->params.round, shape->params.thickness,
+                shape->params.round, shape->params.angle,
+                shape->params.isRight, shape->params.thickness,
                 xBeg, yBeg, xEnd, yEnd);
         break;
     case ST_OVAL:
         res = hittest_ellipse(shape->xLeft, shape->yTop,
                 shape->xRight, shape->yBottom,
+                shape->params.angle, shape->params.isRight,
                 shape->params.thickness, xBeg, yBeg, xEnd, yEnd);
         break;
     case ST_TEXT:
+        g_mutex_lock(&drawCacheLock);
+        textWidth = shape->drawnTextWidth;
+        textHeight = shape->drawnTextHeight;
+        g_mutex_unlock(&drawCacheLock);
+        /* the text box as drawn by pathTextBox, rotated around center */
+        angle = shape->params.angle * G_PI / 180;
+        if( shape->params.isRight )
+            angle = -angle;
+        xHalf = shape->params.thickness + 0.5 * textWidth;
+        yHalf = shape->params.thickness + 0.5 * textHeight;
         res = hittest_rect(
-                shape->xRight - 0.5 * shape->drawnTextWidth,
-                shape->yBottom - 0.5 * shape->drawnTextHeight,
-                shape->xRight + 0.5 * shape->drawnTextWidth,
-                shape->yBottom + 0.5 * shape->drawnTextHeight, 0,
-                2 * shape->params.thickness, xBeg, yBeg, xEnd, yEnd);
+                shape->xRight - xHalf * cos(angle) - yHalf * sin(angle),
+                shape->yBottom + xHalf * sin(angle) - yHalf * cos(angle),
+                shape->xRight + xHalf * cos(angle) + yHalf * sin(angle),
+                shape->yBottom - xHalf * sin(angle) + yHalf * cos(angle),
+                shape->params.round, shape->params.angle,
+                shape->params.isRight, 0, xBeg, yBeg, xEnd, yEnd);
         break;
     default:
         res = hittest_arrow(shape->xLeft, shape->yTop,
-                shape->xRight, shape->yBottom,
-                shape->params.thickness, xBeg, yBeg, xEnd, yEnd);
+                shape->xRight, shape->yBottom, shape->params.thickness,
+                getArrowProportion(shape), shape->params.angle,
+                shape->params.isRight, xBeg, yBeg, xEnd, yEnd);
         break;
     }
     return res;
@@ -401,18 +724,131 @@ static void strokeSelection(cairo_t *cr)
     cairo_set_dash(cr, NULL, 0, 0);
 }
 
+static void setDrawnTextSize(Shape *shape, int width, int height)
+{
+    g_mutex_lock(&drawCacheLock);
+    if( width != shape->drawnTextWidth || height != shape->drawnTextHeight ) {
+        shape->drawnTextWidth = width;
+        shape->drawnTextHeight = height;
+        shape->isBoundsValid = FALSE;
+    }
+    g_mutex_unlock(&drawCacheLock);
+}
+
+/* Creates layout of text shape. Sets width and height to the layout size
+ * in device units. Returns NULL when the shape has no font set.
+ */
+static PangoLayout *createTextLayout(cairo_t *cr, gdouble zoom,
+        const Shape *shape, int *width, int *height)
+{
+    PangoLayout *layout = NULL;
+    PangoFontDescription *desc;
+    const char *text = shape->params.text;
+
+    if( shape->params.fontName ) {
+        layout = pango_cairo_create_layout(cr);
+        pango_layout_set_text(layout, text ? text : "", -1);
+        desc = pango_font_description_from_string(shape->params.fontName);
+        if( zoom != 1.0 ) {
+            pango_font_description_set_size(desc,
+                    pango_font_description_get_size(desc) * zoom);
+        }
+        pango_layout_set_font_description (layout, desc);
+        pango_font_description_free(desc);
+        pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
+        pango_layout_get_pixel_size(layout, width, height);
+    }else{
+        *width = zoom;
+        *height = 8 * zoom;
+    }
+    return layout;
+}
+
+/* Returns text of the shape rendered as alpha mask at the zoom. The mask
+ * is created once and reused until text, font or zoom changes. Sets x and
+ * y to the mask position relative to the text box, width and height to
+ * the text box size. Returns NULL when the shape has no font set.
+ * The returned surface should be destroyed by caller.
+ */
+static cairo_surface_t *getTextMask(Shape *shape, gdouble zoom,
+        int *x, int *y, int *width, int *height)
+{
+    cairo_surface_t *surface, *maskOld, *res = NULL;
+    cairo_t *cr;
+    PangoLayout *layout;
+    PangoRectangle ink;
+
+    g_mutex_lock(&drawCacheLock);
+    if( shape->textMask != NULL && shape->textMaskZoom == zoom ) {
+        res = cairo_surface_reference(shape->textMask);
+        *x = shape->textMaskX;
+        *y = shape->textMaskY;
+        *width = shape->textMaskWidth;
+        *height = shape->textMaskHeight;
+    }
+    g_mutex_unlock(&drawCacheLock);
+    if( res != NULL )
+        return res;
+    /* the text is rendered without the lock held, other threads may
+     * render it concurrently; the last one is kept */
+    surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+    cr = cairo_create(surface);
+    layout = createTextLayout(cr, zoom, shape, width, height);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    if( layout == NULL )
+        return NULL;
+    pango_layout_get_pixel_extents(layout, &ink, NULL);
+    res = cairo_image_surface_create(CAIRO_FORMAT_A8,
+            MAX(ink.width, 1), MAX(ink.height, 1));
+    cr = cairo_create(res);
+    pango_cairo_update_layout(cr, layout);
+    cairo_move_to(cr, -ink.x, -ink.y);
+    pango_cairo_show_layout(cr, layout);
+    cairo_destroy(cr);
+    g_object_unref(layout);
+    *x = ink.x;
+    *y = ink.y;
+    g_mutex_lock(&drawCacheLock);
+    maskOld = shape->textMask;
+    shape->textMask = cairo_surface_reference(res);
+    shape->textMaskZoom = zoom;
+    shape->textMaskX = ink.x;
+    shape->textMaskY = ink.y;
+    shape->textMaskWidth = *width;
+    shape->textMaskHeight = *height;
+    g_mutex_unlock(&drawCacheLock);
+    if( maskOld != NULL )
+        cairo_surface_destroy(maskOld);
+    return res;
+}
+
 static void drawTextOnShape(cairo_t *cr, gdouble zoom, Shape *shape,
-        gdouble posFactor)
+        gdouble posFactor, gboolean isFast)
 {
     PangoLayout *layout;
     PangoFontDescription *desc;
-    int width, height;
+    cairo_surface_t *mask;
+    int width, height, maskX, maskY;
     gdouble xPaint, yPaint;
 
     if( shape->params.text == NULL || shape->params.text[0] == '\0' )
         return;
     xPaint = zoom * (shape->xLeft + posFactor * (shape->xRight - shape->xLeft));
     yPaint = zoom * (shape->yTop + posFactor * (shape->yBottom - shape->yTop));
+    if( isFast && (mask = getTextMask(shape, zoom, &maskX, &maskY,
+                    &width, &height)) != NULL )
+    {
+        cairo_save(cr);
+        cairo_clip_preserve(cr);
+        gdk_cairo_set_source_rgba(cr, &shape->params.textColor);
+        cairo_mask_surface(cr, mask, xPaint - 0.5 * width + maskX,
+                yPaint - 0.5 * height + maskY);
+        cairo_restore(cr);
+        cairo_surface_destroy(mask);
+        setDrawnTextSize(shape, width / zoom, height / zoom);
+        return;
+    }
     layout = pango_cairo_create_layout(cr);
     pango_layout_set_text(layout, shape->params.text, -1);
     desc = pango_font_description_from_string(shape->params.fontName);
@@ -431,8 +867,7 @@ static void drawTextOnShape(cairo_t *cr, gdouble zoom, Shape *shape,
     pango_cairo_show_layout(cr, layout);
     cairo_restore(cr);
     g_object_unref(layout);
-    shape->drawnTextWidth = width / zoom;
-    shape->drawnTextHeight = height / zoom;
+    setDrawnTextSize(shape, width / zoom, height / zoom);
 }
 
 static void strokeShape(const Shape *shape, cairo_t *cr,
@@ -469,33 +904,50 @@ static void strokeResizePoints(const Shape *shape, cairo_t *cr,
 }
 
 static void strokeAndFillShape(Shape *shape, cairo_t *cr, gdouble zoom,
-        gboolean isSelected, gdouble posFactor)
+        gboolean isSelected, gdouble posFactor, gboolean isFast)
 {
-    if( shape->params.thickness == 0 || shape->params.strokeColor.alpha == 1) {
+    gdouble x1, y1, x2, y2;
+    cairo_path_t *path;
+
+    /* in fast mode translucent stroke is drawn over fill, without group */
+    if( shape->params.thickness == 0 || shape->params.strokeColor.alpha == 1
+            || isFast )
+    {
         if( shape->params.fillColor.alpha != 0 ) {
             gdk_cairo_set_source_rgba(cr, &shape->params.fillColor);
             cairo_fill_preserve(cr);
         }
-        drawTextOnShape(cr, zoom, shape, posFactor);
+        drawTextOnShape(cr, zoom, shape, posFactor, isFast);
         if( shape->params.thickness != 0 ) {
             cairo_set_line_width(cr, zoom * shape->params.thickness);
             gdk_cairo_set_source_rgba(cr, &shape->params.strokeColor);
             cairo_stroke_preserve(cr);
         }
     }else{
+        /* limit the group size to the shape area */
+        cairo_set_line_width(cr, zoom * shape->params.thickness);
+        cairo_stroke_extents(cr, &x1, &y1, &x2, &y2);
+        path = cairo_copy_path(cr);
+        cairo_new_path(cr);
+        cairo_save(cr);
+        cairo_rectangle(cr, floor(x1), floor(y1),
+                ceil(x2) - floor(x1), ceil(y2) - floor(y1));
+        cairo_clip(cr);
+        cairo_append_path(cr, path);
+        cairo_path_destroy(path);
         cairo_push_group(cr);
         if( shape->params.fillColor.alpha != 0 ) {
             gdk_cairo_set_source_rgba(cr, &shape->params.fillColor);
             cairo_fill_preserve(cr);
         }
-        drawTextOnShape(cr, zoom, shape, posFactor);
+        drawTextOnShape(cr, zoom, shape, posFactor, FALSE);
         gdk_cairo_set_source_rgba(cr, &shape->params.strokeColor);
         cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-        cairo_set_line_width(cr, zoom * shape->params.thickness);
         cairo_stroke_preserve(cr);
         cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
         cairo_pop_group_to_source(cr);
         cairo_paint(cr);
+        cairo_restore(cr);
     }
     if( isSelected ) {
         strokeSelection(cr);
@@ -503,54 +955,54 @@ static void strokeAndFillShape(Shape *shape, cairo_t *cr, gdouble zoom,
         cairo_new_path(cr);
 }
 
+/* Rotates the cairo context around text center.
+ */
+static void transformForText(cairo_t *cr, gdouble zoom, const Shape *shape)
+{
+    cairo_matrix_t matrix;
+    gdouble angle = shape->params.angle * G_PI / 180;
+    if( shape->params.isRight )
+        angle = -angle;
+    gdouble angleSin = sin(angle);
+    gdouble angleCos = cos(angle);
+    matrix.xx = matrix.yy = angleCos;
+    matrix.xy = angleSin;
+    matrix.yx = -angleSin;
+    matrix.x0 = zoom * (shape->xRight * (1 - angleCos)
+            - shape->yBottom * angleSin);
+    matrix.y0 = zoom * (shape->xRight * angleSin
+            + (1 - angleCos) * shape->yBottom);
+    cairo_transform(cr, &matrix);
+}
+
+static void pathTextBox(cairo_t *cr, gdouble zoom, const Shape *shape,
+        int width, int height)
+{
+    sd_pathRect(cr,
+            zoom * (shape->xRight - shape->params.thickness) - 0.5 * width,
+            zoom * (shape->yBottom - shape->params.thickness) - 0.5 * height,
+            zoom * (shape->xRight + shape->params.thickness) + 0.5 * width,
+            zoom * (shape->yBottom + shape->params.thickness) + 0.5 * height,
+            zoom * shape->params.round, 0, TRUE);
+}
+
 static void drawText(cairo_t *cr, gdouble zoom, Shape *shape,
-        gboolean isSelected)
+        gboolean isSelected, gboolean isFast)
 {
     PangoLayout *layout = NULL;
-    PangoFontDescription *desc;
-    int width, height;
-    const char *text = shape->params.text;
+    cairo_surface_t *mask = NULL;
+    int width, height, maskX, maskY;
 
-    if( shape->params.fontName ) {
-        layout = pango_cairo_create_layout(cr);
-        pango_layout_set_text(layout, text ? text : "", -1);
-        desc = pango_font_description_from_string(shape->params.fontName);
-        if( zoom != 1.0 ) {
-            pango_font_description_set_size(desc,
-                    pango_font_description_get_size(desc) * zoom);
-        }
-        pango_layout_set_font_description (layout, desc);
-        pango_font_description_free(desc);
-        pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
-        pango_layout_get_pixel_size(layout, &width, &height);
-    }else{
-        width = zoom;
-        height = 8 * zoom;
-    }
+    if( isFast )
+        mask = getTextMask(shape, zoom, &maskX, &maskY, &width, &height);
+    if( mask == NULL )
+        layout = createTextLayout(cr, zoom, shape, &width, &height);
     if( shape->params.angle != 0 ) {
-        cairo_matrix_t matrix;
-        gdouble angle = shape->params.angle * G_PI / 180;
-        if( shape->params.isRight )
-            angle = -angle;
-        gdouble angleSin = sin(angle);
-        gdouble angleCos = cos(angle);
         cairo_save(cr);
-        matrix.xx = matrix.yy = angleCos;
-        matrix.xy = angleSin;
-        matrix.yx = -angleSin;
-        matrix.x0 = zoom * (shape->xRight * (1 - angleCos)
-                - shape->yBottom * angleSin);
-        matrix.y0 = zoom * (shape->xRight * angleSin
-                + (1 - angleCos) * shape->yBottom);
-        cairo_transform(cr, &matrix);
+        transformForText(cr, zoom, shape);
     }
     if( shape->params.fillColor.alpha != 0.0 || isSelected ) {
-        sd_pathRect(cr,
-                zoom * (shape->xRight - shape->params.thickness) - 0.5 * width,
-                zoom * (shape->yBottom - shape->params.thickness) - 0.5*height,
-                zoom * (shape->xRight + shape->params.thickness) + 0.5 * width,
-                zoom * (shape->yBottom + shape->params.thickness) + 0.5*height,
-                zoom * shape->params.round, 0, TRUE);
+        pathTextBox(cr, zoom, shape, width, height);
         if( shape->params.fillColor.alpha != 0.0 ) {
             gdk_cairo_set_source_rgba(cr, &shape->params.fillColor);
             cairo_fill_preserve(cr);
@@ -568,94 +1020,292 @@ static void drawText(cairo_t *cr, gdouble zoom, Shape *shape,
         g_object_unref(layout);
         /* pango_cairo_show_layout does not clear path */
         cairo_new_path(cr);
+    }else if( mask ) {
+        gdk_cairo_set_source_rgba(cr, &shape->params.textColor);
+        cairo_mask_surface(cr, mask,
+                zoom * shape->xRight - 0.5 * width + maskX,
+                zoom * shape->yBottom - 0.5 * height + maskY);
+        cairo_surface_destroy(mask);
     }
     if( shape->params.angle != 0 )
         cairo_restore(cr);
-    shape->drawnTextWidth = width / zoom;
-    shape->drawnTextHeight = height / zoom;
+    setDrawnTextSize(shape, width / zoom, height / zoom);
 }
 
-void shape_draw(Shape *shape, cairo_t *cr, gdouble zoom, gboolean isSelected,
-        gboolean isCurrent)
+/* Builds path of the shape outline. Not applicable for text.
+ */
+static void buildPath(const Shape *shape, cairo_t *cr, gdouble zoom)
 {
-    switch( shape->type ) {
-    case ST_FREEFORM:
+    const DrawPoint *pt;
+
+    if( shape->type == ST_FREEFORM ) {
         if( shape->ptCount > 0 ) {
             cairo_move_to(cr, zoom * shape->xLeft, zoom * shape->yTop);
-            for(int j = 0; j < shape->ptCount; ++j)
-                cairo_line_to(cr, zoom * (shape->xLeft + shape->path[j].x),
-                        zoom * (shape->yTop + shape->path[j].y));
+            for(pt = shape->path->points;
+                    pt < shape->path->points + shape->ptCount; ++pt)
+                cairo_line_to(cr, zoom * (shape->xLeft + dp_x(pt)),
+                        zoom * (shape->yTop + dp_y(pt)));
         }else{
             sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
         }
-        strokeShape(shape, cr, zoom, isSelected);
-        break;
+        return;
+    }
+    if( shape->xRight == shape->xLeft && shape->yBottom == shape->yTop ) {
+        sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
+        return;
+    }
+    switch( shape->type ) {
     case ST_LINE:
-        if( shape->xRight != shape->xLeft || shape->yBottom != shape->yTop ) {
-            sd_pathLine(cr, zoom * shape->xLeft, zoom * shape->yTop,
-                    zoom * shape->xRight, zoom * shape->yBottom,
-                    zoom * shape->params.round, shape->params.angle,
-                    shape->params.isRight);
+        sd_pathLine(cr, zoom * shape->xLeft, zoom * shape->yTop,
+                zoom * shape->xRight, zoom * shape->yBottom,
+                zoom * shape->params.round, shape->params.angle,
+                shape->params.isRight);
+        break;
+    case ST_TRIANGLE:
+        sd_pathTriangle(cr, zoom * shape->xLeft, zoom * shape->yTop,
+                zoom * shape->xRight, zoom * shape->yBottom,
+                zoom * shape->params.round, shape->params.angle,
+                shape->params.isRight);
+        break;
+    case ST_RECT:
+        sd_pathRect(cr, zoom * shape->xLeft, zoom * shape->yTop,
+                zoom * shape->xRight, zoom * shape->yBottom,
+                zoom * shape->params.round, shape->params.angle,
+                shape->params.isRight);
+        break;
+    case ST_OVAL:
+        sd_pathOval(cr, zoom * shape->xLeft, zoom * shape->yTop,
+                zoom * shape->xRight, zoom * shape->yBottom,
+                shape->params.round, shape->params.angle,
+                shape->params.isRight);
+        break;
+    case ST_ARROW:
+        sd_pathArrow(cr, zoom * shape->xLeft, zoom * shape->yTop,
+                zoom * shape->xRight, zoom * shape->yBottom,
+                zoom * fmax(shape->params.thickness, 1.0),
+                getArrowProportion(shape), shape->params.angle,
+                shape->params.isRight);
+        break;
+    default:
+        break;
+    }
+}
+
+static const DrawPoint *freeformPoint(const Shape *shape, int idx)
+{
+    static const DrawPoint origin = { 0, 0 };
+
+    return idx == 0 ? &origin : shape->path->points + idx - 1;
+}
+
+/* Simplifies freeform path using Ramer-Douglas-Peucker algorithm.
+ * Returns the simplified path relative to xLeft, yTop.
+ */
+static cairo_path_t *simplifyFreeform(const Shape *shape, gdouble tolerance)
+{
+    int ptCount = shape->ptCount + 1, first, last, i, maxIdx, keptCount;
+    int *stack, stackSize = 0;
+    gboolean *isKept;
+    gdouble dist, maxDist;
+    const DrawPoint *pt;
+    cairo_path_t *res;
+    cairo_path_data_t *data;
+
+    isKept = g_malloc0(ptCount * sizeof(gboolean));
+    stack = g_malloc(2 * ptCount * sizeof(int));
+    isKept[0] = isKept[ptCount - 1] = TRUE;
+    stack[stackSize++] = 0;
+    stack[stackSize++] = ptCount - 1;
+    while( stackSize > 0 ) {
+        last = stack[--stackSize];
+        first = stack[--stackSize];
+        maxDist = 0;
+        maxIdx = -1;
+        for(i = first + 1; i < last; ++i) {
+            dist = segmentDistance(freeformPoint(shape, i),
+                    freeformPoint(shape, first), freeformPoint(shape, last));
+            if( dist > maxDist ) {
+                maxDist = dist;
+                maxIdx = i;
+            }
+        }
+        if( maxDist > tolerance ) {
+            isKept[maxIdx] = TRUE;
+            stack[stackSize++] = first;
+            stack[stackSize++] = maxIdx;
+            stack[stackSize++] = maxIdx;
+            stack[stackSize++] = last;
+        }
+    }
+    keptCount = 0;
+    for(i = 0; i < ptCount; ++i) {
+        if( isKept[i] )
+            ++keptCount;
+    }
+    res = g_malloc(sizeof(cairo_path_t));
+    res->status = CAIRO_STATUS_SUCCESS;
+    res->num_data = 2 * keptCount;
+    res->data = data = g_malloc(res->num_data * sizeof(cairo_path_data_t));
+    for(i = 0; i < ptCount; ++i) {
+        if( isKept[i] ) {
+            pt = freeformPoint(shape, i);
+            data[0].header.type = i == 0 ? CAIRO_PATH_MOVE_TO
+                : CAIRO_PATH_LINE_TO;
+            data[0].header.length = 2;
+            data[1].point.x = dp_x(pt);
+            data[1].point.y = dp_y(pt);
+            data += 2;
+        }
+    }
+    g_free(stack);
+    g_free(isKept);
+    return res;
+}
+
+/* Returns simplified freeform path for drawing at the zoom, or NULL when
+ * the path should be drawn in full detail. The path is simplified outside
+ * of the lock; once published, a level stays valid as long as the shape.
+ */
+static const cairo_path_t *getLodPath(const Shape *shape, gdouble zoom)
+{
+    Shape *shapeMod = (Shape*)shape;
+    cairo_path_t *path;
+    int level;
+
+    if( shape->type != ST_FREEFORM || shape->ptCount < LOD_MIN_POINTS
+            || zoom > 0.5 )
+        return NULL;
+    level = MIN((int)floor(-log2(zoom)), LOD_LEVEL_COUNT);
+    g_mutex_lock(&pathCacheLock);
+    if( shape->pathLod == NULL ) {
+        shapeMod->pathLod = g_malloc0(sizeof(PathLod));
+        shapeMod->pathLod->refCount = 1;
+    }
+    path = shape->pathLod->levels[level - 1];
+    g_mutex_unlock(&pathCacheLock);
+    if( path == NULL ) {
+        path = simplifyFreeform(shape, 0.25 * (1 << level));
+        g_mutex_lock(&pathCacheLock);
+        if( shape->pathLod->levels[level - 1] == NULL ) {
+            shape->pathLod->levels[level - 1] = path;
         }else{
-            sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
+            freePath(path);
+            path = shape->pathLod->levels[level - 1];
         }
+        g_mutex_unlock(&pathCacheLock);
+    }
+    return path;
+}
+
+/* Returns path of the shape outline built at the zoom. The path is built
+ * once and reused until layout or parameters of the shape change.
+ * The returned cache should be released using pathCacheUnref.
+ * Not applicable for text.
+ */
+static PathCache *getPathCache(const Shape *shape, gdouble pathZoom)
+{
+    Shape *shapeMod = (Shape*)shape;
+    PathCache *cache, *cacheOld;
+    cairo_surface_t *surface;
+    cairo_t *pathCr;
+
+    g_mutex_lock(&pathCacheLock);
+    cache = shape->pathCache;
+    if( cache != NULL && cache->zoom == pathZoom )
+        g_atomic_int_inc(&cache->refCount);
+    else
+        cache = NULL;
+    g_mutex_unlock(&pathCacheLock);
+    if( cache == NULL ) {
+        surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+        pathCr = cairo_create(surface);
+        cairo_translate(pathCr, -pathZoom * shape->xLeft,
+                -pathZoom * shape->yTop);
+        buildPath(shape, pathCr, pathZoom);
+        cairo_identity_matrix(pathCr);
+        cache = g_malloc(sizeof(PathCache));
+        cache->refCount = 2;    /* the shape and the caller */
+        cache->path = cairo_copy_path(pathCr);
+        cache->zoom = pathZoom;
+        cairo_destroy(pathCr);
+        cairo_surface_destroy(surface);
+        g_mutex_lock(&pathCacheLock);
+        cacheOld = shape->pathCache;
+        shapeMod->pathCache = cache;
+        g_mutex_unlock(&pathCacheLock);
+        pathCacheUnref(cacheOld);
+    }
+    return cache;
+}
+
+/* Creates path of the shape outline, clipped to the visible area.
+ * Not applicable for text.
+ */
+static void pathShape(const Shape *shape, cairo_t *cr, gdouble zoom)
+{
+    PathCache *cache;
+    const cairo_path_t *lodPath;
+    gdouble pathZoom = 1.0;
+
+    cairo_save(cr);
+    cairo_translate(cr, zoom * shape->xLeft, zoom * shape->yTop);
+    if( (lodPath = getLodPath(shape, zoom)) != NULL ) {
+        cairo_scale(cr, zoom, zoom);
+        sd_appendPath(cr, lodPath, zoom * fmax(shape->params.thickness, 1.0));
+    }else{
+        /* density of wavy line depends on zoom */
+        if( shape->type == ST_LINE && shape->params.round != 0 )
+            pathZoom = zoom;
+        cache = getPathCache(shape, pathZoom);
+        if( zoom != pathZoom )
+            cairo_scale(cr, zoom / pathZoom, zoom / pathZoom);
+        sd_appendPath(cr, cache->path,
+                zoom * fmax(shape->params.thickness, 1.0));
+        pathCacheUnref(cache);
+    }
+    cairo_restore(cr);
+}
+
+void shape_draw(Shape *shape, cairo_t *cr, gdouble zoom, gboolean isSelected,
+        gboolean isCurrent, gboolean isFast)
+{
+    switch( shape->type ) {
+    case ST_FREEFORM:
+        pathShape(shape, cr, zoom);
+        strokeShape(shape, cr, zoom, isSelected);
+        break;
+    case ST_LINE:
+        pathShape(shape, cr, zoom);
         strokeShape(shape, cr, zoom, isSelected);
         if( isCurrent && isSelected )
             strokeResizePoints(shape, cr, zoom, FALSE);
         break;
     case ST_TRIANGLE:
-        if( shape->xRight != shape->xLeft || shape->yBottom != shape->yTop ) {
-            sd_pathTriangle(cr, zoom * shape->xLeft, zoom * shape->yTop,
-                    zoom * shape->xRight, zoom * shape->yBottom,
-                    zoom * shape->params.round, shape->params.angle,
-                    shape->params.isRight);
-        }else{
-            sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
-        }
-        strokeAndFillShape(shape, cr, zoom, isSelected, 2.0 / 3.0);
+        pathShape(shape, cr, zoom);
+        strokeAndFillShape(shape, cr, zoom, isSelected, 2.0 / 3.0,
+                isFast);
         if( isCurrent && isSelected )
             strokeResizePoints(shape, cr, zoom, FALSE);
         break;
     case ST_RECT:
-        if( shape->xRight != shape->xLeft || shape->yBottom != shape->yTop ) {
-            sd_pathRect(cr, zoom * shape->xLeft, zoom * shape->yTop,
-                    zoom * shape->xRight, zoom * shape->yBottom,
-                    zoom * shape->params.round, shape->params.angle,
-                    shape->params.isRight);
-        }else{
-            sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
-        }
-        strokeAndFillShape(shape, cr, zoom, isSelected, 0.5);
+        pathShape(shape, cr, zoom);
+        strokeAndFillShape(shape, cr, zoom, isSelected, 0.5,
+                isFast);
         if( isCurrent && isSelected )
             strokeResizePoints(shape, cr, zoom, FALSE);
         break;
     case ST_OVAL:
-        if( shape->xRight != shape->xLeft || shape->yBottom != shape->yTop ) {
-            sd_pathOval(cr, zoom * shape->xLeft, zoom * shape->yTop,
-                    zoom * shape->xRight, zoom * shape->yBottom,
-                    shape->params.round, shape->params.angle,
-                    shape->params.isRight);
-        }else{
-            sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
-        }
-        strokeAndFillShape(shape, cr, zoom, isSelected, 0.5);
+        pathShape(shape, cr, zoom);
+        strokeAndFillShape(shape, cr, zoom, isSelected, 0.5,
+                isFast);
         if( isCurrent && isSelected )
             strokeResizePoints(shape, cr, zoom, shape->params.angle == 0);
         break;
     case ST_TEXT:
-        drawText(cr, zoom, shape, isSelected);
+        drawText(cr, zoom, shape, isSelected, isFast);
         break;
     case ST_ARROW:
-        if( shape->xRight != shape->xLeft || shape->yBottom != shape->yTop ) {
-            sd_pathArrow(cr, zoom * shape->xLeft, zoom * shape->yTop,
-                    zoom * shape->xRight, zoom * shape->yBottom,
-                    zoom * fmax(shape->params.thickness, 1.0),
-                    1.0 + shape->params.round *
-                        (0.02 + 0.1 / fmax(shape->params.thickness, 1.0)),
-                    shape->params.angle, shape->params.isRight);
-        }else{
-            sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
-        }
+        pathShape(shape, cr, zoom);
         gdk_cairo_set_source_rgba (cr, &shape->params.strokeColor);
         cairo_fill(cr);
         if( isSelected ) {
@@ -669,10 +1319,545 @@ void shape_draw(Shape *shape, cairo_t *cr, gdouble zoom, gboolean isSelected,
     }
 }
 
+void shape_strokePathRange(const Shape *shape, cairo_t *cr, gdouble zoom,
+        int first, int last)
+{
+    const GdkRGBA *color = &shape->params.strokeColor;
+    const DrawPoint *pt;
+
+    if( shape->ptCount == 0 ) {
+        sd_pathPoint(cr, zoom * shape->xLeft, zoom * shape->yTop);
+    }else{
+        if( first < 0 ) {
+            cairo_move_to(cr, zoom * shape->xLeft, zoom * shape->yTop);
+        }else{
+            pt = shape->path->points + first;
+            cairo_move_to(cr, zoom * (shape->xLeft + dp_x(pt)),
+                    zoom * (shape->yTop + dp_y(pt)));
+        }
+        for(pt = shape->path->points + first + 1;
+                pt <= shape->path->points + last; ++pt)
+            cairo_line_to(cr, zoom * (shape->xLeft + dp_x(pt)),
+                    zoom * (shape->yTop + dp_y(pt)));
+    }
+    cairo_set_source_rgb(cr, color->red, color->green, color->blue);
+    cairo_set_line_width(cr, zoom * MAX(shape->params.thickness, 1));
+    cairo_stroke(cr);
+}
+
+void shape_drawForPick(Shape *shape, cairo_t *cr, gdouble zoom)
+{
+    PangoLayout *layout;
+    int width, height;
+
+    switch( shape->type ) {
+    case ST_FREEFORM:
+    case ST_LINE:
+        pathShape(shape, cr, zoom);
+        cairo_set_line_width(cr, zoom * MAX(shape->params.thickness, 1));
+        cairo_stroke(cr);
+        break;
+    case ST_TEXT:
+        layout = createTextLayout(cr, zoom, shape, &width, &height);
+        if( layout )
+            g_object_unref(layout);
+        if( shape->params.angle != 0 ) {
+            cairo_save(cr);
+            transformForText(cr, zoom, shape);
+        }
+        pathTextBox(cr, zoom, shape, width, height);
+        cairo_fill(cr);
+        if( shape->params.angle != 0 )
+            cairo_restore(cr);
+        break;
+    case ST_ARROW:
+        pathShape(shape, cr, zoom);
+        cairo_fill(cr);
+        break;
+    default:
+        pathShape(shape, cr, zoom);
+        if( shape->params.thickness != 0 ) {
+            cairo_set_line_width(cr, zoom * shape->params.thickness);
+            cairo_fill_preserve(cr);
+            cairo_stroke(cr);
+        }else
+            cairo_fill(cr);
+        break;
+    }
+}
+
+void shape_getBounds(const Shape *shape, gdouble *x1, gdouble *y1,
+        gdouble *x2, gdouble *y2)
+{
+    Shape *shapeMod = (Shape*)shape;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    PathCache *cache;
+    gdouble xText, yText, textMargin, textFactor;
+    int textWidth, textHeight;
+    gboolean hasText = shape->params.text != NULL;
+
+    g_mutex_lock(&drawCacheLock);
+    if( shape->isBoundsValid ) {
+        *x1 = shape->boundsX1;
+        *y1 = shape->boundsY1;
+        *x2 = shape->boundsX2;
+        *y2 = shape->boundsY2;
+        g_mutex_unlock(&drawCacheLock);
+        return;
+    }
+    textWidth = shape->drawnTextWidth;
+    textHeight = shape->drawnTextHeight;
+    g_mutex_unlock(&drawCacheLock);
+    if( (hasText || shape->type == ST_TEXT) && textWidth == 0
+            && textHeight == 0 )
+    {
+        /* text size is not known before the shape is drawn */
+        *x1 = *y1 = -G_MAXDOUBLE;
+        *x2 = *y2 = G_MAXDOUBLE;
+        return;
+    }
+    surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+    cr = cairo_create(surface);
+    cairo_set_line_width(cr, MAX(shape->params.thickness, 1));
+    if( shape->type == ST_TEXT ) {
+        if( shape->params.angle != 0 )
+            transformForText(cr, 1.0, shape);
+        pathTextBox(cr, 1.0, shape, textWidth, textHeight);
+        cairo_identity_matrix(cr);
+    }else{
+        /* not clipped to the surface, which is tiny */
+        cache = getPathCache(shape, 1.0);
+        cairo_translate(cr, shape->xLeft, shape->yTop);
+        cairo_append_path(cr, cache->path);
+        cairo_identity_matrix(cr);
+        pathCacheUnref(cache);
+    }
+    cairo_stroke_extents(cr, x1, y1, x2, y2);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    if( hasText ) {
+        /* text size varies a bit with zoom because of font hinting */
+        textMargin = 0.25 * MAX(textWidth, textHeight);
+        if( shape->type != ST_TEXT ) {
+            textFactor = shape->type == ST_TRIANGLE ? 2.0 / 3.0 : 0.5;
+            xText = shape->xLeft
+                + textFactor * (shape->xRight - shape->xLeft);
+            yText = shape->yTop
+                + textFactor * (shape->yBottom - shape->yTop);
+            *x1 = fmin(*x1, xText - 0.5 * textWidth);
+            *y1 = fmin(*y1, yText - 0.5 * textHeight);
+            *x2 = fmax(*x2, xText + 0.5 * textWidth);
+            *y2 = fmax(*y2, yText + 0.5 * textHeight);
+        }
+        *x1 -= textMargin;
+        *y1 -= textMargin;
+        *x2 += textMargin;
+        *y2 += textMargin;
+    }
+    /* computed without the lock held; not stored when the text size has
+     * changed in between */
+    g_mutex_lock(&drawCacheLock);
+    if( shape->drawnTextWidth == textWidth
+            && shape->drawnTextHeight == textHeight )
+    {
+        shapeMod->boundsX1 = *x1;
+        shapeMod->boundsY1 = *y1;
+        shapeMod->boundsX2 = *x2;
+        shapeMod->boundsY2 = *y2;
+        shapeMod->isBoundsValid = TRUE;
+    }
+    g_mutex_unlock(&drawCacheLock);
+}
+
+/* Appends the number to SVG output, with two decimal places at most.
+ */
+static void svgAppendNum(GString *out, gdouble val)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    gchar *end;
+
+    g_ascii_formatd(buf, sizeof(buf), "%.2f", val);
+    end = buf + strlen(buf);
+    while( end[-1] == '0' )
+        --end;
+    if( end[-1] == '.' )
+        --end;
+    *end = '\0';
+    g_string_append(out, strcmp(buf, "-0") ? buf : "0");
+}
+
+static void svgAppendPoint(GString *out, gdouble x, gdouble y)
+{
+    svgAppendNum(out, x);
+    g_string_append_c(out, ',');
+    svgAppendNum(out, y);
+}
+
+static void svgAppendAttr(GString *out, const char *name, gdouble val)
+{
+    g_string_append_printf(out, " %s=\"", name);
+    svgAppendNum(out, val);
+    g_string_append_c(out, '"');
+}
+
+void shape_svgAppendPaint(GString *out, const char *name,
+        const GdkRGBA *color)
+{
+    g_string_append_printf(out, " %s=\"#%02x%02x%02x\"", name,
+            (int)round(255 * color->red), (int)round(255 * color->green),
+            (int)round(255 * color->blue));
+    if( color->alpha < 1.0 ) {
+        g_string_append_printf(out, " %s-opacity=\"", name);
+        svgAppendNum(out, color->alpha);
+        g_string_append_c(out, '"');
+    }
+}
+
+/* Returns TRUE when the path consists of line segments only. Sets
+ * isClosed when the path ends with close path.
+ */
+static gboolean isPolyline(const cairo_path_t *path, gboolean *isClosed)
+{
+    int i;
+
+    *isClosed = FALSE;
+    if( path->num_data == 0
+            || path->data[0].header.type != CAIRO_PATH_MOVE_TO )
+        return FALSE;
+    for(i = path->data[0].header.length; i < path->num_data;
+            i += path->data[i].header.length)
+    {
+        if( path->data[i].header.type == CAIRO_PATH_CLOSE_PATH ) {
+            /* cairo adds move to the path start after close */
+            *isClosed = TRUE;
+            i += path->data[i].header.length;
+            return i == path->num_data || (i + path->data[i].header.length
+                    == path->num_data
+                    && path->data[i].header.type == CAIRO_PATH_MOVE_TO);
+        }
+        if( path->data[i].header.type != CAIRO_PATH_LINE_TO )
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Appends element drawing the path: line, polyline, polygon or generic
+ * path. The element is not terminated, so attributes may be added.
+ */
+static void svgAppendPathElement(GString *out, const cairo_path_t *path)
+{
+    const cairo_path_data_t *data;
+    gboolean isClosed;
+    int i, j;
+
+    if( isPolyline(path, &isClosed) ) {
+        if( ! isClosed && path->num_data == 4 ) {
+            g_string_append(out, "<line");
+            svgAppendAttr(out, "x1", path->data[1].point.x);
+            svgAppendAttr(out, "y1", path->data[1].point.y);
+            svgAppendAttr(out, "x2", path->data[3].point.x);
+            svgAppendAttr(out, "y2", path->data[3].point.y);
+            return;
+        }
+        g_string_append(out, isClosed ? "<polygon points=\""
+                : "<polyline points=\"");
+        for(i = 0; i < path->num_data; i += path->data[i].header.length) {
+            if( path->data[i].header.type == CAIRO_PATH_CLOSE_PATH )
+                break;
+            if( i )
+                g_string_append_c(out, ' ');
+            svgAppendPoint(out, path->data[i + 1].point.x,
+                    path->data[i + 1].point.y);
+        }
+        g_string_append_c(out, '"');
+        return;
+    }
+    g_string_append(out, "<path d=\"");
+    for(i = 0; i < path->num_data; i += path->data[i].header.length) {
+        data = path->data + i;
+        switch( data->header.type ) {
+        case CAIRO_PATH_MOVE_TO:
+            g_string_append_c(out, 'M');
+            break;
+        case CAIRO_PATH_LINE_TO:
+            g_string_append_c(out, 'L');
+            break;
+        case CAIRO_PATH_CURVE_TO:
+            g_string_append_c(out, 'C');
+            break;
+        case CAIRO_PATH_CLOSE_PATH:
+            g_string_append_c(out, 'Z');
+            break;
+        }
+        for(j = 1; j < data->header.length; ++j) {
+            if( j > 1 )
+                g_string_append_c(out, ' ');
+            svgAppendPoint(out, data[j].point.x, data[j].point.y);
+        }
+    }
+    g_string_append_c(out, '"');
+}
+
+/* Creates cairo context used to build paths and text layouts at zoom 1.
+ */
+static cairo_t *createMeasureContext(void)
+{
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_A8,
+            1, 1);
+    cairo_t *cr = cairo_create(surface);
+
+    cairo_surface_destroy(surface);
+    return cr;
+}
+
+/* Appends text element with the shape text centered at (xMid, yMid).
+ * Sets width and height to the text size.
+ */
+static void svgAppendText(GString *out, const Shape *shape, gdouble xMid,
+        gdouble yMid, int *width, int *height)
+{
+    cairo_t *cr = createMeasureContext();
+    PangoLayout *layout;
+    PangoLayoutIter *iter;
+    PangoLayoutLine *line;
+    PangoFontDescription *desc;
+    const char *family;
+    gdouble fontSize;
+    gchar *text;
+
+    layout = createTextLayout(cr, 1.0, shape, width, height);
+    cairo_destroy(cr);
+    if( layout == NULL )
+        return;
+    if( shape->params.text != NULL && shape->params.text[0] ) {
+        desc = pango_font_description_from_string(shape->params.fontName);
+        fontSize = (gdouble)pango_font_description_get_size(desc)
+            / PANGO_SCALE;
+        /* pango cairo uses 96 dpi */
+        if( ! pango_font_description_get_size_is_absolute(desc) )
+            fontSize *= 96.0 / 72.0;
+        family = pango_font_description_get_family(desc);
+        text = g_markup_escape_text(family ? family : "sans-serif", -1);
+        g_string_append_printf(out, "<text font-family=\"%s\"", text);
+        g_free(text);
+        svgAppendAttr(out, "font-size", fontSize);
+        g_string_append_printf(out, " font-weight=\"%d\"",
+                (int)pango_font_description_get_weight(desc));
+        if( pango_font_description_get_style(desc) != PANGO_STYLE_NORMAL )
+            g_string_append(out, " font-style=\"italic\"");
+        pango_font_description_free(desc);
+        g_string_append(out, " text-anchor=\"middle\" xml:space=\"preserve\"");
+        shape_svgAppendPaint(out, "fill", &shape->params.textColor);
+        g_string_append_c(out, '>');
+        iter = pango_layout_get_iter(layout);
+        do {
+            line = pango_layout_iter_get_line_readonly(iter);
+            g_string_append(out, "<tspan");
+            svgAppendAttr(out, "x", xMid);
+            svgAppendAttr(out, "y", yMid - 0.5 * *height
+                    + (gdouble)pango_layout_iter_get_baseline(iter)
+                    / PANGO_SCALE);
+            text = g_markup_escape_text(
+                    shape->params.text + line->start_index, line->length);
+            g_string_append_printf(out, ">%s</tspan>", text);
+            g_free(text);
+        } while( pango_layout_iter_next_line(iter) );
+        pango_layout_iter_free(iter);
+        g_string_append(out, "</text>\n");
+    }
+    g_object_unref(layout);
+}
+
+/* Returns TRUE when the shape outline is a plain rect or ellipse
+ * element.
+ */
+static gboolean isSvgBasicShape(const Shape *shape)
+{
+    gdouble xLen = fabs(shape->xRight - shape->xLeft);
+    gdouble yLen = fabs(shape->yBottom - shape->yTop);
+
+    if( shape->params.round != 0 || shape->params.angle != 0 )
+        return FALSE;
+    if( shape->type == ST_RECT )
+        return xLen != 0 || yLen != 0;
+    /* thin oval is drawn differently */
+    return shape->type == ST_OVAL && xLen > 1 && yLen > 1;
+}
+
+/* Appends element drawing the shape outline. The path is NULL for basic
+ * shapes. The element is not terminated.
+ */
+static void svgAppendOutline(GString *out, const Shape *shape,
+        const cairo_path_t *path)
+{
+    gdouble xLen = fabs(shape->xRight - shape->xLeft);
+    gdouble yLen = fabs(shape->yBottom - shape->yTop);
+
+    if( path != NULL ) {
+        svgAppendPathElement(out, path);
+    }else if( shape->type == ST_OVAL ) {
+        /* the oval goes through the rectangle corners */
+        g_string_append(out, "<ellipse");
+        svgAppendAttr(out, "cx", 0.5 * (shape->xLeft + shape->xRight));
+        svgAppendAttr(out, "cy", 0.5 * (shape->yTop + shape->yBottom));
+        svgAppendAttr(out, "rx", 0.5 * G_SQRT2 * xLen);
+        svgAppendAttr(out, "ry", 0.5 * G_SQRT2 * yLen);
+    }else{
+        g_string_append(out, "<rect");
+        svgAppendAttr(out, "x", fmin(shape->xLeft, shape->xRight));
+        svgAppendAttr(out, "y", fmin(shape->yTop, shape->yBottom));
+        svgAppendAttr(out, "width", xLen);
+        svgAppendAttr(out, "height", yLen);
+    }
+}
+
+/* Appends the shape with fill and stroke as drawn by strokeAndFillShape.
+ * The text on shape is placed between fill and stroke, clipped to the
+ * shape outline by clip path with the given id. Translucent stroke
+ * replaces the fill and text underneath, as the stroke drawn with
+ * CAIRO_OPERATOR_SOURCE does; the fill and text are masked out there.
+ */
+static void svgAppendFilledShape(GString *out, const Shape *shape,
+        const cairo_path_t *path, gdouble posFactor, gint clipId)
+{
+    gboolean hasText = shape->params.text != NULL
+        && shape->params.text[0] != '\0';
+    gboolean hasFill = shape->params.fillColor.alpha != 0;
+    gboolean hasStroke = shape->params.thickness != 0;
+    gboolean isMasked = hasStroke && shape->params.strokeColor.alpha != 1
+        && (hasFill || hasText);
+    int width, height;
+
+    if( isMasked ) {
+        g_string_append_printf(out, "<mask id=\"mask%d\">", clipId);
+        svgAppendOutline(out, shape, path);
+        g_string_append(out, " fill=\"#fff\" stroke=\"#000\"");
+        svgAppendAttr(out, "stroke-width", shape->params.thickness);
+        g_string_append_printf(out, "/></mask>\n"
+                "<g mask=\"url(#mask%d)\">\n", clipId);
+    }
+    if( hasFill || (hasStroke && ! hasText && ! isMasked) ) {
+        svgAppendOutline(out, shape, path);
+        if( hasFill )
+            shape_svgAppendPaint(out, "fill", &shape->params.fillColor);
+        else
+            g_string_append(out, " fill=\"none\"");
+        if( hasStroke && ! hasText && ! isMasked ) {
+            shape_svgAppendPaint(out, "stroke", &shape->params.strokeColor);
+            svgAppendAttr(out, "stroke-width", shape->params.thickness);
+            hasStroke = FALSE;
+        }
+        g_string_append(out, "/>\n");
+    }
+    if( hasText ) {
+        g_string_append_printf(out, "<clipPath id=\"clip%d\">", clipId);
+        svgAppendOutline(out, shape, path);
+        g_string_append_printf(out, "/></clipPath>\n"
+                "<g clip-path=\"url(#clip%d)\">\n", clipId);
+        svgAppendText(out, shape,
+                shape->xLeft + posFactor * (shape->xRight - shape->xLeft),
+                shape->yTop + posFactor * (shape->yBottom - shape->yTop),
+                &width, &height);
+        g_string_append(out, "</g>\n");
+    }
+    if( isMasked )
+        g_string_append(out, "</g>\n");
+    if( hasStroke ) {
+        svgAppendOutline(out, shape, path);
+        g_string_append(out, " fill=\"none\"");
+        shape_svgAppendPaint(out, "stroke", &shape->params.strokeColor);
+        svgAppendAttr(out, "stroke-width", shape->params.thickness);
+        g_string_append(out, "/>\n");
+    }
+}
+
+/* Appends text shape: text box and the text, rotated around the text
+ * center.
+ */
+static void svgAppendTextShape(GString *out, const Shape *shape)
+{
+    cairo_t *cr;
+    cairo_path_t *path;
+    gdouble angle = shape->params.isRight ? -shape->params.angle
+        : shape->params.angle;
+    int width, height;
+    GString *text = g_string_new(NULL);
+
+    svgAppendText(text, shape, shape->xRight, shape->yBottom,
+            &width, &height);
+    if( angle != 0 ) {
+        g_string_append(out, "<g transform=\"rotate(");
+        svgAppendNum(out, -angle);
+        g_string_append_c(out, ' ');
+        svgAppendNum(out, shape->xRight);
+        g_string_append_c(out, ' ');
+        svgAppendNum(out, shape->yBottom);
+        g_string_append(out, ")\">\n");
+    }
+    if( shape->params.fillColor.alpha != 0.0 ) {
+        cr = createMeasureContext();
+        pathTextBox(cr, 1.0, shape, width, height);
+        path = cairo_copy_path(cr);
+        cairo_destroy(cr);
+        svgAppendPathElement(out, path);
+        shape_svgAppendPaint(out, "fill", &shape->params.fillColor);
+        g_string_append(out, "/>\n");
+        cairo_path_destroy(path);
+    }
+    g_string_append_len(out, text->str, text->len);
+    if( angle != 0 )
+        g_string_append(out, "</g>\n");
+    g_string_free(text, TRUE);
+}
+
+void shape_writeSvg(const Shape *shape, GString *out, gint id)
+{
+    cairo_t *cr;
+    cairo_path_t *path = NULL;
+
+    if( shape->type == ST_TEXT ) {
+        svgAppendTextShape(out, shape);
+        return;
+    }
+    if( ! isSvgBasicShape(shape) ) {
+        cr = createMeasureContext();
+        buildPath(shape, cr, 1.0);
+        path = cairo_copy_path(cr);
+        cairo_destroy(cr);
+    }
+    switch( shape->type ) {
+    case ST_FREEFORM:
+    case ST_LINE:
+        svgAppendPathElement(out, path);
+        g_string_append(out, " fill=\"none\"");
+        shape_svgAppendPaint(out, "stroke", &shape->params.strokeColor);
+        svgAppendAttr(out, "stroke-width", MAX(shape->params.thickness, 1));
+        g_string_append(out, "/>\n");
+        break;
+    case ST_TRIANGLE:
+        svgAppendFilledShape(out, shape, path, 2.0 / 3.0, id);
+        break;
+    case ST_RECT:
+    case ST_OVAL:
+        svgAppendFilledShape(out, shape, path, 0.5, id);
+        break;
+    case ST_ARROW:
+        svgAppendPathElement(out, path);
+        shape_svgAppendPaint(out, "fill", &shape->params.strokeColor);
+        g_string_append(out, "/>\n");
+        break;
+    default:
+        break;
+    }
+    if( path != NULL )
+        cairo_path_destroy(path);
+}
+
 Shape *shape_readFromFile(WlqInFile *inFile, gchar **errLoc)
 {
     unsigned shapeType, thickness, round, angle, isRight, ptCount;
-    gdouble xLeft, xRight, yTop, yBottom;
+    gdouble xLeft, xRight, yTop, yBottom, xPt, yPt;
     ShapeParams params;
     Shape *shape;
 
@@ -705,18 +1890,17 @@ Shape *shape_readFromFile(WlqInFile *inFile, gchar **errLoc)
     if( isOK ) {
         isOK = wlq_readU32(inFile, &ptCount, errLoc);
         if( isOK && ptCount ) {
-            shape->path = g_try_malloc(ptCount * sizeof(*shape->path));
+            shape->path = pathPointsTryNew(ptCount);
             if( shape->path != NULL ) {
                 while( shape->ptCount < ptCount ) {
-                    if( ! wlq_readCoordinate(inFile,
-                            &shape->path[shape->ptCount].x, errLoc)
-                        || ! wlq_readCoordinate(inFile,
-                                &shape->path[shape->ptCount].y, errLoc) )
+                    if( ! wlq_readCoordinate(inFile, &xPt, errLoc)
+                        || ! wlq_readCoordinate(inFile, &yPt, errLoc) )
                     {
                         isOK = FALSE;
                         break;
                     }
-                    ++shape->ptCount;
+                    dp_set(shape->path->points + shape->ptCount, xPt, yPt);
+                    shape->path->count = ++shape->ptCount;
                 }
             }else{
                 isOK = FALSE;
@@ -736,6 +1920,7 @@ Shape *shape_readFromFile(WlqInFile *inFile, gchar **errLoc)
 gboolean shape_writeToFile(const Shape *shape, WlqOutFile *outFile,
         gchar **errLoc)
 {
+    const DrawPoint *pt;
     int i;
     gboolean isOK;
 
@@ -755,8 +1940,9 @@ gboolean shape_writeToFile(const Shape *shape, WlqOutFile *outFile,
             && wlq_writeString(outFile, shape->params.fontName, errLoc)
             && wlq_writeU32(outFile, shape->ptCount, errLoc);
     for(i = 0; i < shape->ptCount && isOK; ++i) {
-        isOK = wlq_writeCoordinate(outFile, shape->path[i].x, errLoc)
-                && wlq_writeCoordinate(outFile, shape->path[i].y, errLoc);
+        pt = shape->path->points + i;
+        isOK = wlq_writeCoordinate(outFile, dp_x(pt), errLoc)
+                && wlq_writeCoordinate(outFile, dp_y(pt), errLoc);
     }
     return isOK;
 }
@@ -62,6 +62,11 @@ Shape *shape_copyOf(const Shape*);
 Shape *shape_replaceDup(Shape**);
 
 
+/* Sets tolerance of freeform path simplification performed while the
+ * path is laid out by shape_layoutNew. Zero turns off the simplification.
+ */
+void shape_setPathTolerance(Shape*, gdouble tolerance);
+
 /* New shape layout: set right and bottom side of the shape.
  */
 void shape_layoutNew(Shape *shape, gdouble xRight, gdouble yBottom,
@@ -76,6 +81,11 @@ void shape_layout(Shape *shape, const Shape *prev, gdouble x, gdouble y,
 void shape_move(Shape *shape, const Shape *prev, gdouble x, gdouble y);
 
 ShapeType shape_getType(const Shape*);
+int shape_getPathPointCount(const Shape*);
+
+/* Returns number of bytes allocated for the shape.
+ */
+gsize shape_getMemSize(const Shape*);
 void shape_scale(Shape*, gdouble factor);
 
 void shape_getParams(const Shape*, ShapeParams*);
@@ -88,8 +98,41 @@ enum ShapeCorner shape_cornerHitTest(const Shape *shape, gdouble x,
 gboolean shape_hitTest(const Shape*, gdouble xBeg, gdouble yBeg,
         gdouble xEnd, gdouble yEnd);
 
+/* Draws the shape. When isFast is set, the shape is drawn in lower quality,
+ * suitable for redraws during mouse drag.
+ */
 void shape_draw(Shape*, cairo_t*, gdouble zoom, gboolean isSelected,
-        gboolean isCurrent);
+        gboolean isCurrent, gboolean isFast);
+
+/* Returns bounding box of the shape drawn at zoom 1, including stroke
+ * width and text. Selection marks drawn over the shape are not included.
+ * The box is computed once and cached until the shape changes.
+ */
+void shape_getBounds(const Shape*, gdouble *x1, gdouble *y1,
+        gdouble *x2, gdouble *y2);
+
+/* Strokes part of freeform shape path, from point "first" to point "last".
+ * Point -1 is the path start. The stroke color is drawn opaque.
+ */
+void shape_strokePathRange(const Shape*, cairo_t*, gdouble zoom,
+        int first, int last);
+
+/* Fills area covered by the shape using current source of the cairo
+ * context. Used to draw shape identifiers on a pick buffer.
+ */
+void shape_drawForPick(Shape*, cairo_t*, gdouble zoom);
+
+/* Appends SVG elements drawing the shape at zoom 1. Plain shapes are
+ * written as rect, ellipse, line, polyline or polygon elements, text as
+ * text element. The id, unique in the document, is used to name
+ * the clip path of text on shape and the mask under translucent stroke.
+ */
+void shape_writeSvg(const Shape*, GString *out, gint id);
+
+/* Appends SVG paint attribute, "fill" or "stroke", with opacity when the
+ * color is translucent.
+ */
+void shape_svgAppendPaint(GString *out, const char *name, const GdkRGBA*);
 
 Shape *shape_readFromFile(WlqInFile*, gchar **errLoc);
 gboolean shape_writeToFile(const Shape*, WlqOutFile*, gchar **errLoc);
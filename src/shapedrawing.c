@@ -16,45 +16,271 @@ static double getAngle(gdouble x1, gdouble y1, gdouble x2, gdouble y2)
     return res;
 }
 
-/* cairo bug workaround: cairo does not cope with long lines
+enum {
+    LONG_PATH_LIMIT = 10000,    /* cairo does not cope with longer lines */
+    CLIP_MARGIN = 16,           /* kept around clip area besides stroke */
+    CURVE_SPLIT_MAX = 16        /* max depth of curve subdivision */
+};
+
+/* Path segment end point. For curves also the control points.
+ */
+typedef struct {
+    gdouble x, y;
+    gboolean isCurve;
+    gdouble x1, y1, x2, y2;
+} ClipPoint;
+
+/* Clipping rectangle edge: the inside half-plane is
+ * isVertical ? sign * x <= sign * pos : sign * y <= sign * pos
  */
-static void crLineTo(cairo_t *cr, gdouble x, gdouble y)
+typedef struct {
+    gboolean isVertical;
+    gdouble sign, pos;
+} ClipEdge;
+
+static gboolean isInside(const ClipEdge *edge, const ClipPoint *pt)
 {
-    gdouble xCur, yCur;
-
-    cairo_get_current_point(cr, &xCur, &yCur);
-    if( fabs(x - xCur) > fabs(y - yCur) ) {
-        double dy = (y - yCur) * 10000 / (x - xCur);
-        if( x > xCur ) {
-            while( x - xCur > 10000 ) {
-                xCur += 10000;
-                yCur += dy;
-                cairo_line_to(cr, xCur, yCur);
-            }
-        }else{
-            while( xCur - x > 10000 ) {
-                xCur -= 10000;
-                yCur -= dy;
-                cairo_line_to(cr, xCur, yCur);
+    return edge->sign * (edge->isVertical ? pt->x : pt->y)
+        <= edge->sign * edge->pos;
+}
+
+static ClipPoint intersection(const ClipEdge *edge, const ClipPoint *p1,
+        const ClipPoint *p2)
+{
+    ClipPoint res;
+    gdouble t;
+
+    if( edge->isVertical ) {
+        t = (edge->pos - p1->x) / (p2->x - p1->x);
+        res.x = edge->pos;
+        res.y = p1->y + t * (p2->y - p1->y);
+    }else{
+        t = (edge->pos - p1->y) / (p2->y - p1->y);
+        res.x = p1->x + t * (p2->x - p1->x);
+        res.y = edge->pos;
+    }
+    res.isCurve = FALSE;
+    return res;
+}
+
+/* Clips the polygon (or polyline when not closed) to the half-plane.
+ * Parts outside are replaced by lines along the edge. Curves are assumed
+ * to be inside.
+ */
+static void clipToEdge(GArray *points, const ClipEdge *edge,
+        gboolean isClosed, GArray *res)
+{
+    const ClipPoint *prev, *cur;
+    ClipPoint pt;
+    gint i = 0;
+
+    g_array_set_size(res, 0);
+    if( points->len == 0 )
+        return;
+    if( isClosed ) {
+        prev = &g_array_index(points, ClipPoint, points->len - 1);
+    }else{
+        prev = &g_array_index(points, ClipPoint, 0);
+        if( isInside(edge, prev) )
+            g_array_append_val(res, *prev);
+        i = 1;
+    }
+    for(; i < points->len; ++i) {
+        cur = &g_array_index(points, ClipPoint, i);
+        if( isInside(edge, cur) ) {
+            if( ! isInside(edge, prev) ) {
+                pt = intersection(edge, prev, cur);
+                g_array_append_val(res, pt);
             }
+            g_array_append_val(res, *cur);
+        }else if( isInside(edge, prev) ) {
+            pt = intersection(edge, prev, cur);
+            g_array_append_val(res, pt);
         }
+        prev = cur;
+    }
+}
+
+static void appendPoint(GArray *points, gdouble x, gdouble y)
+{
+    ClipPoint pt;
+
+    pt.x = x;
+    pt.y = y;
+    pt.isCurve = FALSE;
+    g_array_append_val(points, pt);
+}
+
+static void appendCurve(GArray *points, const gdouble *rect,
+        gdouble x0, gdouble y0, gdouble x1, gdouble y1,
+        gdouble x2, gdouble y2, gdouble x3, gdouble y3, int depth)
+{
+    gdouble xMin, yMin, xMax, yMax;
+    gdouble x01, y01, x12, y12, x23, y23, xa, ya, xb, yb, xm, ym;
+    ClipPoint pt;
+
+    xMin = fmin(fmin(x0, x1), fmin(x2, x3));
+    yMin = fmin(fmin(y0, y1), fmin(y2, y3));
+    xMax = fmax(fmax(x0, x1), fmax(x2, x3));
+    yMax = fmax(fmax(y0, y1), fmax(y2, y3));
+    pt.x = x3;
+    pt.y = y3;
+    if( xMin >= rect[0] && yMin >= rect[1] && xMax <= rect[2]
+            && yMax <= rect[3] )
+    {
+        pt.isCurve = TRUE;
+        pt.x1 = x1;
+        pt.y1 = y1;
+        pt.x2 = x2;
+        pt.y2 = y2;
+        g_array_append_val(points, pt);
+    }else if( xMax < rect[0] || yMax < rect[1] || xMin > rect[2]
+            || yMin > rect[3] || depth == CURVE_SPLIT_MAX )
+    {
+        /* the curve is outside, so the chord is also */
+        pt.isCurve = FALSE;
+        g_array_append_val(points, pt);
     }else{
-        double dx = (x - xCur) * 10000 / (y - yCur);
-        if( y > yCur ) {
-            while( y - yCur > 10000 ) {
-                xCur += dx;
-                yCur += 10000;
-                cairo_line_to(cr, xCur, yCur);
-            }
-        }else{
-            while( yCur - y > 10000 ) {
-                xCur -= dx;
-                yCur -= 10000;
-                cairo_line_to(cr, xCur, yCur);
-            }
+        x01 = 0.5 * (x0 + x1); y01 = 0.5 * (y0 + y1);
+        x12 = 0.5 * (x1 + x2); y12 = 0.5 * (y1 + y2);
+        x23 = 0.5 * (x2 + x3); y23 = 0.5 * (y2 + y3);
+        xa = 0.5 * (x01 + x12); ya = 0.5 * (y01 + y12);
+        xb = 0.5 * (x12 + x23); yb = 0.5 * (y12 + y23);
+        xm = 0.5 * (xa + xb); ym = 0.5 * (ya + yb);
+        appendCurve(points, rect, x0, y0, x01, y01, xa, ya, xm, ym,
+                depth + 1);
+        appendCurve(points, rect, xm, ym, xb, yb, x23, y23, x3, y3,
+                depth + 1);
+    }
+}
+
+static void flushSubpath(cairo_t *cr, GArray *points, const gdouble *rect,
+        gboolean isClosed, GArray *tmp)
+{
+    ClipEdge edges[4] = {
+        { TRUE, -1, rect[0] }, { FALSE, -1, rect[1] },
+        { TRUE, 1, rect[2] }, { FALSE, 1, rect[3] }
+    };
+    const ClipPoint *pt;
+    GArray *swap;
+    gint i;
+
+    for(i = 0; i < 4 && points->len != 0; ++i) {
+        clipToEdge(points, edges + i, isClosed, tmp);
+        swap = points; points = tmp; tmp = swap;
+    }
+    if( points->len != 0 ) {
+        /* in closed polygon each point keeps segment from previous one */
+        pt = &g_array_index(points, ClipPoint, isClosed ? points->len - 1 : 0);
+        cairo_move_to(cr, pt->x, pt->y);
+        for(i = isClosed ? 0 : 1; i < points->len; ++i) {
+            pt = &g_array_index(points, ClipPoint, i);
+            if( pt->isCurve )
+                cairo_curve_to(cr, pt->x1, pt->y1, pt->x2, pt->y2,
+                        pt->x, pt->y);
+            else
+                cairo_line_to(cr, pt->x, pt->y);
+        }
+        if( isClosed )
+            cairo_close_path(cr);
+    }
+    g_array_set_size(points, 0);
+    g_array_set_size(tmp, 0);
+}
+
+void sd_appendPath(cairo_t *cr, const cairo_path_t *path, gdouble lineWidth)
+{
+    cairo_matrix_t matrix;
+    const cairo_path_data_t *data;
+    gdouble rect[4], margin, x, y, x1, y1, x2, y2;
+    gdouble xCur = 0, yCur = 0, xStart = 0, yStart = 0;
+    gdouble xMin = G_MAXDOUBLE, yMin = G_MAXDOUBLE;
+    gdouble xMax = -G_MAXDOUBLE, yMax = -G_MAXDOUBLE;
+    GArray *points, *tmp;
+    gint i, j;
+
+    cairo_get_matrix(cr, &matrix);
+    for(i = 0; i < path->num_data; i += path->data[i].header.length) {
+        data = path->data + i;
+        for(j = 1; j < data->header.length; ++j) {
+            x = data[j].point.x;
+            y = data[j].point.y;
+            cairo_matrix_transform_point(&matrix, &x, &y);
+            xMin = fmin(xMin, x);
+            yMin = fmin(yMin, y);
+            xMax = fmax(xMax, x);
+            yMax = fmax(yMax, y);
+        }
+    }
+    cairo_save(cr);
+    cairo_identity_matrix(cr);
+    cairo_clip_extents(cr, rect, rect + 1, rect + 2, rect + 3);
+    if( xMin >= rect[0] - LONG_PATH_LIMIT && yMin >= rect[1] - LONG_PATH_LIMIT
+            && xMax <= rect[2] + LONG_PATH_LIMIT
+            && yMax <= rect[3] + LONG_PATH_LIMIT )
+    {
+        cairo_restore(cr);
+        cairo_append_path(cr, path);
+        return;
+    }
+    /* Outside of the rectangle the path is replaced by lines along its
+     * edges. The margin hides them together with line joins.
+     */
+    margin = 5 * lineWidth + CLIP_MARGIN;
+    rect[0] -= margin;
+    rect[1] -= margin;
+    rect[2] += margin;
+    rect[3] += margin;
+    points = g_array_new(FALSE, FALSE, sizeof(ClipPoint));
+    tmp = g_array_new(FALSE, FALSE, sizeof(ClipPoint));
+    for(i = 0; i < path->num_data; i += path->data[i].header.length) {
+        data = path->data + i;
+        switch( data->header.type ) {
+        case CAIRO_PATH_MOVE_TO:
+            flushSubpath(cr, points, rect, FALSE, tmp);
+            xStart = xCur = data[1].point.x;
+            yStart = yCur = data[1].point.y;
+            cairo_matrix_transform_point(&matrix, &xStart, &yStart);
+            cairo_matrix_transform_point(&matrix, &xCur, &yCur);
+            appendPoint(points, xCur, yCur);
+            break;
+        case CAIRO_PATH_LINE_TO:
+            x = data[1].point.x;
+            y = data[1].point.y;
+            cairo_matrix_transform_point(&matrix, &x, &y);
+            if( points->len == 0 )
+                appendPoint(points, xCur, yCur);
+            appendPoint(points, x, y);
+            xCur = x;
+            yCur = y;
+            break;
+        case CAIRO_PATH_CURVE_TO:
+            x1 = data[1].point.x;
+            y1 = data[1].point.y;
+            x2 = data[2].point.x;
+            y2 = data[2].point.y;
+            x = data[3].point.x;
+            y = data[3].point.y;
+            cairo_matrix_transform_point(&matrix, &x1, &y1);
+            cairo_matrix_transform_point(&matrix, &x2, &y2);
+            cairo_matrix_transform_point(&matrix, &x, &y);
+            if( points->len == 0 )
+                appendPoint(points, xCur, yCur);
+            appendCurve(points, rect, xCur, yCur, x1, y1, x2, y2, x, y, 0);
+            xCur = x;
+            yCur = y;
+            break;
+        case CAIRO_PATH_CLOSE_PATH:
+            flushSubpath(cr, points, rect, TRUE, tmp);
+            xCur = xStart;
+            yCur = yStart;
+            break;
         }
     }
-    cairo_line_to(cr, x, y);
+    flushSubpath(cr, points, rect, FALSE, tmp);
+    g_array_free(points, TRUE);
+    g_array_free(tmp, TRUE);
+    cairo_restore(cr);
 }
 
 void sd_pathPoint(cairo_t *cr, gdouble x, gdouble y)
@@ -77,7 +303,7 @@ void sd_pathLine(cairo_t *cr, gdouble xBeg, gdouble yBeg,
     /* don't allow too dense wavy line from performance reasons */
     if( movement < 2.0 || 2.0 * round - deviation < 0.5 ) {
         cairo_move_to(cr, xBeg, yBeg);
-        crLineTo(cr, xEnd, yEnd);
+        cairo_line_to(cr, xEnd, yEnd);
     }else{
         double angleBound, angleBeg, angleEnd, mvIni, lim;
         double lineLen = sqrt((xEnd - xBeg) * (xEnd - xBeg)
@@ -186,7 +412,7 @@ void sd_pathTriangle(cairo_t *cr, gdouble xBeg, gdouble yBeg,
         angle = 170;
     if( fabs(angle) < 1 ) {
         cairo_move_to(cr, xBeg, yBeg);
-        crLineTo(cr, xEnd, yEnd);
+        cairo_line_to(cr, xEnd, yEnd);
     }else{
         double height, angleTan = tan(angle * G_PI / 360);
 
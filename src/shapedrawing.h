@@ -1,6 +1,13 @@
 #ifndef SHAPEDRAWING_H
 #define SHAPEDRAWING_H
 
+/* Appends the path to current path of cairo context. The path points are
+ * in user coordinates. Parts of the path far outside of the clip area
+ * are cut off, because cairo does not cope with very long lines. The
+ * lineWidth, in device units, is the stroke width used later; the path is
+ * not changed near the clip area.
+ */
+void sd_appendPath(cairo_t *cr, const cairo_path_t *path, gdouble lineWidth);
 
 void sd_pathPoint(cairo_t *cr, gdouble x, gdouble y);
 
@@ -54,12 +54,15 @@ static void on_buttondiv2_changed(GtkButton *button, gpointer user_data)
 }
 
 gboolean showSizeDialog(GtkWindow *owner, const char *title,
-        gdouble *width, gdouble *height, gboolean keepRatio)
+        gdouble *width, gdouble *height, gboolean keepRatio,
+        ImageScaleFilter *filter)
 {
     GtkBuilder *builder;
     GtkDialog *dialog;
     gboolean result = FALSE;
 	GtkButton *buttonX2, *buttonDiv2;
+    GtkWidget *labelFilter;
+    GtkComboBox *comboFilter;
 
     builder = gtk_builder_new_from_resource(
             "/org/rafaello7/wilqpaint/sizedialog.ui");
@@ -69,7 +72,15 @@ gboolean showSizeDialog(GtkWindow *owner, const char *title,
     spinHeight = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "spinHeight"));
     buttonX2 = GTK_BUTTON(gtk_builder_get_object(builder, "buttonX2"));
     buttonDiv2 = GTK_BUTTON(gtk_builder_get_object(builder, "buttonDiv2"));
+    labelFilter = GTK_WIDGET(gtk_builder_get_object(builder, "labelFilter"));
+    comboFilter = GTK_COMBO_BOX(gtk_builder_get_object(builder,
+                "comboFilter"));
     g_object_unref(builder);
+    if( filter != NULL ) {
+        gtk_combo_box_set_active(comboFilter, *filter);
+        gtk_widget_show(labelFilter);
+        gtk_widget_show(GTK_WIDGET(comboFilter));
+    }
     gtk_spin_button_set_value(spinWidth, *width);
     gtk_spin_button_set_value(spinHeight, *height);
     if( keepRatio ) {
@@ -87,6 +98,8 @@ gboolean showSizeDialog(GtkWindow *owner, const char *title,
     if( gtk_dialog_run(dialog) == 1 ) {
         *width = gtk_spin_button_get_value(spinWidth);
         *height = gtk_spin_button_get_value(spinHeight);
+        if( filter != NULL )
+            *filter = gtk_combo_box_get_active(comboFilter);
         result = TRUE;
     }
     gtk_widget_destroy(GTK_WIDGET(dialog));
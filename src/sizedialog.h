@@ -1,7 +1,12 @@
 #ifndef SIZEDIALOG_H
 #define SIZEDIALOG_H
 
+#include "imgscale.h"
+
+/* When filter is not NULL, the dialog allows to choose resampling filter.
+ */
 gboolean showSizeDialog(GtkWindow *owner, const char *title,
-        gdouble *width, gdouble *height, gboolean keepRatio);
+        gdouble *width, gdouble *height, gboolean keepRatio,
+        ImageScaleFilter *filter);
 
 #endif /* SIZEDIALOG_H */
@@ -0,0 +1,478 @@
+#include <gtk/gtk.h>
+#include "tilecache.h"
+#include <math.h>
+
+
+enum {
+    TILE_SIZE = 256,
+    TILE_COUNT_MAX = 256,   /* about 64 MB of ARGB tiles */
+    TILE_MARGIN = 8,        /* selection marks drawn outside of shapes */
+    PREV_ZOOM_RATIO_MAX = 8 /* max zoom out shown using previous tiles */
+};
+
+/* Data used to render tiles, shared by render jobs. The reference count
+ * is modified only by the main thread.
+ */
+typedef struct {
+    gint refCount;
+    gpointer data;
+    TileDrawFunc drawFunc;
+    GDestroyNotify destroyFunc;
+    gboolean isDraft;
+} TileSource;
+
+typedef struct {
+    cairo_surface_t *surface;   /* NULL until the first render finishes */
+    gboolean isValid;           /* surface content is up to date */
+    gboolean isDraft;           /* rendered from draft source */
+    guint invalidSerial;        /* min. serial of source giving valid tile */
+    guint pendingSerial;        /* source serial of queued render, 0 - none */
+    guint lastUsed;             /* tc_draw call number */
+} Tile;
+
+/* Passes render results from the render threads to tile cache. The link
+ * outlives the tile cache when some results are still on the way.
+ */
+typedef struct {
+    gint refCount;          /* atomic */
+    TileCache *tc;          /* NULL when the tile cache is freed */
+    GAsyncQueue *results;   /* rendered jobs */
+    gint isIdleQueued;      /* atomic, TRUE when results will be processed */
+    gint zoomSerial;        /* atomic, jobs for other zoom are skipped */
+} TileLink;
+
+typedef struct {
+    TileLink *link;
+    TileSource *source;
+    guint sourceSerial;
+    gint zoomSerial;
+    gint col, row;
+    gdouble zoom, deviceScale;
+    cairo_surface_t *surface;   /* the rendered tile, NULL when skipped */
+} TileJob;
+
+struct TileCache {
+    GHashTable *tiles;      /* key: row and column, see tileKey */
+    GHashTable *prevTiles;  /* tiles at previous zoom, shown until replaced */
+    gdouble zoom, prevZoom;
+    gdouble deviceScale;
+    guint drawCount;
+    TileSource *source;
+    guint sourceSerial;
+    TileLink *link;
+    GThreadPool *renderPool;
+    void (*onTileReady)(gpointer);
+    gpointer userData;
+};
+
+static gpointer tileKey(gint col, gint row)
+{
+    return GUINT_TO_POINTER((guint)row << 16 | (guint)col);
+}
+
+static void tileFree(gpointer data)
+{
+    Tile *tile = data;
+
+    if( tile->surface != NULL )
+        cairo_surface_destroy(tile->surface);
+    g_free(tile);
+}
+
+static GHashTable *tileTableNew(void)
+{
+    return g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, tileFree);
+}
+
+static void sourceUnref(TileSource *source)
+{
+    if( source != NULL && --source->refCount == 0 ) {
+        source->destroyFunc(source->data);
+        g_free(source);
+    }
+}
+
+static void linkUnref(TileLink *link)
+{
+    if( g_atomic_int_dec_and_test(&link->refCount) ) {
+        g_async_queue_unref(link->results);
+        g_free(link);
+    }
+}
+
+static cairo_surface_t *renderTile(TileDrawFunc drawFunc, gpointer data,
+        gint col, gint row, gdouble zoom, gdouble deviceScale)
+{
+    cairo_surface_t *surface;
+    cairo_t *cr;
+
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            ceil(TILE_SIZE * deviceScale), ceil(TILE_SIZE * deviceScale));
+    cairo_surface_set_device_scale(surface, deviceScale, deviceScale);
+    cr = cairo_create(surface);
+    cairo_translate(cr, -col * TILE_SIZE, -row * TILE_SIZE);
+    cairo_rectangle(cr, col * TILE_SIZE, row * TILE_SIZE,
+            TILE_SIZE, TILE_SIZE);
+    cairo_clip(cr);
+    drawFunc(cr, zoom, data);
+    cairo_destroy(cr);
+    return surface;
+}
+
+static void jobFree(TileJob *job)
+{
+    if( job->surface != NULL )
+        cairo_surface_destroy(job->surface);
+    sourceUnref(job->source);
+    g_free(job);
+}
+
+/* Stores the rendered tile. Returns TRUE when the tile has changed.
+ */
+static gboolean storeResult(TileCache *tc, TileJob *job)
+{
+    Tile *tile;
+
+    if( job->zoomSerial != g_atomic_int_get(&tc->link->zoomSerial) )
+        return FALSE;
+    tile = g_hash_table_lookup(tc->tiles, tileKey(job->col, job->row));
+    if( tile == NULL )
+        return FALSE;
+    if( tile->pendingSerial == job->sourceSerial )
+        tile->pendingSerial = 0;
+    if( job->sourceSerial >= tile->invalidSerial ) {
+        if( tile->surface != NULL )
+            cairo_surface_destroy(tile->surface);
+        tile->isValid = TRUE;
+        tile->isDraft = job->source->isDraft;
+    }else if( tile->surface != NULL )
+        return FALSE;
+    /* an outdated tile is still better than none */
+    tile->surface = job->surface;
+    job->surface = NULL;
+    return TRUE;
+}
+
+static gboolean onRenderDone(gpointer data)
+{
+    TileLink *link = data;
+    TileJob *job;
+    gboolean isTileReady = FALSE;
+
+    g_atomic_int_set(&link->isIdleQueued, FALSE);
+    while( (job = g_async_queue_try_pop(link->results)) != NULL ) {
+        if( link->tc != NULL && storeResult(link->tc, job) )
+            isTileReady = TRUE;
+        jobFree(job);
+    }
+    if( isTileReady )
+        link->tc->onTileReady(link->tc->userData);
+    linkUnref(link);
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs in a render thread.
+ */
+static void renderJob(gpointer data, gpointer userData)
+{
+    TileJob *job = data;
+    TileLink *link = job->link;
+
+    if( job->zoomSerial == g_atomic_int_get(&link->zoomSerial) ) {
+        job->surface = renderTile(job->source->drawFunc, job->source->data,
+                job->col, job->row, job->zoom, job->deviceScale);
+    }
+    g_async_queue_push(link->results, job);
+    if( g_atomic_int_compare_and_exchange(&link->isIdleQueued, FALSE, TRUE) )
+    {
+        g_atomic_int_inc(&link->refCount);
+        g_idle_add(onRenderDone, link);
+    }
+}
+
+TileCache *tc_new(void (*onTileReady)(gpointer), gpointer userData)
+{
+    TileCache *tc = g_malloc(sizeof(TileCache));
+
+    tc->tiles = tileTableNew();
+    tc->prevTiles = NULL;
+    tc->zoom = tc->prevZoom = 0;
+    tc->deviceScale = 0;
+    tc->drawCount = 0;
+    tc->source = NULL;
+    tc->sourceSerial = 0;
+    tc->link = g_malloc(sizeof(TileLink));
+    tc->link->refCount = 1;
+    tc->link->tc = tc;
+    tc->link->results = g_async_queue_new();
+    tc->link->isIdleQueued = FALSE;
+    tc->link->zoomSerial = 0;
+    tc->renderPool = g_thread_pool_new(renderJob, NULL,
+            MAX(g_get_num_processors() - 1, 1), FALSE, NULL);
+    tc->onTileReady = onTileReady;
+    tc->userData = userData;
+    return tc;
+}
+
+static void clearPrevTiles(TileCache *tc)
+{
+    if( tc->prevTiles != NULL ) {
+        g_hash_table_destroy(tc->prevTiles);
+        tc->prevTiles = NULL;
+    }
+}
+
+void tc_clear(TileCache *tc)
+{
+    g_hash_table_remove_all(tc->tiles);
+    clearPrevTiles(tc);
+}
+
+static void invalidateTile(TileCache *tc, Tile *tile)
+{
+    tile->isValid = FALSE;
+    tile->invalidSerial = tc->sourceSerial + 1;
+}
+
+void tc_invalidateRegion(TileCache *tc, const cairo_region_t *region)
+{
+    cairo_rectangle_int_t rect;
+    gint i, col, row, colBeg, colEnd, rowBeg, rowEnd;
+    Tile *tile;
+
+    if( g_hash_table_size(tc->tiles) == 0 )
+        return;
+    for(i = 0; i < cairo_region_num_rectangles(region); ++i) {
+        cairo_region_get_rectangle(region, i, &rect);
+        colBeg = MAX(floor((rect.x * tc->zoom - TILE_MARGIN) / TILE_SIZE), 0);
+        rowBeg = MAX(floor((rect.y * tc->zoom - TILE_MARGIN) / TILE_SIZE), 0);
+        colEnd = MIN(floor(((rect.x + rect.width) * tc->zoom + TILE_MARGIN)
+                    / TILE_SIZE), G_MAXUINT16);
+        rowEnd = MIN(floor(((rect.y + rect.height) * tc->zoom + TILE_MARGIN)
+                    / TILE_SIZE), G_MAXUINT16);
+        for(row = rowBeg; row <= rowEnd; ++row) {
+            for(col = colBeg; col <= colEnd; ++col) {
+                tile = g_hash_table_lookup(tc->tiles, tileKey(col, row));
+                if( tile != NULL )
+                    invalidateTile(tc, tile);
+            }
+        }
+    }
+}
+
+void tc_invalidateAll(TileCache *tc)
+{
+    GHashTableIter iter;
+    gpointer tile;
+
+    g_hash_table_iter_init(&iter, tc->tiles);
+    while( g_hash_table_iter_next(&iter, NULL, &tile) )
+        invalidateTile(tc, tile);
+}
+
+void tc_setSource(TileCache *tc, gpointer data, TileDrawFunc drawFunc,
+        GDestroyNotify destroyFunc, gboolean isDraft)
+{
+    GHashTableIter iter;
+    gpointer value;
+    Tile *tile;
+
+    if( ! isDraft ) {
+        g_hash_table_iter_init(&iter, tc->tiles);
+        while( g_hash_table_iter_next(&iter, NULL, &value) ) {
+            tile = value;
+            if( tile->isDraft )
+                invalidateTile(tc, tile);
+        }
+    }
+    sourceUnref(tc->source);
+    tc->source = g_malloc(sizeof(TileSource));
+    tc->source->refCount = 1;
+    tc->source->data = data;
+    tc->source->drawFunc = drawFunc;
+    tc->source->destroyFunc = destroyFunc;
+    tc->source->isDraft = isDraft;
+    ++tc->sourceSerial;
+}
+
+gboolean tc_hasSource(const TileCache *tc)
+{
+    return tc->source != NULL;
+}
+
+gboolean tc_isSourceDraft(const TileCache *tc)
+{
+    return tc->source != NULL && tc->source->isDraft;
+}
+
+static gboolean isTileUnused(gpointer key, gpointer value, gpointer user_data)
+{
+    const Tile *tile = value;
+    const TileCache *tc = user_data;
+
+    return tile->lastUsed != tc->drawCount;
+}
+
+static void queueRender(TileCache *tc, Tile *tile, gint col, gint row)
+{
+    TileJob *job = g_malloc(sizeof(TileJob));
+
+    job->link = tc->link;
+    job->source = tc->source;
+    ++tc->source->refCount;
+    job->sourceSerial = tc->sourceSerial;
+    job->zoomSerial = g_atomic_int_get(&tc->link->zoomSerial);
+    job->col = col;
+    job->row = row;
+    job->zoom = tc->zoom;
+    job->deviceScale = tc->deviceScale;
+    job->surface = NULL;
+    tile->pendingSerial = tc->sourceSerial;
+    g_thread_pool_push(tc->renderPool, job, NULL);
+}
+
+/* Paints area of the tile using tiles rendered at previous zoom.
+ * Returns FALSE when there is nothing to paint.
+ */
+static gboolean paintPrevTiles(TileCache *tc, cairo_t *cr, gint col, gint row)
+{
+    gdouble ratio = tc->zoom / tc->prevZoom;
+    gint prevCol, prevRow;
+    const Tile *tile;
+    gboolean res = FALSE;
+
+    if( tc->prevTiles == NULL || ratio * PREV_ZOOM_RATIO_MAX < 1 )
+        return FALSE;
+    cairo_save(cr);
+    cairo_rectangle(cr, col * TILE_SIZE, row * TILE_SIZE,
+            TILE_SIZE, TILE_SIZE);
+    cairo_clip(cr);
+    cairo_scale(cr, ratio, ratio);
+    for(prevRow = floor(row / ratio); prevRow < ceil((row + 1) / ratio);
+            ++prevRow)
+    {
+        for(prevCol = floor(col / ratio); prevCol < ceil((col + 1) / ratio);
+                ++prevCol)
+        {
+            tile = g_hash_table_lookup(tc->prevTiles,
+                    tileKey(prevCol, prevRow));
+            if( tile != NULL && tile->surface != NULL ) {
+                cairo_set_source_surface(cr, tile->surface,
+                        prevCol * TILE_SIZE, prevRow * TILE_SIZE);
+                cairo_rectangle(cr, prevCol * TILE_SIZE, prevRow * TILE_SIZE,
+                        TILE_SIZE, TILE_SIZE);
+                cairo_fill(cr);
+                res = TRUE;
+            }
+        }
+    }
+    cairo_restore(cr);
+    return res;
+}
+
+static void drawTiles(TileCache *tc, cairo_t *cr, gdouble zoom, gint width,
+        gint height, TileDrawFunc drawFunc, gpointer userData)
+{
+    gdouble clipX1, clipY1, clipX2, clipY2, deviceScale, deviceYScale;
+    gint col, row, colBeg, colEnd, rowBeg, rowEnd;
+    gboolean isPrevUsed = FALSE;
+    Tile *tile;
+
+    cairo_surface_get_device_scale(cairo_get_target(cr), &deviceScale,
+            &deviceYScale);
+    if( zoom != tc->zoom || deviceScale != tc->deviceScale ) {
+        clearPrevTiles(tc);
+        if( deviceScale == tc->deviceScale
+                && g_hash_table_size(tc->tiles) != 0 )
+        {
+            tc->prevTiles = tc->tiles;
+            tc->prevZoom = tc->zoom;
+            tc->tiles = tileTableNew();
+        }else
+            g_hash_table_remove_all(tc->tiles);
+        tc->zoom = zoom;
+        tc->deviceScale = deviceScale;
+        g_atomic_int_inc(&tc->link->zoomSerial);
+    }
+    ++tc->drawCount;
+    cairo_clip_extents(cr, &clipX1, &clipY1, &clipX2, &clipY2);
+    colBeg = MAX(floor(clipX1 / TILE_SIZE), 0);
+    rowBeg = MAX(floor(clipY1 / TILE_SIZE), 0);
+    colEnd = MIN(ceil(MIN(clipX2, width) / TILE_SIZE), G_MAXUINT16);
+    rowEnd = MIN(ceil(MIN(clipY2, height) / TILE_SIZE), G_MAXUINT16);
+    for(row = rowBeg; row < rowEnd; ++row) {
+        for(col = colBeg; col < colEnd; ++col) {
+            tile = g_hash_table_lookup(tc->tiles, tileKey(col, row));
+            if( tile == NULL ) {
+                tile = g_malloc(sizeof(Tile));
+                tile->surface = NULL;
+                tile->isValid = FALSE;
+                tile->isDraft = FALSE;
+                /* renders from older sources may be still on the way */
+                tile->invalidSerial = tc->sourceSerial;
+                tile->pendingSerial = 0;
+                g_hash_table_insert(tc->tiles, tileKey(col, row), tile);
+            }
+            tile->lastUsed = tc->drawCount;
+            if( ! tile->isValid ) {
+                if( drawFunc != NULL ) {
+                    if( tile->surface != NULL )
+                        cairo_surface_destroy(tile->surface);
+                    tile->surface = renderTile(drawFunc, userData, col, row,
+                            zoom, deviceScale);
+                    tile->isValid = TRUE;
+                    tile->isDraft = FALSE;
+                    tile->invalidSerial = tc->sourceSerial + 1;
+                }else if( tc->source != NULL
+                        && tc->sourceSerial >= tile->invalidSerial
+                        && (tile->pendingSerial == 0
+                            || tile->pendingSerial < tile->invalidSerial) )
+                {
+                    queueRender(tc, tile, col, row);
+                }
+            }
+            if( tile->surface != NULL ) {
+                cairo_set_source_surface(cr, tile->surface,
+                        col * TILE_SIZE, row * TILE_SIZE);
+                cairo_rectangle(cr, col * TILE_SIZE, row * TILE_SIZE,
+                        TILE_SIZE, TILE_SIZE);
+                cairo_fill(cr);
+            }else if( paintPrevTiles(tc, cr, col, row) )
+                isPrevUsed = TRUE;
+        }
+    }
+    if( ! isPrevUsed )
+        clearPrevTiles(tc);
+    if( g_hash_table_size(tc->tiles) > TILE_COUNT_MAX )
+        g_hash_table_foreach_remove(tc->tiles, isTileUnused, tc);
+}
+
+void tc_draw(TileCache *tc, cairo_t *cr, gdouble zoom, gint width,
+        gint height)
+{
+    drawTiles(tc, cr, zoom, width, height, NULL, NULL);
+}
+
+void tc_drawSync(TileCache *tc, cairo_t *cr, gdouble zoom, gint width,
+        gint height, TileDrawFunc drawFunc, gpointer userData)
+{
+    drawTiles(tc, cr, zoom, width, height, drawFunc, userData);
+}
+
+void tc_free(TileCache *tc)
+{
+    TileJob *job;
+
+    /* skip the queued jobs */
+    g_atomic_int_set(&tc->link->zoomSerial, -1);
+    g_thread_pool_free(tc->renderPool, FALSE, TRUE);
+    while( (job = g_async_queue_try_pop(tc->link->results)) != NULL )
+        jobFree(job);
+    tc->link->tc = NULL;
+    linkUnref(tc->link);
+    sourceUnref(tc->source);
+    g_hash_table_destroy(tc->tiles);
+    clearPrevTiles(tc);
+    g_free(tc);
+}
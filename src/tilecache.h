@@ -0,0 +1,61 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+/* Rendered image kept in square tiles, at one zoom. Tiles are rendered
+ * by background threads, from a source set by tc_setSource. Until a tile
+ * is rendered, its previous content is shown, or content rendered at the
+ * previous zoom.
+ */
+typedef struct TileCache TileCache;
+
+/* Draws image part on the tile. The cairo context is translated so the
+ * image origin is at (0, 0) and clipped to the tile area.
+ */
+typedef void (*TileDrawFunc)(cairo_t*, gdouble zoom, gpointer userData);
+
+/* The onTileReady function is called on the main thread when some tiles
+ * have been rendered and the image should be redrawn.
+ */
+TileCache *tc_new(void (*onTileReady)(gpointer), gpointer userData);
+
+/* Discards all tiles.
+ */
+void tc_clear(TileCache*);
+
+/* Marks tiles covering the region, given in image coordinates
+ * (before zoom), as outdated. The tiles are rendered again using the
+ * next source.
+ */
+void tc_invalidateRegion(TileCache*, const cairo_region_t*);
+
+/* Marks all tiles as outdated.
+ */
+void tc_invalidateAll(TileCache*);
+
+/* Sets data used to render tiles. The data is passed to drawFunc in
+ * render threads, so it should not be changed later. When the data is no
+ * longer needed, destroyFunc is called on the main thread.
+ * Tiles rendered from a draft source are rendered again when a non-draft
+ * source is set.
+ */
+void tc_setSource(TileCache*, gpointer data, TileDrawFunc drawFunc,
+        GDestroyNotify destroyFunc, gboolean isDraft);
+
+gboolean tc_hasSource(const TileCache*);
+gboolean tc_isSourceDraft(const TileCache*);
+
+/* Paints the clip area of the cairo context using cached tiles. Rendering
+ * of missing and outdated tiles is queued. All tiles are discarded when
+ * zoom differs from the zoom of cached ones.
+ */
+void tc_draw(TileCache*, cairo_t*, gdouble zoom, gint width, gint height);
+
+/* Like tc_draw, but missing and outdated tiles are rendered immediately
+ * using drawFunc.
+ */
+void tc_drawSync(TileCache*, cairo_t*, gdouble zoom, gint width,
+        gint height, TileDrawFunc drawFunc, gpointer userData);
+
+void tc_free(TileCache*);
+
+#endif /* TILECACHE_H */
@@ -1,10 +1,13 @@
 #include <gtk/gtk.h>
 #include "wilqpaintapp.h"
 #include "wilqpaintwin.h"
+#include "drawimage.h"
+#include "imagefile.h"
 
 
 struct WilqpaintApp {
     GtkApplication parent;
+    gboolean isOpenedFromOptions;   /* skip the activation window */
 };
 
 typedef struct {
@@ -13,6 +16,18 @@ typedef struct {
 
 G_DEFINE_TYPE(WilqpaintApp, wilqpaint_app, GTK_TYPE_APPLICATION);
 
+static const GOptionEntry gOptions[] = {
+    { "export", 'e', 0, G_OPTION_ARG_FILENAME_ARRAY, NULL,
+        "Write the image scaled by SCALE to PATH and exit; may be repeated",
+        "SCALE:PATH" },
+    { "compression", 'c', 0, G_OPTION_ARG_INT, NULL,
+        "Compression level of exported PNG files, 0 (none) to 9 (best)",
+        "LEVEL" },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, NULL, NULL,
+        "FILE" },
+    { NULL }
+};
+
 
 static void wilqpaint_app_init(WilqpaintApp *app)
 {
@@ -33,7 +48,12 @@ static void wilqpaint_app_startup(GApplication *app)
 
 static void wilqpaint_app_activate(GApplication *app)
 {
-    wilqpaint_windowNew(GTK_APPLICATION(app), NULL);
+    WilqpaintApp *wapp = WILQPAINT_APP(app);
+
+    if( wapp->isOpenedFromOptions )
+        wapp->isOpenedFromOptions = FALSE;
+    else
+        wilqpaint_windowNew(GTK_APPLICATION(app), NULL);
 }
 
 static void wilqpaint_app_open(GApplication  *app,
@@ -48,18 +68,123 @@ static void wilqpaint_app_open(GApplication  *app,
     }
 }
 
+/* Exports the image file at scales given in "SCALE:PATH" form.
+ * Returns the process exit status.
+ */
+static gint exportImage(const char *fileName, gchar **exports,
+        gint compressionLevel)
+{
+    gint count = g_strv_length(exports), i;
+    gdouble *scales = g_malloc(count * sizeof(gdouble));
+    const char **fileNames = g_malloc(count * sizeof(char*));
+    char *end;
+    gchar *err = NULL;
+    gboolean isOK = TRUE, isNoEntErr;
+    DrawImage *di;
+
+    for(i = 0; i < count && isOK; ++i) {
+        scales[i] = g_ascii_strtod(exports[i], &end);
+        fileNames[i] = end + 1;
+        if( end == exports[i] || *end != ':' || end[1] == '\0'
+                || !(scales[i] > 0) )
+        {
+            err = g_strdup_printf("invalid export \"%s\", should be"
+                    " SCALE:PATH", exports[i]);
+            isOK = FALSE;
+        }
+    }
+    if( isOK ) {
+        if( (di = imgfile_open(fileName, &err, &isNoEntErr)) != NULL ) {
+            isOK = imgfile_saveScaled(di, count, scales, fileNames,
+                    compressionLevel, &err);
+            di_free(di);
+        }else
+            isOK = FALSE;
+    }
+    if( ! isOK ) {
+        g_printerr("%s\n", err);
+        g_free(err);
+    }
+    g_free(scales);
+    g_free(fileNames);
+    return isOK ? 0 : 1;
+}
+
+/* Opens files given on the command line. The files are consumed by the
+ * option parser, so the application would be activated instead.
+ */
+static gint openFiles(GApplication *app, gchar **files)
+{
+    gint count = g_strv_length(files), i;
+    GFile **gfiles;
+    GError *gerr = NULL;
+
+    if( ! g_application_register(app, NULL, &gerr) ) {
+        g_printerr("%s\n", gerr->message);
+        g_error_free(gerr);
+        return 1;
+    }
+    gfiles = g_malloc(count * sizeof(GFile*));
+    for(i = 0; i < count; ++i)
+        gfiles[i] = g_file_new_for_commandline_arg(files[i]);
+    g_application_open(app, gfiles, count, "");
+    for(i = 0; i < count; ++i)
+        g_object_unref(gfiles[i]);
+    g_free(gfiles);
+    WILQPAINT_APP(app)->isOpenedFromOptions = TRUE;
+    return -1;
+}
+
+static gint wilqpaint_app_handle_local_options(GApplication *app,
+        GVariantDict *options)
+{
+    gchar **exports, **files = NULL;
+    gint compressionLevel = -1, res;
+
+    if( ! g_variant_dict_lookup(options, "export", "^a&ay", &exports) ) {
+        res = -1;
+        if( g_variant_dict_lookup(options, G_OPTION_REMAINING, "^a&ay",
+                    &files) )
+        {
+            res = openFiles(app, files);
+            g_free(files);
+        }
+        return res;
+    }
+    g_variant_dict_lookup(options, "compression", "i", &compressionLevel);
+    if( compressionLevel < -1 || compressionLevel > 9 ) {
+        g_printerr("invalid compression level %d, should be 0 to 9\n",
+                compressionLevel);
+        res = 1;
+    }else if( g_variant_dict_lookup(options, G_OPTION_REMAINING, "^a&ay",
+                &files) && g_strv_length(files) == 1 )
+    {
+        res = exportImage(files[0], exports, compressionLevel);
+    }else{
+        g_printerr("--export requires exactly one image file\n");
+        res = 1;
+    }
+    g_free(files);
+    g_free(exports);
+    return res;
+}
+
 static void wilqpaint_app_class_init (WilqpaintAppClass *class)
 {
     G_APPLICATION_CLASS(class)->startup = wilqpaint_app_startup;
     G_APPLICATION_CLASS(class)->activate = wilqpaint_app_activate;
     G_APPLICATION_CLASS(class)->open = wilqpaint_app_open;
+    G_APPLICATION_CLASS(class)->handle_local_options =
+        wilqpaint_app_handle_local_options;
 }
 
 WilqpaintApp *wilqpaint_appNew(void)
 {
-    return g_object_new (WILQPAINT_APP_TYPE,
+    WilqpaintApp *app = g_object_new (WILQPAINT_APP_TYPE,
             //"application-id", "org.rafaello7.wilqpaint",
             "flags", G_APPLICATION_HANDLES_OPEN,
             NULL);
+    g_application_add_main_option_entries(G_APPLICATION(app), gOptions);
+    return app;
 }
 
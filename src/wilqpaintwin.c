@@ -11,6 +11,7 @@
 #include "aboutdialog.h"
 #include "imgtype.h"
 #include "imagefile.h"
+#include "tilecache.h"
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
@@ -31,14 +32,40 @@ typedef enum {
     MA_LOUPE
 } MouseAction;
 
+enum {
+    GRID_TILE_MAX = 256     /* max grid period drawn using a pattern */
+};
+
+/* Target of image copied to clipboard, for paste back into wilqpaint.
+ */
+#define CLIPBOARD_WLQ_TARGET "application/x-wilqpaint"
+
+enum {
+    CLIPBOARD_INFO_IMAGE,
+    CLIPBOARD_INFO_WLQ
+};
+
+/* Pointer position received in motion event, waiting for next frame.
+ */
+typedef struct {
+    gdouble x, y;
+    GdkModifierType state;
+} PendingMotion;
+
 typedef struct {
     char *curFileName;
+    gboolean isBaseImageLinked;     /* save option of SVG file */
     DrawImage *drawImage;
     MouseAction curAction;
 
     /* MA_LAYOUT */
     gdouble snapXoffset, snapYoffset;
     gdouble lastEvX, lastEvY;
+    gboolean isFreeformCapture;     /* all motion events are kept */
+
+    /* motion events are applied once per frame */
+    GArray *pendingMotion;
+    guint motionTickId;
 
     /* selection - MA_SELECTAREA */
     gdouble selXbeg, selYbeg, selWidth, selHeight;
@@ -54,12 +81,25 @@ typedef struct {
     gdouble drawingHAdjNewX, drawingVAdjNewY;
     gdouble curZoom;
     gint shapeControlsSetInProgress;
+    gboolean simplifyFreeform;
+    gboolean usePickBuffer;
     GridOptions *gopts;
+    TileCache *tileCache;
     struct {
         gdouble round;
         gdouble angle;
         gboolean isRight;
     } curParams[ST_COUNT];
+    struct {
+        cairo_pattern_t *pattern;   /* NULL when not created yet */
+        gdouble scale, xOffset, yOffset, deviceScale;
+    } gridCache;
+    struct {
+        cairo_surface_t *surface;   /* NULL when not drawn yet */
+        ShapeType shapeType;
+        ShapeParams params;         /* text is not NULL when non-empty */
+        gint width, height;
+    } previewCache;
 
     /* controls */
     GtkWidget       *drawing;
@@ -101,6 +141,14 @@ typedef struct {
 G_DEFINE_TYPE_WITH_PRIVATE(WilqpaintWindow, wilqpaint_window,
         GTK_TYPE_APPLICATION_WINDOW);
 
+static void onTileReady(gpointer data)
+{
+    WilqpaintWindowPrivate *priv = wilqpaint_window_get_instance_private(
+            WILQPAINT_WINDOW(data));
+
+    gtk_widget_queue_draw(priv->drawing);
+}
+
 static void wilqpaint_window_init(WilqpaintWindow *win)
 {
     WilqpaintWindowPrivate *priv;
@@ -108,8 +156,12 @@ static void wilqpaint_window_init(WilqpaintWindow *win)
     gtk_widget_init_template(GTK_WIDGET(win));
     priv = wilqpaint_window_get_instance_private(win);
     priv->curFileName = NULL;
+    priv->isBaseImageLinked = FALSE;
     priv->drawImage = NULL;
     priv->curAction = MA_NONE;
+    priv->isFreeformCapture = FALSE;
+    priv->pendingMotion = g_array_new(FALSE, FALSE, sizeof(PendingMotion));
+    priv->motionTickId = 0;
     priv->moveXref = 0;
     priv->moveYref = 0;
     priv->selWidth = 0;
@@ -117,7 +169,13 @@ static void wilqpaint_window_init(WilqpaintWindow *win)
     priv->curZoom = 1.0;
     priv->drawingHAdjNewX = priv->drawingVAdjNewY = -1.0;
     priv->shapeControlsSetInProgress = 0;
+    priv->simplifyFreeform = FALSE;
+    priv->usePickBuffer = FALSE;
     priv->gopts = grid_optsNew();
+    priv->tileCache = tc_new(onTileReady, win);
+    priv->gridCache.pattern = NULL;
+    priv->previewCache.surface = NULL;
+    priv->previewCache.params.fontName = NULL;
     priv->curParams[ST_FREEFORM].round = 0;
     priv->curParams[ST_FREEFORM].angle = 0;
     priv->curParams[ST_FREEFORM].isRight = FALSE;
@@ -141,6 +199,16 @@ static void wilqpaint_window_init(WilqpaintWindow *win)
     priv->curParams[ST_ARROW].isRight = FALSE;
 }
 
+static void freeShapePreviewCache(WilqpaintWindowPrivate *priv)
+{
+    if( priv->previewCache.surface != NULL ) {
+        cairo_surface_destroy(priv->previewCache.surface);
+        priv->previewCache.surface = NULL;
+    }
+    g_free((void*)priv->previewCache.params.fontName);
+    priv->previewCache.params.fontName = NULL;
+}
+
 static void wilqpaint_window_dispose(GObject *object)
 {
     WilqpaintWindow *win;
@@ -153,6 +221,23 @@ static void wilqpaint_window_dispose(GObject *object)
     priv = wilqpaint_window_get_instance_private(win);
     grid_optsFree(priv->gopts);
     priv->gopts = NULL;
+    freeShapePreviewCache(priv);
+    if( priv->tileCache != NULL ) {
+        tc_free(priv->tileCache);
+        priv->tileCache = NULL;
+    }
+    if( priv->gridCache.pattern != NULL ) {
+        cairo_pattern_destroy(priv->gridCache.pattern);
+        priv->gridCache.pattern = NULL;
+    }
+    if( priv->motionTickId ) {
+        gtk_widget_remove_tick_callback(priv->drawing, priv->motionTickId);
+        priv->motionTickId = 0;
+    }
+    if( priv->pendingMotion ) {
+        g_array_free(priv->pendingMotion, TRUE);
+        priv->pendingMotion = NULL;
+    }
     G_OBJECT_CLASS(wilqpaint_window_parent_class)->dispose(object);
 }
 
@@ -260,6 +345,19 @@ static void redrawDrawingArea(GtkWidget *drawing)
     gdk_window_invalidate_rect(gtk_widget_get_window(drawing), NULL, FALSE);
 }
 
+/* Prints memory report of the image when WILQPAINT_DEBUG_DUMP environment
+ * variable is set.
+ */
+static void debugDump(WilqpaintWindowPrivate *priv)
+{
+    static gint isEnabled = -1;
+
+    if( isEnabled < 0 )
+        isEnabled = g_getenv("WILQPAINT_DEBUG_DUMP") != NULL;
+    if( isEnabled )
+        di_dump(priv->drawImage);
+}
+
 void adjustDrawingSize(WilqpaintWindowPrivate *priv,
         gboolean adjustImageSizeSpins)
 {
@@ -355,57 +453,51 @@ static void getShapeParamsFromControls(WilqpaintWindowPrivate *priv,
             GTK_FONT_CHOOSER(priv->fontButton));
 }
 
-void on_shapePreview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+/* Creates shape drawn as a preview in the tool panel.
+ */
+static Shape *createPreviewShape(ShapeType shapeType,
+        const ShapeParams *shapeParams, gdouble winWidth, gdouble winHeight)
 {
-    ShapeParams shapeParams;
+    ShapeParams textParams;
     Shape *shape = NULL;
     int i;
-    gdouble thickness, round, winWidth, winHeight, shapeWidth, shapeHeight;
-    gdouble shapeMargin, angle, angleSin, angleCos, angleSin2, angleCos2;
-    gboolean hasText;
-    WilqpaintWindow *win;
-    WilqpaintWindowPrivate *priv;
-
-    win = WILQPAINT_WINDOW(gtk_widget_get_toplevel(widget));
-    priv = wilqpaint_window_get_instance_private(win);
-    winWidth = gtk_widget_get_allocated_width(widget);
-    winHeight = gtk_widget_get_allocated_height(widget);
-    if( winWidth <= 20 || winHeight <= 20 )
-        return;
-    getShapeParamsFromControls(priv, &shapeParams);
-    hasText = shapeParams.text && shapeParams.text[0];
-    g_free((void*)shapeParams.text);
-    shapeParams.text = hasText ? "Ww" : NULL;
-    thickness = shapeParams.thickness;
-    round = shapeParams.round;
-    if( gtk_toggle_button_get_active(priv->shapeFreeForm) ) {
-        shape = shape_new(ST_FREEFORM, 0, winHeight / 6, &shapeParams);
+    gdouble thickness, round, shapeWidth, shapeHeight, shapeMargin;
+    gdouble angle, angleSin, angleCos, angleSin2, angleCos2;
+    gdouble htop, hbottom, maxShapeWidth, maxShapeHeight, xLen, yLen;
+
+    thickness = shapeParams->thickness;
+    round = shapeParams->round;
+    switch( shapeType ) {
+    case ST_FREEFORM:
+        shape = shape_new(ST_FREEFORM, 0, winHeight / 6, shapeParams);
         for(i = 4; i < winWidth; i += 4) {
             shape_layoutNew(shape, i, winHeight * (1.0/6.0
                         + 0.2 * (3.0 - cos(53.0 * G_PI / winWidth)
                             - 4.0 * fabs(i - 0.5 * winWidth) / winWidth
                             - cos(5.3 * (i - 10) / winWidth * G_PI))), FALSE);
         }
-    }else if( gtk_toggle_button_get_active(priv->shapeLine) ) {
+        break;
+    case ST_LINE:
         shapeMargin = 2;
         /* ensure the shape is at pixel boundary */
         if( fmod(winHeight + thickness, 2) == 1 )
             --winHeight;
-        shape = shape_new(ST_LINE, shapeMargin, 0.5 * winHeight, &shapeParams);
+        shape = shape_new(ST_LINE, shapeMargin, 0.5 * winHeight, shapeParams);
         shape_layoutNew(shape, winWidth - shapeMargin, 0.5 * winHeight, FALSE);
-    }else if( gtk_toggle_button_get_active(priv->shapeArrow) ) {
+        break;
+    case ST_ARROW:
         shapeMargin = 2;
         if( fmod(winHeight + thickness, 2) == 1 )
             --winHeight;
-        shape = shape_new(ST_ARROW, shapeMargin, 0.5 * winHeight, &shapeParams);
+        shape = shape_new(ST_ARROW, shapeMargin, 0.5 * winHeight, shapeParams);
         shape_layoutNew(shape, winWidth - shapeMargin, 0.5 * winHeight, FALSE);
-    }else if( gtk_toggle_button_get_active(priv->shapeTriangle) ) {
-        gdouble htop, hbottom;
-        angle = shapeParams.angle * G_PI / 360;
+        break;
+    case ST_TRIANGLE:
+        angle = shapeParams->angle * G_PI / 360;
         if( round == 0 ) {
             /* it looks that cairo_stroke cutts vertex of triangle when
              * angle is less than 12 degrees */
-            if( shapeParams.angle >= 12 )
+            if( shapeParams->angle >= 12 )
                 htop = 0.5 * thickness / sin(angle);
             else
                 htop = 0.5 * thickness;
@@ -413,7 +505,7 @@ void on_shapePreview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
             gdouble hh = winHeight - htop - hbottom - 8;
             gdouble hw = 0.5 * (winWidth - 8) / tan(angle);
             /* 12 degrees boundary of opposite angle */
-            if( shapeParams.angle <= 180 - 2 * 12 )
+            if( shapeParams->angle <= 180 - 2 * 12 )
                 hw -= 0.5 * thickness * (1.0 + 1.0 / sin(angle));
             else
                 hw -= 0.5 * thickness / tan(angle);
@@ -428,14 +520,15 @@ void on_shapePreview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
         }
         shape = shape_new(ST_TRIANGLE, 0.5 * winWidth,
                 0.5 * (winHeight - shapeHeight + htop - hbottom),
-                &shapeParams);
+                shapeParams);
         shape_layoutNew(shape, 0.5 * winWidth,
                 0.5 * (winHeight + shapeHeight + htop - hbottom), FALSE);
-    }else if( gtk_toggle_button_get_active(priv->shapeRect) ) {
-        gdouble maxShapeWidth = winWidth - 16 - thickness;
-        gdouble maxShapeHeight = winHeight - 16 - thickness;
-        angle = fmod(shapeParams.angle, 90.0);
-        if( shapeParams.isRight )
+        break;
+    case ST_RECT:
+        maxShapeWidth = winWidth - 16 - thickness;
+        maxShapeHeight = winHeight - 16 - thickness;
+        angle = fmod(shapeParams->angle, 90.0);
+        if( shapeParams->isRight )
             angle = 90 - angle;
         angle *= G_PI / 180;
         angleSin = sin(angle);
@@ -461,8 +554,8 @@ void on_shapePreview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
         }else{
             shapeHeight = shapeWidth * angleCos2 / angleSin2;
         }
-        gdouble xLen = shapeWidth * angleCos - shapeHeight * angleSin;
-        gdouble yLen = shapeWidth * angleSin + shapeHeight * angleCos;
+        xLen = shapeWidth * angleCos - shapeHeight * angleSin;
+        yLen = shapeWidth * angleSin + shapeHeight * angleCos;
         if( round != 0 ) {
             round = fmin(round, 0.5 * G_SQRT2 * fmin(fabs(xLen), fabs(yLen)));
             shapeWidth = fmax(1, fmin(shapeWidth, maxShapeWidth
@@ -473,14 +566,15 @@ void on_shapePreview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
                     shapeHeight);
         }
         shape = shape_new(ST_RECT, 0.5 * (winWidth - shapeWidth),
-                0.5 * (winHeight - shapeHeight), &shapeParams);
+                0.5 * (winHeight - shapeHeight), shapeParams);
         shape_layoutNew(shape, 0.5 * (winWidth + shapeWidth),
                 0.5 * (winHeight + shapeHeight), FALSE);
-    }else if( gtk_toggle_button_get_active(priv->shapeOval) ) {
+        break;
+    case ST_OVAL:
         shapeWidth = fmax(1, winWidth - thickness - 8);
         shapeHeight = fmax(1, winHeight - thickness - 8);
-        angle = fmod(shapeParams.angle, 90.0);
-        if( shapeParams.isRight )
+        angle = fmod(shapeParams->angle, 90.0);
+        if( shapeParams->isRight )
             angle = 90 - angle;
         angle *= G_PI / 180;
         angleSin = sin(angle);
@@ -499,19 +593,95 @@ void on_shapePreview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
             shapeHeight = b * (angleCos - 0.5 * G_SQRT2 * angleSin);
         }
         shape = shape_new(ST_OVAL, 0.5 * (winWidth - shapeWidth),
-                0.5 * (winHeight - shapeHeight), &shapeParams);
+                0.5 * (winHeight - shapeHeight), shapeParams);
         shape_layoutNew(shape,  0.5 * (winWidth + shapeWidth),
                 0.5 * (winHeight + shapeHeight), FALSE);
-    }else if( gtk_toggle_button_get_active(priv->shapeText) ) {
-        shapeParams.text = "Ww";
+        break;
+    case ST_TEXT:
+        textParams = *shapeParams;
+        textParams.text = "Ww";
         shape = shape_new(ST_TEXT, 0.5 * winWidth, 0.5 * winHeight,
-                &shapeParams);
+                &textParams);
         shape_layoutNew(shape, 0.5 * winWidth, 0.5 * winHeight, FALSE);
+        break;
+    default:
+        break;
     }
-    if( shape != NULL ) {
-        shape_draw(shape, cr, 1.0, FALSE, FALSE);
-        shape_unref(shape);
+    return shape;
+}
+
+/* Returns TRUE when the cached shape preview was drawn for the same shape
+ * type, parameters and size.
+ */
+static gboolean isShapePreviewCacheValid(const WilqpaintWindowPrivate *priv,
+        ShapeType shapeType, const ShapeParams *shapeParams,
+        gint width, gint height)
+{
+    const ShapeParams *cached = &priv->previewCache.params;
+
+    return priv->previewCache.surface != NULL
+        && priv->previewCache.shapeType == shapeType
+        && priv->previewCache.width == width
+        && priv->previewCache.height == height
+        && gdk_rgba_equal(&cached->strokeColor, &shapeParams->strokeColor)
+        && gdk_rgba_equal(&cached->fillColor, &shapeParams->fillColor)
+        && gdk_rgba_equal(&cached->textColor, &shapeParams->textColor)
+        && cached->thickness == shapeParams->thickness
+        && cached->round == shapeParams->round
+        && cached->angle == shapeParams->angle
+        && cached->isRight == shapeParams->isRight
+        && (cached->text == NULL) == (shapeParams->text == NULL)
+        && g_strcmp0(cached->fontName, shapeParams->fontName) == 0;
+}
+
+void on_shapePreview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    ShapeParams shapeParams;
+    ShapeType shapeType;
+    Shape *shape;
+    gint winWidth, winHeight;
+    gboolean hasText;
+    cairo_t *previewCr;
+    WilqpaintWindow *win;
+    WilqpaintWindowPrivate *priv;
+
+    win = WILQPAINT_WINDOW(gtk_widget_get_toplevel(widget));
+    priv = wilqpaint_window_get_instance_private(win);
+    winWidth = gtk_widget_get_allocated_width(widget);
+    winHeight = gtk_widget_get_allocated_height(widget);
+    if( winWidth <= 20 || winHeight <= 20 )
+        return;
+    shapeType = getCurShapeType(priv);
+    if( shapeType == ST_COUNT )
+        return;
+    getShapeParamsFromControls(priv, &shapeParams);
+    hasText = shapeParams.text && shapeParams.text[0];
+    g_free((void*)shapeParams.text);
+    shapeParams.text = hasText ? "Ww" : NULL;
+    if( isShapePreviewCacheValid(priv, shapeType, &shapeParams,
+                winWidth, winHeight) )
+    {
+        g_free((void*)shapeParams.fontName);
+    }else{
+        freeShapePreviewCache(priv);
+        priv->previewCache.surface = gdk_window_create_similar_surface(
+                gtk_widget_get_window(widget), CAIRO_CONTENT_COLOR_ALPHA,
+                winWidth, winHeight);
+        priv->previewCache.shapeType = shapeType;
+        priv->previewCache.params = shapeParams;
+        priv->previewCache.width = winWidth;
+        priv->previewCache.height = winHeight;
+        shape = createPreviewShape(shapeType, &shapeParams,
+                winWidth, winHeight);
+        if( shape != NULL ) {
+            previewCr = cairo_create(priv->previewCache.surface);
+            shape_draw(shape, previewCr, 1.0, FALSE, FALSE, FALSE);
+            cairo_destroy(previewCr);
+            shape_unref(shape);
+        }
     }
+    cairo_set_source_surface(cr, priv->previewCache.surface, 0, 0);
+    cairo_paint(cr);
 }
 
 void on_thickness_value_changed(GtkSpinButton *spin, gpointer user_data)
@@ -922,9 +1092,18 @@ gboolean on_drawing_button_press(GtkWidget *widget, GdkEventButton *event,
             shapeType = getCurShapeType(priv);
             if( shapeType != ST_COUNT ) {
                 getShapeParamsFromControls(priv, &shapeParams);
+                /* drop points deviating less than half of screen pixel */
+                di_setFreeformTolerance(priv->drawImage,
+                        priv->simplifyFreeform ? 0.5 / priv->curZoom : 0);
                 di_addShape(priv->drawImage, shapeType, evX, evY, &shapeParams,
                         gtk_toggle_button_get_active(priv->drawBottom));
                 g_free((void*)shapeParams.text);
+                if( shapeType == ST_FREEFORM ) {
+                    /* get all motion events, not only one per frame */
+                    gdk_window_set_event_compression(
+                            gtk_widget_get_window(widget), FALSE);
+                    priv->isFreeformCapture = TRUE;
+                }
                 priv->lastEvX = evX;
                 priv->lastEvY = evY;
                 priv->snapXoffset = priv->snapYoffset = 0;
@@ -937,11 +1116,80 @@ gboolean on_drawing_button_press(GtkWidget *widget, GdkEventButton *event,
     return GDK_EVENT_STOP;
 }
 
+/* Applies pointer move to the image.
+ */
+static void applyMotion(WilqpaintWindowPrivate *priv, gdouble x, gdouble y,
+        GdkModifierType state)
+{
+    gdouble evX, evY;
+
+    switch( priv->curAction ) {
+    case MA_LAYOUT:
+        evX = grid_getSnapXValue(priv->gopts,
+                mapXValue(priv, x, MDP_TO_DRAWIMAGE)
+                - priv->snapXoffset, priv->curZoom) + priv->snapXoffset;
+        evY = grid_getSnapYValue(priv->gopts,
+                mapYValue(priv, y, MDP_TO_DRAWIMAGE)
+                - priv->snapYoffset, priv->curZoom) + priv->snapYoffset;
+        di_selectionDragTo(priv->drawImage, evX, evY,
+                state & GDK_SHIFT_MASK);
+        priv->lastEvX = evX;
+        priv->lastEvY = evY;
+        break;
+    case MA_MOVEIMAGE:
+        evX = mapXValue(priv, x, MDP_TO_DRAWIMAGE_SNAPPED);
+        evY = mapYValue(priv, y, MDP_TO_DRAWIMAGE_SNAPPED);
+        di_moveTo(priv->drawImage, evX - priv->moveXref,
+                evY - priv->moveYref);
+        break;
+    case MA_SELECTAREA:
+        evX = mapXValue(priv, x, MDP_TO_DRAWIMAGE);
+        evY = mapYValue(priv, y, MDP_TO_DRAWIMAGE);
+        priv->selWidth = evX - priv->selXbeg;
+        priv->selHeight = evY - priv->selYbeg;
+        di_selectionFromRect(priv->drawImage, evX, evY);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Applies all motion events received since last frame. Returns TRUE when
+ * there was any.
+ */
+static gboolean flushPendingMotion(WilqpaintWindowPrivate *priv)
+{
+    const PendingMotion *motion;
+    guint i;
+
+    if( priv->pendingMotion->len == 0 )
+        return FALSE;
+    for(i = 0; i < priv->pendingMotion->len; ++i) {
+        motion = &g_array_index(priv->pendingMotion, PendingMotion, i);
+        applyMotion(priv, motion->x, motion->y, motion->state);
+    }
+    g_array_set_size(priv->pendingMotion, 0);
+    return TRUE;
+}
+
+static gboolean onMotionTick(GtkWidget *widget, GdkFrameClock *frameClock,
+        gpointer user_data)
+{
+    WilqpaintWindowPrivate *priv;
+
+    priv = wilqpaint_window_get_instance_private(WILQPAINT_WINDOW(user_data));
+    priv->motionTickId = 0;
+    if( flushPendingMotion(priv) )
+        redrawDrawingArea(priv->drawing);
+    return G_SOURCE_REMOVE;
+}
+
 gboolean on_drawing_motion(GtkWidget *widget, GdkEventMotion *event,
                gpointer user_data)
 {
     WilqpaintWindow *win;
     WilqpaintWindowPrivate *priv;
+    PendingMotion motion;
     gdouble evX, evY;
 
     win = WILQPAINT_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(widget)));
@@ -950,29 +1198,20 @@ gboolean on_drawing_motion(GtkWidget *widget, GdkEventMotion *event,
     if( event->state & GDK_BUTTON1_MASK ) {
         switch( priv->curAction ) {
         case MA_LAYOUT:
-            evX = grid_getSnapXValue(priv->gopts,
-                    mapXValue(priv, event->x, MDP_TO_DRAWIMAGE)
-                    - priv->snapXoffset, priv->curZoom) + priv->snapXoffset;
-            evY = grid_getSnapYValue(priv->gopts,
-                    mapYValue(priv, event->y, MDP_TO_DRAWIMAGE)
-                    - priv->snapYoffset, priv->curZoom) + priv->snapYoffset;
-            di_selectionDragTo(priv->drawImage, evX, evY,
-                    event->state & GDK_SHIFT_MASK);
-            priv->lastEvX = evX;
-            priv->lastEvY = evY;
-            break;
         case MA_MOVEIMAGE:
-            evX = mapXValue(priv, event->x, MDP_TO_DRAWIMAGE_SNAPPED);
-            evY = mapYValue(priv, event->y, MDP_TO_DRAWIMAGE_SNAPPED);
-            di_moveTo(priv->drawImage, evX - priv->moveXref,
-                    evY - priv->moveYref);
-            break;
         case MA_SELECTAREA:
-            evX = mapXValue(priv, event->x, MDP_TO_DRAWIMAGE);
-            evY = mapYValue(priv, event->y, MDP_TO_DRAWIMAGE);
-            priv->selWidth = evX - priv->selXbeg;
-            priv->selHeight = evY - priv->selYbeg;
-            di_selectionFromRect(priv->drawImage, evX, evY);
+            motion.x = event->x;
+            motion.y = event->y;
+            motion.state = event->state;
+            /* only the last position matters, unless drawing freeform */
+            if( priv->isFreeformCapture || priv->pendingMotion->len == 0 )
+                g_array_append_val(priv->pendingMotion, motion);
+            else
+                g_array_index(priv->pendingMotion, PendingMotion,
+                        priv->pendingMotion->len - 1) = motion;
+            if( priv->motionTickId == 0 )
+                priv->motionTickId = gtk_widget_add_tick_callback(
+                        priv->drawing, onMotionTick, win, NULL);
             break;
         case MA_LOUPE:
             evX = mapXValue(priv, event->x, MDP_COMPENSATE_OFFSET);
@@ -989,9 +1228,11 @@ gboolean on_drawing_motion(GtkWidget *widget, GdkEventMotion *event,
                 gtk_adjustment_set_value(adj, priv->loupeYFixed - evY
                         + gtk_adjustment_get_value(adj));
             }
+            redrawDrawingArea(priv->drawing);
+            break;
+        default:
             break;
         }
-        redrawDrawingArea(priv->drawing);
     }
     return GDK_EVENT_STOP;
 }
@@ -1005,6 +1246,14 @@ gboolean on_drawing_button_release(GtkWidget *widget, GdkEventButton *event,
 
     win = WILQPAINT_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(widget)));
     priv = wilqpaint_window_get_instance_private(win);
+    if( flushPendingMotion(priv) )
+        redrawDrawingArea(priv->drawing);
+    if( priv->isFreeformCapture ) {
+        gdk_window_set_event_compression(gtk_widget_get_window(widget), TRUE);
+        priv->isFreeformCapture = FALSE;
+        di_finishCapture(priv->drawImage);
+        redrawDrawingArea(priv->drawing);
+    }
     if( priv->curAction == MA_LOUPE && (event->button == 3 ||
             event->time - priv->loupePressTime < 200 &&
             (event->x_root - priv->loupeXpress)
@@ -1030,7 +1279,12 @@ gboolean on_drawing_button_release(GtkWidget *widget, GdkEventButton *event,
         priv->loupeXFixed = evX * zoomFact;
         priv->loupeYFixed = evY * zoomFact;
     }
+    if( priv->curAction == MA_LAYOUT )
+        debugDump(priv);
     priv->curAction = MA_NONE;
+    /* render in full quality tiles drawn during drag */
+    if( tc_isSourceDraft(priv->tileCache) )
+        redrawDrawingArea(priv->drawing);
 }
 
 gboolean on_drawing_keypress(GtkWidget *widget, GdkEventKey *event,
@@ -1049,6 +1303,7 @@ gboolean on_drawing_keypress(GtkWidget *widget, GdkEventKey *event,
     case GDK_KEY_Shift_L:
     case GDK_KEY_Shift_R:
         if( priv->curAction == MA_LAYOUT && event->state & GDK_BUTTON1_MASK ) {
+            flushPendingMotion(priv);
             di_selectionDragTo(priv->drawImage, priv->lastEvX,
                     priv->lastEvY, TRUE);
             redrawDrawingArea(priv->drawing);
@@ -1072,6 +1327,7 @@ gboolean on_drawing_keyrelease(GtkWidget *widget, GdkEventKey *event,
     case GDK_KEY_Shift_L:
     case GDK_KEY_Shift_R:
         if( priv->curAction == MA_LAYOUT && event->state & GDK_BUTTON1_MASK ) {
+            flushPendingMotion(priv);
             di_selectionDragTo(priv->drawImage, priv->lastEvX,
                     priv->lastEvY, FALSE);
             redrawDrawingArea(priv->drawing);
@@ -1083,9 +1339,72 @@ gboolean on_drawing_keyrelease(GtkWidget *widget, GdkEventKey *event,
     return GDK_EVENT_PROPAGATE;
 }
 
+/* Returns mask of grid points, repeated with grid period. The pattern
+ * is cached until grid parameters change. Returns NULL when the period
+ * is not an integer number of pixels or is too large for a tile.
+ */
+static cairo_pattern_t *getGridPattern(WilqpaintWindowPrivate *priv,
+        cairo_t *cr, gdouble scale, gdouble xOffset, gdouble yOffset)
+{
+    cairo_surface_t *tile;
+    cairo_t *tileCr;
+    gdouble deviceScale, deviceYScale, dotSize, dotX, dotY;
+    gint tileSize, i, j;
+
+    tileSize = round(scale);
+    if( fabs(scale - tileSize) > 1e-6 || tileSize > GRID_TILE_MAX )
+        return NULL;
+    cairo_surface_get_device_scale(cairo_get_target(cr), &deviceScale,
+            &deviceYScale);
+    if( priv->gridCache.pattern != NULL && priv->gridCache.scale == scale
+            && priv->gridCache.xOffset == xOffset
+            && priv->gridCache.yOffset == yOffset
+            && priv->gridCache.deviceScale == deviceScale )
+        return priv->gridCache.pattern;
+    if( priv->gridCache.pattern != NULL )
+        cairo_pattern_destroy(priv->gridCache.pattern);
+    tile = cairo_surface_create_similar(cairo_get_target(cr),
+            CAIRO_CONTENT_ALPHA, tileSize, tileSize);
+    tileCr = cairo_create(tile);
+    dotSize = scale < 32 ? 1 : 2;
+    dotX = fmod(xOffset, tileSize) - 0.5 * dotSize;
+    dotY = fmod(yOffset, tileSize) - 0.5 * dotSize;
+    /* the dot may cross tile edges */
+    for(i = -1; i <= 1; ++i) {
+        for(j = -1; j <= 1; ++j)
+            cairo_rectangle(tileCr, dotX + i * tileSize, dotY + j * tileSize,
+                    dotSize, dotSize);
+    }
+    cairo_fill(tileCr);
+    cairo_destroy(tileCr);
+    priv->gridCache.pattern = cairo_pattern_create_for_surface(tile);
+    cairo_surface_destroy(tile);
+    cairo_pattern_set_extend(priv->gridCache.pattern, CAIRO_EXTEND_REPEAT);
+    cairo_pattern_set_filter(priv->gridCache.pattern, CAIRO_FILTER_NEAREST);
+    priv->gridCache.scale = scale;
+    priv->gridCache.xOffset = xOffset;
+    priv->gridCache.yOffset = yOffset;
+    priv->gridCache.deviceScale = deviceScale;
+    return priv->gridCache.pattern;
+}
+
+static void drawImageTile(cairo_t *cr, gdouble zoom, gpointer drawImage)
+{
+    di_draw(drawImage, cr, zoom);
+}
+
+static void drawSnapshotTile(cairo_t *cr, gdouble zoom, gpointer snapshot)
+{
+    di_snapshotDraw(snapshot, cr, zoom);
+}
+
 gboolean on_drawing_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
 {
     gdouble i, scale, imgWidth, imgHeight, gridXOffset, gridYOffset, dashes[2];
+    gdouble clipX1, clipY1, clipX2, clipY2, yBeg, yEnd;
+    cairo_pattern_t *gridPattern;
+    cairo_region_t *dirtyRegion;
+    gboolean isImageChanged, isFast;
     gint drawingWidth, drawingHeight;
     WilqpaintWindow *win;
     WilqpaintWindowPrivate *priv;
@@ -1107,27 +1426,75 @@ gboolean on_drawing_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
         cairo_stroke_preserve(cr);
         cairo_clip(cr);
     }
-    di_draw(priv->drawImage, cr, priv->curZoom);
+    if( priv->isFreeformCapture ) {
+        di_drawCapture(priv->drawImage, cr, priv->curZoom);
+    }else{
+        dirtyRegion = di_takeDirtyRegion(priv->drawImage);
+        isImageChanged = dirtyRegion == NULL
+            || ! cairo_region_is_empty(dirtyRegion);
+        if( dirtyRegion != NULL ) {
+            tc_invalidateRegion(priv->tileCache, dirtyRegion);
+            cairo_region_destroy(dirtyRegion);
+        }else
+            tc_invalidateAll(priv->tileCache);
+        if( di_isPreviewActive(priv->drawImage) ) {
+            /* the preview changes in place, so it is not in snapshots */
+            tc_drawSync(priv->tileCache, cr, priv->curZoom, ceil(imgWidth),
+                    ceil(imgHeight), drawImageTile, priv->drawImage);
+        }else{
+            /* lower quality while mouse is dragged */
+            isFast = priv->curAction != MA_NONE;
+            if( isImageChanged || ! tc_hasSource(priv->tileCache)
+                    || (tc_isSourceDraft(priv->tileCache) && ! isFast) )
+            {
+                tc_setSource(priv->tileCache,
+                        di_snapshotNew(priv->drawImage, isFast),
+                        drawSnapshotTile, (GDestroyNotify)di_snapshotFree,
+                        isFast);
+            }
+            tc_draw(priv->tileCache, cr, priv->curZoom, ceil(imgWidth),
+                    ceil(imgHeight));
+        }
+    }
     scale = grid_getScale(priv->gopts) * priv->curZoom;
     if( grid_isShow(priv->gopts) && scale > 2 ) {
         gridXOffset = grid_getXOffset(priv->gopts) * priv->curZoom;
         gridYOffset = grid_getYOffset(priv->gopts) * priv->curZoom;
-        if( scale < 32 ) {
-            cairo_set_line_width(cr, 1);
-            dashes[0] = 1;
-            dashes[1] = scale - 1;
-            cairo_set_dash(cr, dashes, 2, scale - gridYOffset + 0.5);
+        gridPattern = getGridPattern(priv, cr, scale, gridXOffset,
+                gridYOffset);
+        if( gridPattern != NULL ) {
+            cairo_save(cr);
+            cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+            cairo_rectangle(cr, 0, 0, imgWidth, imgHeight);
+            cairo_clip(cr);
+            cairo_mask(cr, gridPattern);
+            cairo_restore(cr);
         }else{
-            cairo_set_line_width(cr, 2);
-            dashes[0] = 2;
-            dashes[1] = scale - 2;
-            cairo_set_dash(cr, dashes, 2, scale - gridYOffset + 1);
-        }
-        cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
-        for(i = gridXOffset; i <= imgWidth; i += scale) {
-            cairo_move_to(cr, i, 0);
-            cairo_line_to(cr, i, imgHeight);
-            cairo_stroke(cr);
+            /* draw only lines in exposed area */
+            cairo_clip_extents(cr, &clipX1, &clipY1, &clipX2, &clipY2);
+            yBeg = fmax(clipY1 - 2, 0);
+            yEnd = fmin(clipY2 + 2, imgHeight);
+            if( scale < 32 ) {
+                cairo_set_line_width(cr, 1);
+                dashes[0] = 1;
+                dashes[1] = scale - 1;
+                cairo_set_dash(cr, dashes, 2,
+                        scale - gridYOffset + 0.5 + yBeg);
+            }else{
+                cairo_set_line_width(cr, 2);
+                dashes[0] = 2;
+                dashes[1] = scale - 2;
+                cairo_set_dash(cr, dashes, 2, scale - gridYOffset + 1 + yBeg);
+            }
+            cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+            i = gridXOffset + fmax(ceil((clipX1 - 2 - gridXOffset) / scale), 0)
+                * scale;
+            for(; i <= fmin(clipX2 + 2, imgWidth); i += scale) {
+                cairo_move_to(cr, i, yBeg);
+                cairo_line_to(cr, i, yEnd);
+                cairo_stroke(cr);
+            }
+            cairo_set_dash(cr, NULL, 0, 0);
         }
     }
     if( priv->selWidth != 0 || priv->selHeight != 0 ) {
@@ -1331,7 +1698,8 @@ static gboolean saveChanges(WilqpaintWindow *win,
     if( priv->curFileName == NULL || forceChooseFileName
             || !imgtype_isWritableByFileName(priv->curFileName) )
     {
-        char *fname = showSaveFileDialog(GTK_WINDOW(win), priv->curFileName);
+        char *fname = showSaveFileDialog(GTK_WINDOW(win), priv->curFileName,
+                &priv->isBaseImageLinked);
         if( fname ) {
             setCurFileName(win, fname);
             g_free(fname);
@@ -1340,7 +1708,8 @@ static gboolean saveChanges(WilqpaintWindow *win,
     }
     if( doSave ) {
         gchar *err;
-        doSave = imgfile_save(priv->drawImage, priv->curFileName, &err);
+        doSave = imgfile_save(priv->drawImage, priv->curFileName,
+                priv->isBaseImageLinked, &err);
         if( ! doSave ) {
             GtkWidget *messageDialog = gtk_message_dialog_new(
                     GTK_WINDOW(win), GTK_DIALOG_MODAL, GTK_MESSAGE_ERROR,
@@ -1362,6 +1731,8 @@ static void setCurDrawImage(WilqpaintWindow *win, const char *fileName,
     if( priv->drawImage != NULL )
         di_free(priv->drawImage);
     priv->drawImage = newDrawImg;
+    tc_clear(priv->tileCache);
+    di_setPickBufferEnabled(newDrawImg, priv->usePickBuffer);
     setCurFileName(win, fileName);
     setZoom1x(win);
     adjustBackgroundColorControl(priv);
@@ -1369,6 +1740,7 @@ static void setCurDrawImage(WilqpaintWindow *win, const char *fileName,
     gtk_spin_button_set_value(priv->spinImageWidth, di_getWidth(newDrawImg));
     gtk_spin_button_set_value(priv->spinImageHeight, di_getHeight(newDrawImg));
     --priv->shapeControlsSetInProgress;
+    debugDump(priv);
 }
 
 static void newFile(WilqpaintWindow *win,
@@ -1382,7 +1754,7 @@ static void newFile(WilqpaintWindow *win,
         imgWidth = di_getWidth(priv->drawImage);
         imgHeight = di_getHeight(priv->drawImage);
         if( ! showSizeDialog(GTK_WINDOW(win), "New Image - wilqpaint",
-                    &imgWidth, &imgHeight, FALSE) )
+                    &imgWidth, &imgHeight, FALSE, NULL) )
             return;
     }
     newDrawImg = di_new(imgWidth, imgHeight, NULL);
@@ -1453,6 +1825,31 @@ static void on_menu_from_clipboard_cb(GtkClipboard *clipboard,
     }
 }
 
+/* Pastes image copied from wilqpaint, with shapes kept editable. When the
+ * clipboard does not contain such image, requests a bitmap.
+ */
+static void on_menu_from_clipboard_wlq_cb(GtkClipboard *clipboard,
+        GtkSelectionData *selData, gpointer data)
+{
+    const guchar *wlqData = gtk_selection_data_get_data(selData);
+    gint length = gtk_selection_data_get_length(selData);
+    GInputStream *inStrm;
+    DrawImage *newDrawImg = NULL;
+    gchar *errMsg = NULL;
+
+    if( length > 0 ) {
+        inStrm = g_memory_input_stream_new_from_data(wlqData, length, NULL);
+        newDrawImg = di_openWLQStream(inStrm, "clipboard", &errMsg);
+        g_object_unref(inStrm);
+        g_free(errMsg);
+    }
+    if( newDrawImg != NULL )
+        setCurDrawImage(WILQPAINT_WINDOW(data), NULL, newDrawImg);
+    else
+        gtk_clipboard_request_image(clipboard, on_menu_from_clipboard_cb,
+                data);
+}
+
 static void on_menu_from_clipboard(GSimpleAction *action, GVariant *parameter,
         gpointer window)
 {
@@ -1461,7 +1858,9 @@ static void on_menu_from_clipboard(GSimpleAction *action, GVariant *parameter,
         return;
     GtkClipboard *clipboard = gtk_widget_get_clipboard(GTK_WIDGET(win),
             GDK_SELECTION_CLIPBOARD);
-    gtk_clipboard_request_image(clipboard, on_menu_from_clipboard_cb, window);
+    gtk_clipboard_request_contents(clipboard,
+            gdk_atom_intern_static_string(CLIPBOARD_WLQ_TARGET),
+            on_menu_from_clipboard_wlq_cb, window);
 }
 
 static void on_menu_saveas(GSimpleAction *action, GVariant *parameter,
@@ -1476,19 +1875,89 @@ static void on_menu_save(GSimpleAction *action, GVariant *parameter,
     saveChanges(WILQPAINT_WINDOW(window), FALSE, FALSE);
 }
 
+/* Image offered on clipboard. The image is rendered when requested.
+ */
+typedef struct {
+    DrawImageSnapshot *snapshot;
+    GdkPixbuf *pixbuf;          /* rendered on first request */
+} ClipboardImage;
+
+static void onClipboardGet(GtkClipboard *clipboard,
+        GtkSelectionData *selData, guint info, gpointer data)
+{
+    ClipboardImage *clipImg = data;
+    GOutputStream *outStrm;
+    GBytes *bytes;
+    gchar *errMsg = NULL;
+
+    if( info == CLIPBOARD_INFO_WLQ ) {
+        outStrm = g_memory_output_stream_new_resizable();
+        if( di_snapshotWriteWLQ(clipImg->snapshot, outStrm, &errMsg) ) {
+            bytes = g_memory_output_stream_steal_as_bytes(
+                    G_MEMORY_OUTPUT_STREAM(outStrm));
+            gtk_selection_data_set(selData,
+                    gdk_atom_intern_static_string(CLIPBOARD_WLQ_TARGET), 8,
+                    g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes));
+            g_bytes_unref(bytes);
+        }else
+            g_free(errMsg);
+        g_object_unref(outStrm);
+    }else{
+        if( clipImg->pixbuf == NULL )
+            clipImg->pixbuf = di_snapshotToPixbuf(clipImg->snapshot);
+        /* on failure the selection is left unset, the request is refused */
+        if( clipImg->pixbuf != NULL )
+            gtk_selection_data_set_pixbuf(selData, clipImg->pixbuf);
+    }
+}
+
+static void onClipboardClear(GtkClipboard *clipboard, gpointer data)
+{
+    ClipboardImage *clipImg = data;
+
+    di_snapshotFree(clipImg->snapshot);
+    if( clipImg->pixbuf != NULL )
+        g_object_unref(clipImg->pixbuf);
+    g_free(clipImg);
+}
+
 static void on_menu_to_clipboard(GSimpleAction *action, GVariant *parameter,
         gpointer win)
 {
+    /* clipboard manager keeps a bitmap after the program exits */
+    static const GtkTargetEntry storeTargets[] = {
+        { "image/png", 0, CLIPBOARD_INFO_IMAGE }
+    };
     WilqpaintWindowPrivate *priv;
+    GtkTargetList *targetList;
+    GtkTargetEntry *targets;
+    ClipboardImage *clipImg;
+    gint targetCount;
 
     priv = wilqpaint_window_get_instance_private(win);
     if( priv->drawImage != NULL ) {
         GtkClipboard *clipboard = gtk_widget_get_clipboard(GTK_WIDGET(win),
                 GDK_SELECTION_CLIPBOARD);
         di_selectionSetEmpty(priv->drawImage);
-        GdkPixbuf *pixbuf = di_toPixbuf(priv->drawImage);
-        gtk_clipboard_set_image(clipboard, pixbuf);
-        g_object_unref(G_OBJECT(pixbuf));
+        clipImg = g_malloc(sizeof(ClipboardImage));
+        clipImg->snapshot = di_snapshotNew(priv->drawImage, FALSE);
+        clipImg->pixbuf = NULL;
+        targetList = gtk_target_list_new(NULL, 0);
+        gtk_target_list_add(targetList,
+                gdk_atom_intern_static_string(CLIPBOARD_WLQ_TARGET), 0,
+                CLIPBOARD_INFO_WLQ);
+        gtk_target_list_add_image_targets(targetList, CLIPBOARD_INFO_IMAGE,
+                TRUE);
+        targets = gtk_target_table_new_from_list(targetList, &targetCount);
+        if( gtk_clipboard_set_with_data(clipboard, targets, targetCount,
+                    onClipboardGet, onClipboardClear, clipImg) )
+        {
+            gtk_clipboard_set_can_store(clipboard, storeTargets,
+                    G_N_ELEMENTS(storeTargets));
+        }else
+            onClipboardClear(clipboard, clipImg);
+        gtk_target_table_free(targets, targetCount);
+        gtk_target_list_unref(targetList);
     }
 }
 
@@ -1513,6 +1982,7 @@ static void on_menu_edit_undo(GSimpleAction *action, GVariant *parameter,
     else
         redrawDrawingArea(priv->drawing);
     adjustBackgroundColorControl(priv);
+    debugDump(priv);
 }
 
 static void on_menu_edit_redo(GSimpleAction *action, GVariant *parameter,
@@ -1531,22 +2001,47 @@ static void on_menu_edit_redo(GSimpleAction *action, GVariant *parameter,
     else
         redrawDrawingArea(priv->drawing);
     adjustBackgroundColorControl(priv);
+    debugDump(priv);
+}
+
+static void on_menu_select_all(GSimpleAction *action, GVariant *parameter,
+        gpointer window)
+{
+    WilqpaintWindowPrivate *priv;
+
+    priv = wilqpaint_window_get_instance_private(WILQPAINT_WINDOW(window));
+    gtk_toggle_button_set_active(priv->shapeSelect, TRUE);
+    if( di_selectAll(priv->drawImage) )
+        redrawDrawingArea(priv->drawing);
 }
 
 static void on_menu_image_scale(GSimpleAction *action, GVariant *parameter,
         gpointer window)
 {
+    static ImageScaleFilter filter = ISF_LANCZOS3;
     gdouble imgWidth, imgHeight;
     WilqpaintWindowPrivate *priv;
+    GtkWidget *messageDialog;
+    gchar *err;
 
     priv = wilqpaint_window_get_instance_private(WILQPAINT_WINDOW(window));
     imgWidth = di_getWidth(priv->drawImage);
     imgHeight = di_getHeight(priv->drawImage);
     if( showSizeDialog(GTK_WINDOW(window), "Scale image - wilqpaint",
-                &imgWidth, &imgHeight, TRUE) )
+                &imgWidth, &imgHeight, TRUE, &filter) )
     {
-        di_scale(priv->drawImage, imgWidth / di_getWidth(priv->drawImage));
-        adjustDrawingSize(priv, TRUE);
+        if( di_scale(priv->drawImage,
+                    imgWidth / di_getWidth(priv->drawImage), filter, &err) )
+        {
+            adjustDrawingSize(priv, TRUE);
+        }else{
+            messageDialog = gtk_message_dialog_new(GTK_WINDOW(window),
+                    GTK_DIALOG_MODAL, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+                    "%s", err);
+            gtk_dialog_run(GTK_DIALOG(messageDialog));
+            gtk_widget_destroy(GTK_WIDGET(messageDialog));
+            g_free(err);
+        }
     }
 }
 
@@ -1654,6 +2149,45 @@ static void menu_grid_snap (GSimpleAction *action, GVariant *state,
     g_simple_action_set_state(action, state);
 }
 
+static void menu_simplify_freeform(GSimpleAction *action, GVariant *state,
+        gpointer window)
+{
+    WilqpaintWindowPrivate *priv;
+
+    priv = wilqpaint_window_get_instance_private(WILQPAINT_WINDOW(window));
+    priv->simplifyFreeform = g_variant_get_boolean(state);
+    g_simple_action_set_state(action, state);
+}
+
+static void menu_pick_buffer(GSimpleAction *action, GVariant *state,
+        gpointer window)
+{
+    WilqpaintWindowPrivate *priv;
+
+    priv = wilqpaint_window_get_instance_private(WILQPAINT_WINDOW(window));
+    priv->usePickBuffer = g_variant_get_boolean(state);
+    if( priv->drawImage != NULL )
+        di_setPickBufferEnabled(priv->drawImage, priv->usePickBuffer);
+    g_simple_action_set_state(action, state);
+}
+
+static void on_menu_memory_report(GSimpleAction *action, GVariant *parameter,
+        gpointer window)
+{
+    WilqpaintWindowPrivate *priv;
+    GtkWidget *messageDialog;
+    gchar *report;
+
+    priv = wilqpaint_window_get_instance_private(WILQPAINT_WINDOW(window));
+    report = di_getMemoryReport(priv->drawImage);
+    messageDialog = gtk_message_dialog_new(
+            GTK_WINDOW(window), GTK_DIALOG_MODAL, GTK_MESSAGE_INFO,
+            GTK_BUTTONS_CLOSE, "%s", report);
+    gtk_dialog_run(GTK_DIALOG(messageDialog));
+    gtk_widget_destroy(GTK_WIDGET(messageDialog));
+    g_free(report);
+}
+
 static void on_menu_about(GSimpleAction *action, GVariant *parameter,
         gpointer window)
 {
@@ -1675,6 +2209,7 @@ WilqpaintWindow *wilqpaint_windowNew(GtkApplication *app, const char *fileName)
         /* Edit */
         { "edit-undo", on_menu_edit_undo, NULL, NULL, NULL },
         { "edit-redo", on_menu_edit_redo, NULL, NULL, NULL },
+        { "select-all", on_menu_select_all, NULL, NULL, NULL },
         { "image-scale", on_menu_image_scale, NULL, NULL, NULL },
         { "rotate180", on_menu_image_rotate180, NULL, NULL, NULL },
         { "image-threshold", on_menu_image_threshold, NULL, NULL, NULL },
@@ -1682,7 +2217,10 @@ WilqpaintWindow *wilqpaint_windowNew(GtkApplication *app, const char *fileName)
         { "grid-options", on_menu_grid_options, NULL, NULL, NULL },
         { "grid-show", NULL, NULL, "false", menu_grid_show },
         { "snap", NULL, "s", "'1pxCenter'", menu_grid_snap },
+        { "simplify-freeform", NULL, NULL, "false", menu_simplify_freeform },
+        { "pick-buffer", NULL, NULL, "false", menu_pick_buffer },
         /* Help */
+        { "memory-report", on_menu_memory_report, NULL, NULL, NULL },
         { "help-about",  on_menu_about,  NULL, NULL, NULL }
     };
     gint imgWidth, imgHeight;
@@ -23,48 +23,58 @@ static gchar *gerrorToErrStr(GError *gerr)
     return errStr;
 }
 
+WlqInFile *wlq_openInStream(GInputStream *inStrm, const char *name,
+        gchar **errLoc)
+{
+    WlqInFile *inFile;
+    char magic[sizeof(wlqmagic)];
+    GConverter *conv;
+    unsigned version;
+    gboolean isValid = FALSE;
+
+    inFile = g_malloc(sizeof(WlqInFile));
+    inFile->inStrm = g_object_ref(inStrm);
+    inFile->fileName = g_strdup(name);
+    if( wlq_read(inFile, magic, sizeof(magic), errLoc) ) {
+        if( memcmp(magic, wlqmagic, sizeof(wlqmagic)) ) {
+            *errLoc = g_strdup_printf("%s: file is corrupted", name);
+        }else if( wlq_readU32(inFile, &version, errLoc) ) {
+            if( version == 0 ) {
+                isValid = TRUE;
+            }else{
+                *errLoc = g_strdup_printf("%s: file is in newer version "
+                       " than supported by this program.", name);
+            }
+        }
+    }
+    if( isValid ) {
+        conv = G_CONVERTER(g_zlib_decompressor_new(
+                    G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+        inFile->inStrm = G_INPUT_STREAM(g_converter_input_stream_new(
+                    inStrm, conv));
+        g_object_unref(inStrm);
+        g_object_unref(conv);
+    }else{
+        wlq_closeIn(inFile);
+        inFile = NULL;
+    }
+    return inFile;
+}
+
 WlqInFile *wlq_openIn(const char *fileName, gchar **errLoc,
         gboolean *isNoEntErr)
 {
     GFile *gf;
     GFileInputStream *inStrm;
     WlqInFile *inFile = NULL;
-    char magic[sizeof(wlqmagic)];
-    GConverter *conv;
-    unsigned version;
     GError *gerr = NULL;
 
     gf = g_file_new_for_path(fileName);
     inStrm = g_file_read(gf, NULL, &gerr);
     g_object_unref(gf);
     if( inStrm != NULL ) {
-        inFile = g_malloc(sizeof(WlqInFile));
-        inFile->inStrm = G_INPUT_STREAM(inStrm);
-        inFile->fileName = g_strdup(fileName);
-        gboolean isValid = FALSE;
-        if( wlq_read(inFile, magic, sizeof(magic), errLoc) ) {
-            if( memcmp(magic, wlqmagic, sizeof(wlqmagic)) ) {
-                *errLoc = g_strdup_printf("%s: file is corrupted", fileName);
-            }else if( wlq_readU32(inFile, &version, errLoc) ) {
-                if( version == 0 ) {
-                    isValid = TRUE;
-                }else{
-                    *errLoc = g_strdup_printf("%s: file is in newer version "
-                           " than supported by this program.", fileName);
-                }
-            }
-        }
-        if( isValid ) {
-            conv = G_CONVERTER(g_zlib_decompressor_new(
-                        G_ZLIB_COMPRESSOR_FORMAT_GZIP));
-            inFile->inStrm = G_INPUT_STREAM(g_converter_input_stream_new(
-                        inFile->inStrm, conv));
-            g_object_unref(inStrm);
-            g_object_unref(conv);
-        }else{
-            wlq_closeIn(inFile);
-            inFile = NULL;
-        }
+        inFile = wlq_openInStream(G_INPUT_STREAM(inStrm), fileName, errLoc);
+        g_object_unref(inStrm);
         *isNoEntErr = FALSE;
     }else{
         *isNoEntErr = g_error_matches(gerr, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)
@@ -74,33 +84,41 @@ WlqInFile *wlq_openIn(const char *fileName, gchar **errLoc,
     return inFile;
 }
 
+WlqOutFile *wlq_openOutStream(GOutputStream *outStrm, gchar **errLoc)
+{
+    WlqOutFile *outFile;
+    GConverter *conv;
+
+    outFile = g_malloc(sizeof(WlqOutFile));
+    outFile->outStrm = g_object_ref(outStrm);
+    if( wlq_write(outFile, wlqmagic, sizeof(wlqmagic), errLoc) &&
+            wlq_writeU32(outFile, 0, errLoc) )    /* version */
+    {
+        conv = G_CONVERTER(g_zlib_compressor_new(
+                    G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+        outFile->outStrm = g_converter_output_stream_new(outStrm, conv);
+        g_object_unref(outStrm);
+        g_object_unref(conv);
+    }else{
+        wlq_closeOut(outFile);
+        outFile = NULL;
+    }
+    return outFile;
+}
+
 WlqOutFile *wlq_openOut(const char *fileName, gchar **errLoc)
 {
     GFile *gf;
     GFileOutputStream *outStrm;
     WlqOutFile *outFile = NULL;
-    GConverter *conv;
     GError *gerr = NULL;
 
     gf = g_file_new_for_path(fileName);
     outStrm = g_file_replace(gf, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &gerr);
     g_object_unref(gf);
     if( outStrm != NULL ) {
-        outFile = g_malloc(sizeof(WlqOutFile));
-        outFile->outStrm = G_OUTPUT_STREAM(outStrm);
-        if( wlq_write(outFile, wlqmagic, sizeof(wlqmagic), errLoc) &&
-                wlq_writeU32(outFile, 0, errLoc) )    /* version */
-        {
-            conv = G_CONVERTER(g_zlib_compressor_new(
-                        G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
-            outFile->outStrm = g_converter_output_stream_new(
-                    outFile->outStrm, conv);
-            g_object_unref(outStrm);
-            g_object_unref(conv);
-        }else{
-            wlq_closeOut(outFile);
-            outFile = NULL;
-        }
+        outFile = wlq_openOutStream(G_OUTPUT_STREAM(outStrm), errLoc);
+        g_object_unref(outStrm);
     }else
         *errLoc = gerrorToErrStr(gerr);
     return outFile;
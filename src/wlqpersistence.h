@@ -10,6 +10,12 @@ WlqInFile *wlq_openIn(const char *fileName, gchar **errLoc,
         gboolean *isNoEntErr);
 WlqOutFile *wlq_openOut(const char *fileName, gchar **errLoc);
 
+/* Like wlq_openIn and wlq_openOut, but read from or write to the given
+ * stream. The name is used in error messages.
+ */
+WlqInFile *wlq_openInStream(GInputStream*, const char *name, gchar **errLoc);
+WlqOutFile *wlq_openOutStream(GOutputStream*, gchar **errLoc);
+
 const char *wlq_getInFileName(const WlqInFile*);
 
 gboolean wlq_read(WlqInFile*, void *buf, gsize size, gchar **errLoc);